@@ -84,6 +84,50 @@ macro(generate_qmf_schemas SCHEMAS SCHEMA_SOURCES)
 endmacro(generate_qmf_schemas)
 
 
+# This macro will generate QMF definition files from QMF schema at build
+# time, for schemas which are themselves generated, e.g. by merge_qmf_schemas
+# Argument SCHEMA - path to XML schema file
+# Remaining arguments - paths of the generated files
+macro(generate_qmf_sources SCHEMA)
+    add_custom_command(
+        OUTPUT ${ARGN}
+        COMMAND ${QMFGEN} -2 -o ./qmf ${SCHEMA}
+        DEPENDS ${SCHEMA}
+        WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+        COMMENT "Generating QMFv2 classes from ${SCHEMA}"
+        VERBATIM
+    )
+endmacro(generate_qmf_sources)
+
+# This macro will merge several QMF schemas of the same package into one
+# at build time
+# Argument OUTPUT - path of the merged XML schema file
+# Remaining arguments - paths to XML schema files to merge
+macro(merge_qmf_schemas OUTPUT)
+    find_file(XSLTPROC xsltproc)
+    find_file(MERGE_SCHEMAS merge-schemas.xsl
+              ${CMAKE_CURRENT_SOURCE_DIR}/..
+              /usr/share/matahari)
+
+    # Only touched when the list changes, so it does not force a merge
+    set(schema_list ${CMAKE_CURRENT_BINARY_DIR}/schemas.xml)
+    file(WRITE ${schema_list}.tmp "<schemas>\n")
+    foreach (schema_file ${ARGN})
+        file(APPEND ${schema_list}.tmp "    <file href=\"${schema_file}\"/>\n")
+    endforeach (schema_file ${ARGN})
+    file(APPEND ${schema_list}.tmp "</schemas>\n")
+    configure_file(${schema_list}.tmp ${schema_list} COPYONLY)
+
+    add_custom_command(
+        OUTPUT ${OUTPUT}
+        COMMAND ${XSLTPROC} --output ${OUTPUT} ${MERGE_SCHEMAS} ${schema_list}
+        DEPENDS ${ARGN} ${MERGE_SCHEMAS} ${schema_list}
+        WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+        COMMENT "Merging QMF schemas into ${OUTPUT}"
+        VERBATIM
+    )
+endmacro(merge_qmf_schemas)
+
 # This macro takes schema XML file and check if there are PolicyKit action
 # for each property/statistic/method in .policy file in current directory.
 # Name of the file must be (Package from schema).(Class from schema).policy
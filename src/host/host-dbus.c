@@ -24,11 +24,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
 
 #include "matahari/dbus_common.h"
 
 /* Host methods */
 #include "matahari/host.h"
+#include "matahari/logging.h"
 
 /* Generated properties list */
 #include "host-dbus-properties.h"
@@ -119,6 +122,161 @@ Host_set_uuid(Matahari* matahari, const char *lifetime, const char *uuid, DBusGM
     return TRUE;
 }
 
+gboolean
+Host_has_cpu_feature(Matahari* matahari, const char *feature, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".has_cpu_feature", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    dbus_g_method_return(context, mh_host_has_cpu_feature(feature));
+    return TRUE;
+}
+
+gboolean
+Host_get_history(Matahari* matahari, int since, unsigned int resolution,
+                 const char **fields, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".get_history", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // The D-Bus agent sends no heartbeats, so it has no history to return
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_add_alert(Matahari* matahari, const char *name, const char *rule,
+                gdouble hysteresis, unsigned int hold, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".add_alert", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Alerts are checked on heartbeats, which the D-Bus agent doesn't send
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_remove_alert(Matahari* matahari, const char *name,
+                   DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".remove_alert", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Alerts are checked on heartbeats, which the D-Bus agent doesn't send
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_list_alerts(Matahari* matahari, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".list_alerts", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Alerts are checked on heartbeats, which the D-Bus agent doesn't send
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_get_top_processes(Matahari* matahari, unsigned int n, const char *sort,
+                       DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".get_top_processes", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // CPU usage is measured between heartbeats, which the D-Bus agent doesn't send
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_add_pressure_trigger(Matahari* matahari, const char *name, const char *rule,
+                          DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".add_pressure_trigger", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Pressure events are raised over QMF, the D-Bus agent has no events
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_remove_pressure_trigger(Matahari* matahari, const char *name,
+                             DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".remove_pressure_trigger", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Pressure events are raised over QMF, the D-Bus agent has no events
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
+gboolean
+Host_list_pressure_triggers(Matahari* matahari, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(HOST_BUS_NAME ".list_pressure_triggers", &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Pressure events are raised over QMF, the D-Bus agent has no events
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
 gboolean
 Host_set_power_profile(Matahari* matahari, const char *profile, DBusGMethodInvocation *context)
 {
@@ -218,12 +376,217 @@ matahari_set_property(GObject *object, guint property_id, const GValue *value,
     }
 }
 
+/*
+ * Statistics for the property getters.  A client reading all the properties
+ * at once gets them from a single snapshot, taken at most once a second.
+ */
+static const struct mh_host_snapshot *
+host_snapshot(void)
+{
+    static struct mh_host_snapshot snapshot;
+
+    if (snapshot.timestamp != (uint64_t) time(NULL)
+        && mh_host_get_snapshot(&snapshot) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect host statistics");
+    }
+
+    return &snapshot;
+}
+
+static void
+cpu_utilization_add(Dict *dict, const char *cpu,
+                    const struct mh_host_cpu_utilization *util)
+{
+    GValue value = {0, };
+    char key[32];
+
+    g_value_init(&value, G_TYPE_DOUBLE);
+
+    snprintf(key, sizeof(key), "%s.user", cpu);
+    g_value_set_double(&value, util->user);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.system", cpu);
+    g_value_set_double(&value, util->system);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.iowait", cpu);
+    g_value_set_double(&value, util->iowait);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.steal", cpu);
+    g_value_set_double(&value, util->steal);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.idle", cpu);
+    g_value_set_double(&value, util->idle);
+    dict_add(dict, key, &value);
+}
+
+static void
+disk_io_add(Dict *dict, const struct mh_host_disk_io *io)
+{
+    GValue value = {0, };
+    char key[64];
+
+    g_value_init(&value, G_TYPE_DOUBLE);
+
+    snprintf(key, sizeof(key), "%s.reads", io->name);
+    g_value_set_double(&value, io->reads);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.writes", io->name);
+    g_value_set_double(&value, io->writes);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.read_mb", io->name);
+    g_value_set_double(&value, io->read_mb);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.write_mb", io->name);
+    g_value_set_double(&value, io->write_mb);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.queue", io->name);
+    g_value_set_double(&value, io->queue);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.await", io->name);
+    g_value_set_double(&value, io->await);
+    dict_add(dict, key, &value);
+}
+
+static void
+pressure_stall_add(Dict *dict, const char *prefix,
+                   const struct mh_host_pressure_stall *stall)
+{
+    GValue value = {0, };
+    char key[64];
+
+    g_value_init(&value, G_TYPE_DOUBLE);
+
+    snprintf(key, sizeof(key), "%s.avg10", prefix);
+    g_value_set_double(&value, stall->avg10);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.avg60", prefix);
+    g_value_set_double(&value, stall->avg60);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.avg300", prefix);
+    g_value_set_double(&value, stall->avg300);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.total", prefix);
+    g_value_set_double(&value, stall->total);
+    dict_add(dict, key, &value);
+}
+
+static void
+filesystem_add(Dict *dict, const struct mh_host_filesystem *fs)
+{
+    GValue value = {0, };
+    char key[PATH_MAX];
+
+    g_value_init(&value, G_TYPE_UINT64);
+
+    snprintf(key, sizeof(key), "%s.size", fs->mount_point);
+    g_value_set_uint64(&value, fs->size);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.free", fs->mount_point);
+    g_value_set_uint64(&value, fs->free);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.avail", fs->mount_point);
+    g_value_set_uint64(&value, fs->avail);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.inodes", fs->mount_point);
+    g_value_set_uint64(&value, fs->inodes);
+    dict_add(dict, key, &value);
+
+    snprintf(key, sizeof(key), "%s.inodes_free", fs->mount_point);
+    g_value_set_uint64(&value, fs->inodes_free);
+    dict_add(dict, key, &value);
+}
+
+/*
+ * The topology, flattened to "key" and "nodeN.key" / "Ln.key" strings.
+ */
+static void
+topology_add(Dict *dict, const struct mh_host_topology *topology)
+{
+    GValue value = {0, };
+    char key[32], buf[32];
+    unsigned int lpc;
+
+    g_value_init(&value, G_TYPE_STRING);
+
+    snprintf(buf, sizeof(buf), "%u", topology->sockets);
+    g_value_set_string(&value, buf);
+    dict_add(dict, "sockets", &value);
+
+    snprintf(buf, sizeof(buf), "%u", topology->cores);
+    g_value_set_string(&value, buf);
+    dict_add(dict, "cores", &value);
+
+    snprintf(buf, sizeof(buf), "%u", topology->threads);
+    g_value_set_string(&value, buf);
+    dict_add(dict, "threads", &value);
+
+    g_value_set_string(&value, topology->smt ? "true" : "false");
+    dict_add(dict, "smt", &value);
+
+    snprintf(buf, sizeof(buf), "%u", topology->nnodes);
+    g_value_set_string(&value, buf);
+    dict_add(dict, "numa_nodes", &value);
+
+    for (lpc = 0; lpc < topology->nnodes; lpc++) {
+        const struct mh_host_numa_node *node = &topology->nodes[lpc];
+
+        snprintf(key, sizeof(key), "node%u.cpus", node->id);
+        g_value_set_string(&value, node->cpus);
+        dict_add(dict, key, &value);
+
+        snprintf(key, sizeof(key), "node%u.memory", node->id);
+        snprintf(buf, sizeof(buf), "%" G_GUINT64_FORMAT, node->memory);
+        g_value_set_string(&value, buf);
+        dict_add(dict, key, &value);
+    }
+
+    for (lpc = 0; lpc < topology->ncaches; lpc++) {
+        const struct mh_host_cache *cache = &topology->caches[lpc];
+
+        snprintf(key, sizeof(key), "%s.size", cache->name);
+        snprintf(buf, sizeof(buf), "%" G_GUINT64_FORMAT, cache->size);
+        g_value_set_string(&value, buf);
+        dict_add(dict, key, &value);
+
+        snprintf(key, sizeof(key), "%s.shared_cpus", cache->name);
+        g_value_set_string(&value, cache->shared_cpus);
+        dict_add(dict, key, &value);
+    }
+
+    g_value_unset(&value);
+}
+
 void
 matahari_get_property(GObject *object, guint property_id, GValue *value,
                       GParamSpec *pspec)
 {
-    sigar_proc_stat_t procs;
-    sigar_loadavg_t avg;
+    static struct mh_host_cpu_utilization *cpus = NULL;
+    static uint64_t *numa_free_mem = NULL;
+    static struct mh_host_disks *disks = NULL;
+    static struct mh_host_filesystems *filesystems = NULL;
+    const struct mh_host_filesystem *fs;
+    const struct mh_host_disk_io *io;
+    unsigned int count;
+    const struct mh_host_topology *topology;
+    struct mh_host_cpu_utilization total;
+    char cpu[16];
+    int lpc, ncpus;
+    const struct mh_host_snapshot *snapshot;
     Dict *dict;
     GValue value_value = {0, };
 
@@ -261,6 +624,14 @@ matahari_get_property(GObject *object, guint property_id, GValue *value,
     case PROP_HOST_CPU_FLAGS:
         g_value_set_string (value, mh_host_get_cpu_flags());
         break;
+    case PROP_HOST_ISA_LEVEL:
+        g_value_set_string (value, mh_host_get_isa_level());
+        break;
+    case PROP_HOST_TOPOLOGY:
+        dict = dict_new(value);
+        topology_add(dict, mh_host_get_topology());
+        dict_free(dict);
+        break;
     case PROP_HOST_UPDATE_INTERVAL:
         g_value_set_uint (value, priv.update_interval);
         break;
@@ -271,54 +642,145 @@ matahari_get_property(GObject *object, guint property_id, GValue *value,
         // Not used in DBus module
         break;
     case PROP_HOST_FREE_MEM:
-        g_value_set_uint64 (value, mh_host_get_mem_free());
+        g_value_set_uint64 (value, host_snapshot()->mem_free);
         break;
     case PROP_HOST_FREE_SWAP:
-        g_value_set_uint64 (value, mh_host_get_swap_free());
+        g_value_set_uint64 (value, host_snapshot()->swap_free);
         break;
     case PROP_HOST_LOAD:
         // 1/5/15 minute load average - map
-        mh_host_get_load_averages(&avg);
+        snapshot = host_snapshot();
 
         dict = dict_new(value);
         g_value_init (&value_value, G_TYPE_DOUBLE);
 
-        g_value_set_double(&value_value, avg.loadavg[0]);
+        g_value_set_double(&value_value, snapshot->loadavg[0]);
         dict_add(dict, "1", &value_value);
 
-        g_value_set_double(&value_value, avg.loadavg[1]);
+        g_value_set_double(&value_value, snapshot->loadavg[1]);
         dict_add(dict, "5", &value_value);
 
-        g_value_set_double(&value_value, avg.loadavg[2]);
+        g_value_set_double(&value_value, snapshot->loadavg[2]);
         dict_add(dict, "15", &value_value);
         dict_free(dict);
         break;
     case PROP_HOST_PROCESS_STATISTICS:
         // Process statistics is type map string -> int
-        mh_host_get_processes(&procs);
+        snapshot = host_snapshot();
 
         dict = dict_new(value);
         g_value_init (&value_value, G_TYPE_INT);
 
-        g_value_set_int(&value_value, procs.total);
+        g_value_set_int(&value_value, snapshot->procs.total);
         dict_add(dict, "total", &value_value);
 
-        g_value_set_int(&value_value, procs.idle);
+        g_value_set_int(&value_value, snapshot->procs.idle);
         dict_add(dict, "idle", &value_value);
 
-        g_value_set_int(&value_value, procs.zombie);
+        g_value_set_int(&value_value, snapshot->procs.zombie);
         dict_add(dict, "zombie", &value_value);
 
-        g_value_set_int(&value_value, procs.running);
+        g_value_set_int(&value_value, snapshot->procs.running);
         dict_add(dict, "running", &value_value);
 
-        g_value_set_int(&value_value, procs.stopped);
+        g_value_set_int(&value_value, snapshot->procs.stopped);
         dict_add(dict, "stopped", &value_value);
 
-        g_value_set_int(&value_value, procs.sleeping);
+        g_value_set_int(&value_value, snapshot->procs.sleeping);
         dict_add(dict, "sleeping", &value_value);
         dict_free(dict);
         break;
+    case PROP_HOST_CPU_UTILIZATION:
+        // Utilization since the previous get, flattened to "cpu.field"
+        ncpus = mh_host_get_cpu_count();
+        if (!cpus) {
+            cpus = g_new0(struct mh_host_cpu_utilization, ncpus);
+        }
+
+        dict = dict_new(value);
+        if (mh_host_get_cpu_utilization(&total, cpus, ncpus) == MH_RES_SUCCESS) {
+            cpu_utilization_add(dict, "total", &total);
+            for (lpc = 0; lpc < ncpus; lpc++) {
+                snprintf(cpu, sizeof(cpu), "cpu%d", lpc);
+                cpu_utilization_add(dict, cpu, &cpus[lpc]);
+            }
+        }
+        dict_free(dict);
+        break;
+    case PROP_HOST_DISK_IO:
+        // I/O since the previous get, flattened to "device.field"
+        if (!disks) {
+            disks = mh_host_disks_new(0);
+        }
+
+        dict = dict_new(value);
+        if (mh_host_disks_update(disks, &io, &count) == MH_RES_SUCCESS) {
+            for (lpc = 0; lpc < (int) count; lpc++) {
+                disk_io_add(dict, &io[lpc]);
+            }
+        }
+        dict_free(dict);
+        break;
+    case PROP_HOST_FILESYSTEMS:
+        // Flattened to "mount_point.field", without the device and type
+        if (!filesystems) {
+            filesystems = mh_host_filesystems_new(1000);
+        }
+
+        dict = dict_new(value);
+        if (mh_host_filesystems_update(filesystems, &fs, &count) == MH_RES_SUCCESS) {
+            for (lpc = 0; lpc < (int) count; lpc++) {
+                filesystem_add(dict, &fs[lpc]);
+            }
+        }
+        dict_free(dict);
+        break;
+    case PROP_HOST_TOP_PROCESSES:
+        // Not used in DBus module, CPU usage is measured between heartbeats
+        dict = dict_new(value);
+        dict_free(dict);
+        break;
+    case PROP_HOST_PRESSURE:
+        // Flattened to "resource.some.field" and "resource.full.field"
+        dict = dict_new(value);
+        for (lpc = 0; lpc < MH_HOST_PRESSURE_RESOURCES; lpc++) {
+            const char *name = mh_host_pressure_resource_name(lpc);
+            struct mh_host_pressure pressure;
+            char prefix[32];
+
+            if (mh_host_get_pressure(lpc, &pressure) != MH_RES_SUCCESS) {
+                continue;
+            }
+            snprintf(prefix, sizeof(prefix), "%s.some", name);
+            pressure_stall_add(dict, prefix, &pressure.some);
+            snprintf(prefix, sizeof(prefix), "%s.full", name);
+            pressure_stall_add(dict, prefix, &pressure.full);
+        }
+        dict_free(dict);
+        break;
+    case PROP_HOST_NUMA_FREE_MEM:
+        topology = mh_host_get_topology();
+        if (!numa_free_mem) {
+            numa_free_mem = g_new0(uint64_t, topology->nnodes);
+        }
+
+        dict = dict_new(value);
+        if (mh_host_get_numa_free_mem(numa_free_mem,
+                                      topology->nnodes) == MH_RES_SUCCESS) {
+            g_value_init (&value_value, G_TYPE_UINT64);
+            for (lpc = 0; lpc < (int) topology->nnodes; lpc++) {
+                snprintf(cpu, sizeof(cpu), "node%u", topology->nodes[lpc].id);
+                g_value_set_uint64(&value_value, numa_free_mem[lpc]);
+                dict_add(dict, cpu, &value_value);
+            }
+        }
+        dict_free(dict);
+        break;
+    case PROP_HOST_PUBLICATION_STATISTICS:
+        // Not used in DBus module, statistics are read on demand
+        dict = dict_new(value);
+        dict_free(dict);
+        break;
     default:
         /* We don't have any other property... */
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -336,6 +798,30 @@ matahari_dict_type(int prop)
     case PROP_HOST_PROCESS_STATISTICS:
         return G_TYPE_INT;
         break;
+    case PROP_HOST_CPU_UTILIZATION:
+        return G_TYPE_DOUBLE;
+        break;
+    case PROP_HOST_TOPOLOGY:
+        return G_TYPE_STRING;
+        break;
+    case PROP_HOST_DISK_IO:
+        return G_TYPE_DOUBLE;
+        break;
+    case PROP_HOST_FILESYSTEMS:
+        return G_TYPE_UINT64;
+        break;
+    case PROP_HOST_TOP_PROCESSES:
+        return G_TYPE_VALUE;
+        break;
+    case PROP_HOST_PRESSURE:
+        return G_TYPE_DOUBLE;
+        break;
+    case PROP_HOST_NUMA_FREE_MEM:
+        return G_TYPE_UINT64;
+        break;
+    case PROP_HOST_PUBLICATION_STATISTICS:
+        return G_TYPE_UINT64;
+        break;
     default:
         g_printerr("Type of property %s is map of unknown types\n",
                    properties[prop].name);
@@ -348,5 +834,8 @@ main(int argc, char** argv)
 {
     g_type_init();
     priv.update_interval = 5;
+
+    /* Start looking up the Hardware UUID, without waiting for it */
+    mh_host_get_uuid("Hardware");
     return run_dbus_server(HOST_BUS_NAME, HOST_OBJECT_PATH);
 }
@@ -25,12 +25,15 @@
 #include "config.h"
 
 #include <set>
+#include <map>
+#include <vector>
 #include "matahari/agent.h"
 #include <qmf/Data.h>
 #include "qmf/org/matahariproject/QmfPackage.h"
 
 extern "C" {
 #include <string.h>
+#include <time.h>
 #include <sigar.h>
 #include "matahari/host.h"
 #include "matahari/logging.h"
@@ -40,16 +43,39 @@ extern "C" {
 class HostAgent : public MatahariAgent
 {
 public:
+    HostAgent() : _heartbeat_timer(0), _phase(0.0), _refresh_interval(0),
+                  _since_refresh(0), _updates_full(0), _updates_partial(0),
+                  _suppressed(0), _bytes_saved(0), _history(NULL),
+                  _alerts(mh_host_alerts_new()), _disks(NULL),
+                  _filesystems(NULL), _processes(mh_host_processes_new()),
+                  _pressure_triggers(mh_host_pressure_triggers_new(pressure_fired,
+                                                                   this)),
+                  _heartbeat_updated(0), _heartbeat_suppressed(0)
+    {
+    }
+
+    virtual ~HostAgent()
+    {
+        mh_host_history_free(_history);
+        mh_host_alerts_free(_alerts);
+        mh_host_disks_free(_disks);
+        mh_host_filesystems_free(_filesystems);
+        mh_host_processes_free(_processes);
+        mh_host_pressure_triggers_free(_pressure_triggers);
+    }
+
+    virtual void registerSchemas(qmf::AgentSession session);
+    virtual void registerOptions(qpid::types::Variant::Map &options);
     virtual int setup(qmf::AgentSession session);
     virtual gboolean invoke(qmf::AgentSession session, qmf::AgentEvent event,
                             gpointer user_data);
+    virtual void reconnected(qmf::AgentSession session);
 
     /**
      * Send a heartbeat and reset the timer.
      *
-     * This function should be called a single time after the HostAgent
-     * is created.  From then on it will automatically reschedule itself
-     * to be called.
+     * The first heartbeat is scheduled by setup().  From then on this
+     * function automatically reschedules itself.
      *
      * \param[in] data a pointer to the HostAgent
      *
@@ -58,6 +84,27 @@ public:
     static gboolean heartbeat_timer(gpointer data);
 
 private:
+    /**
+     * Time until the next heartbeat.
+     *
+     * Heartbeats are aligned to the wall clock so that they happen at the
+     * same offset ('phase') within every update interval.  This keeps them
+     * from drifting, and different hosts picking different phases keeps the
+     * heartbeats of a fleet spread out over the interval.
+     *
+     * \param[in] interval the update interval, in milliseconds
+     * \param[in] first true if no heartbeat has been sent yet
+     *
+     * \return the number of milliseconds until the next heartbeat
+     */
+    guint heartbeat_delay(uint32_t interval, bool first);
+
+    /** Pending heartbeat timer */
+    guint _heartbeat_timer;
+
+    /** Offset of the heartbeats within the update interval, in [0, 1) */
+    double _phase;
+
     /**
      * Send HostAgent heartbeat.
      *
@@ -69,6 +116,174 @@ private:
      */
     int heartbeat();
 
+    /**
+     * Publish the statistics of a snapshot.
+     *
+     * Only the statistics that changed by more than their tolerance since
+     * they were last published are updated, unless a full refresh is due.
+     *
+     * \param[in] snapshot the current statistics
+     */
+    void publish(const struct mh_host_snapshot &snapshot);
+
+    /**
+     * Publish a statistic if it changed by more than its tolerance.
+     *
+     * Numbers anywhere in the value are compared against the value last
+     * published, relative to the tolerance configured for \p name.  Any
+     * other change, such as a new key, a different string or a different
+     * identifier, is always published.  A due full refresh publishes the
+     * value regardless.
+     *
+     * \param[in] name the property name
+     * \param[in] value the current value
+     *
+     * \retval true the statistic was published
+     * \retval false the statistic was within tolerance and suppressed
+     */
+    bool publishStatistic(const std::string &name,
+                          const qpid::types::Variant &value);
+
+    /**
+     * Account for the statistics published during a heartbeat.
+     *
+     * Called once all statistics of a heartbeat went through
+     * publishStatistic(); updates and publishes the publication counters.
+     */
+    void finishPublication(void);
+
+    /**
+     * Parse the --publish-tolerance and --full-refresh options.
+     */
+    void configurePublication(void);
+
+    /**
+     * Publish the CPU utilization since the previous heartbeat.
+     *
+     * \param[out] total the aggregate utilization
+     *
+     * \retval true the utilization was collected
+     * \retval false failure, total is undefined
+     */
+    bool publishCpuUtilization(struct mh_host_cpu_utilization *total);
+
+    /**
+     * Publish the available memory of each NUMA node.
+     */
+    void publishNumaFreeMem(void);
+
+    /**
+     * Publish the I/O statistics of the block devices.
+     */
+    void publishDiskIO(void);
+
+    /** Block device I/O counters */
+    struct mh_host_disks *_disks;
+
+    /**
+     * Publish the capacity and inode usage of the mounted filesystems.
+     */
+    void publishFilesystems(void);
+
+    /** Mounted filesystems */
+    struct mh_host_filesystems *_filesystems;
+
+    /**
+     * Publish the processes using the most CPU time and memory.
+     */
+    void publishTopProcesses(void);
+
+    /**
+     * Get the top processes, as of the latest heartbeat.
+     *
+     * \param[in] n the number of processes
+     * \param[in] sort how to rank them
+     *
+     * \return a list of process maps, highest first
+     */
+    qpid::types::Variant::List topProcesses(unsigned int n,
+                                            enum mh_host_process_sort sort);
+
+    /** CPU and memory usage of each process */
+    struct mh_host_processes *_processes;
+
+    /**
+     * Publish the pressure stall information of cpu, memory and io.
+     */
+    void publishPressure(void);
+
+    /**
+     * Raise a pressure event.
+     *
+     * Called from the main loop as soon as the kernel fires a trigger.
+     *
+     * \param[in] trigger the trigger
+     * \param[in] userdata a pointer to the HostAgent
+     */
+    static void pressure_fired(const struct mh_host_pressure_trigger *trigger,
+                               void *userdata);
+
+    /** Kernel pressure triggers */
+    struct mh_host_pressure_triggers *_pressure_triggers;
+
+    /**
+     * Handle the get_history method.
+     *
+     * \param[in]  args the method arguments
+     * \param[out] history the downsampled series
+     *
+     * \return see enum mh_result
+     */
+    enum mh_result getHistory(qpid::types::Variant::Map &args,
+                              qpid::types::Variant::Map &history);
+
+    /** Samples of the recent heartbeats */
+    struct mh_host_history *_history;
+
+    /**
+     * Raise an alert event.
+     *
+     * Called by mh_host_alerts_check() when an alert is raised or cleared.
+     *
+     * \param[in] alert the alert
+     * \param[in] value the value of the statistic
+     * \param[in] userdata a pointer to the HostAgent
+     */
+    static void alert_changed(const struct mh_host_alert *alert, double value,
+                              void *userdata);
+
+    /** Threshold alerts checked on every heartbeat */
+    struct mh_host_alerts *_alerts;
+
+    /** Per CPU utilization, sized once from the number of CPUs */
+    std::vector<struct mh_host_cpu_utilization> _cpus;
+
+    /** Available memory per NUMA node, sized once from the topology */
+    std::vector<uint64_t> _numa_free_mem;
+
+    /** Statistics as last published, by name */
+    std::map<std::string, qpid::types::Variant> _published;
+
+    /** Tolerance of each statistic, in percent of the published value */
+    std::map<std::string, double> _tolerance;
+
+    /** Fields of each statistic compared exactly, whatever the tolerance */
+    std::map<std::string, std::set<std::string> > _exact;
+
+    /** Number of heartbeats between full refreshes (0 to always refresh) */
+    uint32_t _refresh_interval;
+    uint32_t _since_refresh;
+
+    /** Publication counters */
+    uint64_t _updates_full;
+    uint64_t _updates_partial;
+    uint64_t _suppressed;
+    uint64_t _bytes_saved;
+
+    /** Statistics published and suppressed since the last heartbeat */
+    uint32_t _heartbeat_updated;
+    uint32_t _heartbeat_suppressed;
+
     qmf::org::matahariproject::PackageDefinition _package;
     qmf::Data _instance;
     static const char HOST_NAME[];
@@ -79,6 +294,31 @@ private:
      * This value is in seconds.
      */
     static const uint32_t DEFAULT_UPDATE_INTERVAL = 5;
+
+    /**
+     * Default number of heartbeats between full refreshes of the statistics.
+     */
+    static const uint32_t DEFAULT_REFRESH_INTERVAL = 12;
+
+    /**
+     * Time covered by the history of heartbeat samples, in seconds.
+     */
+    static const uint32_t HISTORY_LENGTH = 24 * 60 * 60;
+
+    /**
+     * Time a heartbeat waits for the statistics of a filesystem, in ms.
+     */
+    static const uint32_t FILESYSTEM_TIMEOUT = 1000;
+
+    /**
+     * Number of processes in each list of the top_processes statistic.
+     */
+    static const uint32_t TOP_PROCESSES = 5;
+
+    /**
+     * Maximum number of processes returned by get_top_processes.
+     */
+    static const uint32_t MAX_TOP_PROCESSES = 1000;
 };
 
 const char HostAgent::HOST_NAME[] = "Host";
@@ -87,22 +327,131 @@ gboolean
 HostAgent::heartbeat_timer(gpointer data)
 {
     HostAgent *agent = (HostAgent *) data;
-    g_timeout_add(agent->heartbeat(), heartbeat_timer, data);
+    uint32_t interval = agent->heartbeat();
+
+    agent->_heartbeat_timer = g_timeout_add(
+        agent->heartbeat_delay(interval, false), heartbeat_timer, data);
     return FALSE;
 }
 
+guint
+HostAgent::heartbeat_delay(uint32_t interval, bool first)
+{
+    GTimeVal now;
+    uint64_t now_ms, next;
+
+    if (interval == 0) {
+        return 0;
+    }
+
+    g_get_current_time(&now);
+    now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+
+    next = now_ms - (now_ms % interval) + (uint64_t) (_phase * interval);
+
+    /*
+     * Timers may fire a little early or late.  Anything less than half an
+     * interval away is the heartbeat we were just called for.
+     */
+    while (next < now_ms + (first ? 0 : interval / 2)) {
+        next += interval;
+    }
+
+    return (guint) (next - now_ms);
+}
+
+void
+HostAgent::reconnected(qmf::AgentSession session)
+{
+    /* Consoles may have missed updates while we were away */
+    _since_refresh = 0;
+
+    if (!getOptions().count("random-phase")) {
+        return;
+    }
+
+    _phase = g_random_double();
+    mh_info("Heartbeat phase is now %.3f of the update interval", _phase);
+
+    if (_heartbeat_timer) {
+        uint32_t interval = _instance.getProperty("update_interval").asInt32();
+
+        g_source_remove(_heartbeat_timer);
+        _heartbeat_timer = g_timeout_add(
+            heartbeat_delay(interval ? interval * 1000 : 5 * 60 * 1000, true),
+            heartbeat_timer, this);
+    }
+}
+
+#ifdef MH_NODE_AGENT
+MatahariAgent *
+mh_node_host_agent(void)
+{
+    return new HostAgent();
+}
+#else
 int
 main(int argc, char **argv)
 {
     HostAgent *agent = new HostAgent();
     int rc = agent->init(argc, argv, "host");
     if (rc == 0) {
-        HostAgent::heartbeat_timer(agent);
         agent->run();
     }
 
     return rc;
 }
+#endif
+
+/*
+ * The power profile methods run tuned-adm and wait for it to finish, so they
+ * are handed to the worker pool.
+ */
+static enum mh_result
+set_power_profile(_qtype::Variant::Map &args, _qtype::Variant::Map &results,
+                  void *userdata)
+{
+    enum mh_result res;
+
+    res = mh_host_set_power_profile(args["profile"].asString().c_str());
+    if (res == MH_RES_SUCCESS) {
+        results["status"] = 0;
+    }
+    return res;
+}
+
+static enum mh_result
+get_power_profile(_qtype::Variant::Map &args, _qtype::Variant::Map &results,
+                  void *userdata)
+{
+    enum mh_result res;
+    char *profile = NULL;
+
+    res = mh_host_get_power_profile(&profile);
+    if (res == MH_RES_SUCCESS) {
+        results["profile"] = profile;
+    }
+    free(profile);
+    return res;
+}
+
+static enum mh_result
+list_power_profiles(_qtype::Variant::Map &args, _qtype::Variant::Map &results,
+                    void *userdata)
+{
+    GList *plist = NULL;
+    GList *profile_list = NULL;
+    _qtype::Variant::List s_list;
+
+    profile_list = mh_host_list_power_profiles();
+    for (plist = g_list_first(profile_list); plist;
+         plist = g_list_next(plist)) {
+        s_list.push_back((const char *) plist->data);
+    }
+    results["profiles"] = s_list;
+    g_list_free_full(profile_list, free);
+    return MH_RES_SUCCESS;
+}
 
 gboolean
 HostAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event,
@@ -112,7 +461,6 @@ HostAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event,
         return TRUE;
     }
 
-    enum mh_result res = MH_RES_SUCCESS;
     const std::string& methodName(event.getMethodName());
     qpid::types::Variant::Map& args = event.getArguments();
 
@@ -154,37 +502,102 @@ HostAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event,
         if (uuid) {
             event.addReturnArgument("uuid", uuid);
         }
-    } else if (methodName == "set_power_profile") {
-        res = mh_host_set_power_profile(args["profile"].asString().c_str());
+    } else if (methodName == "has_cpu_feature") {
+        bool present = mh_host_has_cpu_feature(args["feature"].asString().c_str());
+        event.addReturnArgument("present", present);
+    } else if (methodName == "get_history") {
+        qpid::types::Variant::Map history;
+        enum mh_result res = getHistory(args, history);
+
         if (res != MH_RES_SUCCESS) {
             session.raiseException(event, mh_result_to_str(res));
             goto bail;
-        } else {
-            event.addReturnArgument("status", 0);
         }
-    } else if (methodName == "get_power_profile") {
-        char *profile = NULL;
-        res = mh_host_get_power_profile(&profile);
+        event.addReturnArgument("history", history);
+    } else if (methodName == "get_top_processes") {
+        enum mh_host_process_sort sort;
+        unsigned int n = args.count("n") ? args["n"].asUint32() : TOP_PROCESSES;
+
+        if (mh_host_process_sort_from_name(args["sort"].asString().c_str(),
+                                           &sort) != MH_RES_SUCCESS) {
+            session.raiseException(event, mh_result_to_str(MH_RES_INVALID_ARGS));
+            goto bail;
+        }
+        event.addReturnArgument("processes", topProcesses(n, sort));
+    } else if (methodName == "add_alert") {
+        enum mh_result res = mh_host_alerts_add(_alerts,
+                args["name"].asString().c_str(),
+                args["rule"].asString().c_str(),
+                args.count("hysteresis") ? args["hysteresis"].asDouble() : 0.0,
+                args.count("hold") ? args["hold"].asUint32() : 0);
+
         if (res != MH_RES_SUCCESS) {
             session.raiseException(event, mh_result_to_str(res));
             goto bail;
-        } else {
-            event.addReturnArgument("profile", profile);
         }
-        free(profile);
-    } else if (methodName == "list_power_profiles") {
-        GList *plist = NULL;
-        GList *profile_list = NULL;
+    } else if (methodName == "remove_alert") {
+        enum mh_result res = mh_host_alerts_remove(_alerts,
+                args["name"].asString().c_str());
+
+        if (res != MH_RES_SUCCESS) {
+            session.raiseException(event, mh_result_to_str(res));
+            goto bail;
+        }
+    } else if (methodName == "list_alerts") {
+        qpid::types::Variant::Map alerts;
+
+        for (unsigned int lpc = 0; lpc < mh_host_alerts_count(_alerts); lpc++) {
+            const struct mh_host_alert *alert = mh_host_alerts_get(_alerts, lpc);
+            qpid::types::Variant::Map entry;
+
+            entry["rule"] = alert->rule;
+            entry["threshold"] = alert->threshold;
+            entry["clear"] = alert->clear;
+            entry["hold"] = alert->hold;
+            entry["active"] = alert->active ? true : false;
+            alerts[alert->name] = entry;
+        }
+        event.addReturnArgument("alerts", alerts);
+    } else if (methodName == "add_pressure_trigger") {
+        enum mh_result res = mh_host_pressure_triggers_add(_pressure_triggers,
+                args["name"].asString().c_str(),
+                args["rule"].asString().c_str());
+
+        if (res != MH_RES_SUCCESS) {
+            session.raiseException(event, mh_result_to_str(res));
+            goto bail;
+        }
+    } else if (methodName == "remove_pressure_trigger") {
+        enum mh_result res = mh_host_pressure_triggers_remove(_pressure_triggers,
+                args["name"].asString().c_str());
+
+        if (res != MH_RES_SUCCESS) {
+            session.raiseException(event, mh_result_to_str(res));
+            goto bail;
+        }
+    } else if (methodName == "list_pressure_triggers") {
+        qpid::types::Variant::Map triggers;
 
-        _qtype::Variant::List s_list;
+        for (unsigned int lpc = 0;
+             lpc < mh_host_pressure_triggers_count(_pressure_triggers); lpc++) {
+            const struct mh_host_pressure_trigger *trigger =
+                mh_host_pressure_triggers_get(_pressure_triggers, lpc);
+            qpid::types::Variant::Map entry;
 
-        profile_list = mh_host_list_power_profiles();
-        for (plist = g_list_first(profile_list); plist;
-             plist = g_list_next(plist)) {
-            s_list.push_back((const char *) plist->data);
+            entry["rule"] = trigger->rule;
+            entry["fired"] = trigger->fired;
+            triggers[trigger->name] = entry;
         }
-        event.addReturnArgument("profiles", s_list);
-        g_list_free_full(profile_list, free);
+        event.addReturnArgument("triggers", triggers);
+    } else if (methodName == "set_power_profile") {
+        runBlocking(session, event, set_power_profile, NULL);
+        goto bail;
+    } else if (methodName == "get_power_profile") {
+        runBlocking(session, event, get_power_profile, NULL);
+        goto bail;
+    } else if (methodName == "list_power_profiles") {
+        runBlocking(session, event, list_power_profiles, NULL);
+        goto bail;
     } else {
         session.raiseException(event, mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
         goto bail;
@@ -196,13 +609,99 @@ bail:
     return TRUE;
 }
 
+void
+HostAgent::registerSchemas(qmf::AgentSession session)
+{
+    _package.configure(session);
+}
+
+void
+HostAgent::registerOptions(qpid::types::Variant::Map &options)
+{
+    mh_add_map_option('T', required_argument, "publish-tolerance", "relative change, in percent, below which statistics are not republished; either one value or a list of statistic=value", options);
+    mh_add_map_option('F', required_argument, "full-refresh",      "number of updates between republishing all statistics", options);
+    mh_add_map_option('R', no_argument,       "random-phase",      "pick a new random phase for periodic updates after reconnecting to the broker", options);
+    mh_add_map_option('M', required_argument, "metadata-url",      "URL of the cloud instance id used as Hardware UUID on hosts without SMBIOS (default: the EC2 metadata service)", options);
+    mh_add_map_option('I', required_argument, "disk-include",      "devices to report disk I/O of, other than whole disks: a list of 'partitions' and 'virtual' (loop and ram devices)", options);
+}
+
+static ::qpid::types::Variant::Map
+topology_map(const struct mh_host_topology *topology)
+{
+    ::qpid::types::Variant::Map map, nodes, caches;
+    char name[16];
+
+    map["sockets"]    = ::qpid::types::Variant(topology->sockets);
+    map["cores"]      = ::qpid::types::Variant(topology->cores);
+    map["threads"]    = ::qpid::types::Variant(topology->threads);
+    map["smt"]        = ::qpid::types::Variant(topology->smt ? true : false);
+    map["numa_nodes"] = ::qpid::types::Variant(topology->nnodes);
+
+    for (unsigned int lpc = 0; lpc < topology->nnodes; lpc++) {
+        ::qpid::types::Variant::Map node;
+
+        node["cpus"]   = ::qpid::types::Variant(topology->nodes[lpc].cpus);
+        node["memory"] = ::qpid::types::Variant(topology->nodes[lpc].memory);
+        snprintf(name, sizeof(name), "node%u", topology->nodes[lpc].id);
+        nodes[name] = node;
+    }
+    map["nodes"] = nodes;
+
+    for (unsigned int lpc = 0; lpc < topology->ncaches; lpc++) {
+        ::qpid::types::Variant::Map cache;
+
+        cache["size"]        = ::qpid::types::Variant(topology->caches[lpc].size);
+        cache["shared_cpus"] = ::qpid::types::Variant(topology->caches[lpc].shared_cpus);
+        caches[topology->caches[lpc].name] = cache;
+    }
+    map["caches"] = caches;
+
+    return map;
+}
+
+/*
+ * Parse the --disk-include option, a list of "partitions" and "virtual".
+ */
+static unsigned int
+disk_include(qpid::types::Variant::Map &options)
+{
+    unsigned int include = 0;
+    gchar **kinds;
+
+    if (!options.count("disk-include")) {
+        return 0;
+    }
+
+    kinds = g_strsplit(options["disk-include"].asString().c_str(), ",", 0);
+    for (int lpc = 0; kinds[lpc]; lpc++) {
+        g_strstrip(kinds[lpc]);
+        if (!strcmp(kinds[lpc], "partitions")) {
+            include |= MH_HOST_DISK_PARTITIONS;
+        } else if (!strcmp(kinds[lpc], "virtual")) {
+            include |= MH_HOST_DISK_VIRTUAL;
+        } else if (kinds[lpc][0]) {
+            mh_warn("Unknown kind of device '%s' in --disk-include", kinds[lpc]);
+        }
+    }
+    g_strfreev(kinds);
+
+    return include;
+}
+
 int
 HostAgent::setup(qmf::AgentSession session)
 {
     const char *custom_uuid = mh_host_get_uuid("Custom");
-    _package.configure(session);
+    struct mh_host_cpu_utilization cpu;
+
     _instance = qmf::Data(_package.data_Host);
 
+    if (getOptions().count("metadata-url")) {
+        mh_host_set_metadata_url(getOptions()["metadata-url"].asString().c_str());
+    }
+    /* Start looking up the Hardware UUID, without waiting for it */
+    mh_host_get_uuid("Hardware");
+
     _instance.setProperty("update_interval", DEFAULT_UPDATE_INTERVAL);
     _instance.setProperty("uuid", mh_host_get_uuid("Filesystem"));
     if(custom_uuid) {
@@ -219,17 +718,44 @@ HostAgent::setup(qmf::AgentSession session)
     _instance.setProperty("cpu_cores", mh_host_get_cpu_number_of_cores());
     _instance.setProperty("cpu_model", mh_host_get_cpu_model());
     _instance.setProperty("cpu_flags", mh_host_get_cpu_flags());
+    _instance.setProperty("isa_level", mh_host_get_isa_level());
+    _instance.setProperty("topology", topology_map(mh_host_get_topology()));
+
+    addData(_instance, HOST_NAME);
+    configurePublication();
+
+    /* Start counting CPU time from here, rather than from boot */
+    _cpus.resize(mh_host_get_cpu_count());
+    publishCpuUtilization(&cpu);
+
+    _numa_free_mem.resize(mh_host_get_topology()->nnodes);
+
+    /* Start counting I/O from here, rather than from boot */
+    _disks = mh_host_disks_new(disk_include(getOptions()));
+    publishDiskIO();
+
+    _filesystems = mh_host_filesystems_new(FILESYSTEM_TIMEOUT);
+    publishFilesystems();
 
-    session.addData(_instance, HOST_NAME);
+    /* Start counting process CPU time from here */
+    mh_host_processes_update(_processes);
+
+    _history = mh_host_history_new(HISTORY_LENGTH / DEFAULT_UPDATE_INTERVAL);
+
+    /* Spread the heartbeats of different hosts over the update interval */
+    _phase = (g_str_hash(mh_host_get_uuid("Filesystem")) % 10000) / 10000.0;
+    mh_debug("Heartbeat phase is %.3f of the update interval", _phase);
+    _heartbeat_timer = g_timeout_add(
+        heartbeat_delay(DEFAULT_UPDATE_INTERVAL * 1000, true),
+        heartbeat_timer, this);
     return 0;
 }
 
 int
 HostAgent::heartbeat()
 {
-    uint64_t timestamp = 0L, now = 0L;
-    sigar_loadavg_t avg;
-    sigar_proc_stat_t procs;
+    struct mh_host_snapshot snapshot;
+    struct mh_host_cpu_utilization cpu;
     static uint32_t _heartbeat_sequence = 0;
     uint32_t interval = _instance.getProperty("update_interval").asInt32();
 
@@ -241,38 +767,31 @@ HostAgent::heartbeat()
         return 5 * 60 * 1000;
     }
 
-#ifdef HAVE_TIME
-    timestamp = ::time(NULL);
-#endif
-
-    now = timestamp * 1000000000;
+    memset(&snapshot, 0, sizeof(snapshot));
+    if (mh_host_get_snapshot(&snapshot) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect host statistics");
+    }
 
-    _instance.setProperty("last_updated", now);
+    _instance.setProperty("last_updated", snapshot.timestamp * 1000000000);
     _instance.setProperty("sequence", _heartbeat_sequence);
+    publish(snapshot);
+    publishNumaFreeMem();
+    publishDiskIO();
+    publishFilesystems();
+    publishTopProcesses();
+    publishPressure();
 
-    _instance.setProperty("free_swap", mh_host_get_swap_free());
-    _instance.setProperty("free_mem", mh_host_get_mem_free());
-
-    ::qpid::types::Variant::Map load;
-    memset(&avg, 0, sizeof(sigar_loadavg_t));
-    mh_host_get_load_averages(&avg);
-    load["1"]  = ::qpid::types::Variant((double)avg.loadavg[0]);
-    load["5"]  = ::qpid::types::Variant((double)avg.loadavg[1]);
-    load["15"] = ::qpid::types::Variant((double)avg.loadavg[2]);
-    _instance.setProperty("load", load);
-
-    ::qpid::types::Variant::Map proc;
-    mh_host_get_processes(&procs);
-    proc["total"]    = ::qpid::types::Variant((int)procs.total);
-    proc["idle"]     = ::qpid::types::Variant((int)procs.idle);
-    proc["zombie"]   = ::qpid::types::Variant((int)procs.zombie);
-    proc["running"]  = ::qpid::types::Variant((int)procs.running);
-    proc["stopped"]  = ::qpid::types::Variant((int)procs.stopped);
-    proc["sleeping"] = ::qpid::types::Variant((int)procs.sleeping);
-    _instance.setProperty("process_statistics", proc);
+    if (publishCpuUtilization(&cpu)) {
+        mh_host_history_add(_history, &snapshot, &cpu);
+        mh_host_alerts_check(_alerts, &snapshot, &cpu, alert_changed, this);
+    } else {
+        mh_host_history_add(_history, &snapshot, NULL);
+        mh_host_alerts_check(_alerts, &snapshot, NULL, alert_changed, this);
+    }
+    finishPublication();
 
     qmf::Data event = qmf::Data(_package.event_heartbeat);
-    event.setProperty("timestamp", timestamp);
+    event.setProperty("timestamp", snapshot.timestamp);
     event.setProperty("sequence",  _heartbeat_sequence);
     event.setProperty("hostname",  mh_host_get_hostname());
     event.setProperty("uuid",      mh_host_get_uuid("Filesystem"));
@@ -286,3 +805,563 @@ HostAgent::heartbeat()
 
     return interval * 1000;
 }
+
+/*
+ * Rough size of a property on the wire, as in the AMQP 0-10 map encoding:
+ * the name, a type code and the value.
+ */
+static uint64_t
+encoded_size(const std::string &name, const qpid::types::Variant &value)
+{
+    uint64_t size = 1 + name.size() + 1;
+
+    if (value.getType() == qpid::types::VAR_MAP) {
+        const qpid::types::Variant::Map &map = value.asMap();
+        qpid::types::Variant::Map::const_iterator iter;
+
+        size += 8;
+        for (iter = map.begin(); iter != map.end(); iter++) {
+            size += encoded_size(iter->first, iter->second);
+        }
+    } else if (value.getType() == qpid::types::VAR_LIST) {
+        const qpid::types::Variant::List &list = value.asList();
+        qpid::types::Variant::List::const_iterator iter;
+
+        size += 8;
+        for (iter = list.begin(); iter != list.end(); iter++) {
+            size += encoded_size("", *iter);
+        }
+    } else {
+        size += 8;
+    }
+
+    return size;
+}
+
+static bool
+changed(double published, double current, double tolerance)
+{
+    double diff = current > published ? current - published : published - current;
+
+    return diff > (published < 0 ? -published : published) * tolerance / 100.0;
+}
+
+static bool
+variant_number(const qpid::types::Variant &value, double *number)
+{
+    switch (value.getType()) {
+    case qpid::types::VAR_UINT8:
+    case qpid::types::VAR_UINT16:
+    case qpid::types::VAR_UINT32:
+    case qpid::types::VAR_UINT64:
+        *number = (double) value.asUint64();
+        return true;
+    case qpid::types::VAR_INT8:
+    case qpid::types::VAR_INT16:
+    case qpid::types::VAR_INT32:
+    case qpid::types::VAR_INT64:
+        *number = (double) value.asInt64();
+        return true;
+    case qpid::types::VAR_FLOAT:
+    case qpid::types::VAR_DOUBLE:
+        *number = value.asDouble();
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Compare a statistic against the value last published: numbers within
+ * the tolerance are the same, anything else has to be equal.  Numbers
+ * under a key in exact, such as identifiers and counters, have to be
+ * equal too.
+ */
+static bool
+variant_changed(const qpid::types::Variant &published,
+                const qpid::types::Variant &current, double tolerance,
+                const std::set<std::string> &exact)
+{
+    double a, b;
+
+    if (published.getType() != current.getType()) {
+        return true;
+    }
+
+    if (current.getType() == qpid::types::VAR_MAP) {
+        const qpid::types::Variant::Map &old_map = published.asMap();
+        const qpid::types::Variant::Map &new_map = current.asMap();
+        qpid::types::Variant::Map::const_iterator iter, match;
+
+        if (old_map.size() != new_map.size()) {
+            return true;
+        }
+        for (iter = new_map.begin(); iter != new_map.end(); iter++) {
+            match = old_map.find(iter->first);
+            if (match == old_map.end()
+                || variant_changed(match->second, iter->second,
+                                   exact.count(iter->first) ? 0.0 : tolerance,
+                                   exact)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (current.getType() == qpid::types::VAR_LIST) {
+        const qpid::types::Variant::List &old_list = published.asList();
+        const qpid::types::Variant::List &new_list = current.asList();
+        qpid::types::Variant::List::const_iterator old_iter, new_iter;
+
+        if (old_list.size() != new_list.size()) {
+            return true;
+        }
+        for (old_iter = old_list.begin(), new_iter = new_list.begin();
+             new_iter != new_list.end(); old_iter++, new_iter++) {
+            if (variant_changed(*old_iter, *new_iter, tolerance, exact)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (variant_number(published, &a) && variant_number(current, &b)) {
+        return changed(a, b, tolerance);
+    }
+
+    return !(published == current);
+}
+
+void
+HostAgent::configurePublication(void)
+{
+    qpid::types::Variant::Map &options = getOptions();
+    gchar **fields;
+    int lpc;
+
+    _tolerance["free_mem"] = 1.0;
+    _tolerance["free_swap"] = 1.0;
+    _tolerance["load"] = 5.0;
+    _tolerance["process_statistics"] = 5.0;
+    _tolerance["cpu_utilization"] = 5.0;
+    _tolerance["numa_free_mem"] = 1.0;
+    _tolerance["disk_io"] = 10.0;
+    _tolerance["filesystems"] = 1.0;
+    _tolerance["top_processes"] = 10.0;
+    _tolerance["pressure"] = 10.0;
+
+    /* Identifiers and cumulative counters are not measurements */
+    _exact["top_processes"].insert("pid");
+    _exact["pressure"].insert("total");
+
+    /* Either a single percentage, or a list of field=percentage */
+    if (options.count("publish-tolerance")) {
+        fields = g_strsplit(options["publish-tolerance"].asString().c_str(),
+                            ",", 0);
+        for (lpc = 0; fields[lpc]; lpc++) {
+            gchar *value = strchr(fields[lpc], '=');
+
+            if (value) {
+                *value++ = '\0';
+                if (!_tolerance.count(fields[lpc])) {
+                    mh_warn("Unknown statistic '%s' in --publish-tolerance",
+                            fields[lpc]);
+                    continue;
+                }
+                _tolerance[fields[lpc]] = g_ascii_strtod(value, NULL);
+            } else {
+                std::map<std::string, double>::iterator iter;
+
+                for (iter = _tolerance.begin(); iter != _tolerance.end(); iter++) {
+                    iter->second = g_ascii_strtod(fields[lpc], NULL);
+                }
+            }
+        }
+        g_strfreev(fields);
+    }
+
+    _refresh_interval = DEFAULT_REFRESH_INTERVAL;
+    if (options.count("full-refresh")) {
+        _refresh_interval = atoi(options["full-refresh"].asString().c_str());
+    }
+}
+
+void
+HostAgent::publish(const struct mh_host_snapshot &snapshot)
+{
+    ::qpid::types::Variant::Map load;
+    load["1"]  = ::qpid::types::Variant(snapshot.loadavg[0]);
+    load["5"]  = ::qpid::types::Variant(snapshot.loadavg[1]);
+    load["15"] = ::qpid::types::Variant(snapshot.loadavg[2]);
+
+    ::qpid::types::Variant::Map proc;
+    proc["total"]    = ::qpid::types::Variant((int)snapshot.procs.total);
+    proc["idle"]     = ::qpid::types::Variant((int)snapshot.procs.idle);
+    proc["zombie"]   = ::qpid::types::Variant((int)snapshot.procs.zombie);
+    proc["running"]  = ::qpid::types::Variant((int)snapshot.procs.running);
+    proc["stopped"]  = ::qpid::types::Variant((int)snapshot.procs.stopped);
+    proc["sleeping"] = ::qpid::types::Variant((int)snapshot.procs.sleeping);
+
+    publishStatistic("free_mem", snapshot.mem_free);
+    publishStatistic("free_swap", snapshot.swap_free);
+    publishStatistic("load", load);
+    publishStatistic("process_statistics", proc);
+}
+
+bool
+HostAgent::publishStatistic(const std::string &name,
+                            const qpid::types::Variant &value)
+{
+    std::map<std::string, qpid::types::Variant>::iterator published;
+    std::map<std::string, double>::iterator tolerance;
+
+    published = _published.find(name);
+    tolerance = _tolerance.find(name);
+    if (_since_refresh == 0 || published == _published.end()
+        || variant_changed(published->second, value,
+                           tolerance == _tolerance.end() ? 0.0 : tolerance->second,
+                           _exact[name])) {
+        _instance.setProperty(name, value);
+        _published[name] = value;
+        _heartbeat_updated++;
+        return true;
+    }
+
+    _bytes_saved += encoded_size(name, value);
+    _heartbeat_suppressed++;
+    return false;
+}
+
+void
+HostAgent::finishPublication(void)
+{
+    bool full = _since_refresh == 0;
+
+    if (full) {
+        _updates_full++;
+    } else {
+        _updates_partial++;
+    }
+    _suppressed += _heartbeat_suppressed;
+
+    if (++_since_refresh >= _refresh_interval) {
+        _since_refresh = 0;
+    }
+
+    mh_trace("Published %u statistics, suppressed %u%s", _heartbeat_updated,
+             _heartbeat_suppressed, full ? " (full refresh)" : "");
+    _heartbeat_updated = 0;
+    _heartbeat_suppressed = 0;
+
+    ::qpid::types::Variant::Map counters;
+    counters["full"]        = ::qpid::types::Variant(_updates_full);
+    counters["partial"]     = ::qpid::types::Variant(_updates_partial);
+    counters["suppressed"]  = ::qpid::types::Variant(_suppressed);
+    counters["bytes_saved"] = ::qpid::types::Variant(_bytes_saved);
+    _instance.setProperty("publication_statistics", counters);
+}
+
+static ::qpid::types::Variant::Map
+cpu_utilization_map(const struct mh_host_cpu_utilization &util)
+{
+    ::qpid::types::Variant::Map map;
+
+    map["user"]   = ::qpid::types::Variant(util.user);
+    map["system"] = ::qpid::types::Variant(util.system);
+    map["iowait"] = ::qpid::types::Variant(util.iowait);
+    map["steal"]  = ::qpid::types::Variant(util.steal);
+    map["idle"]   = ::qpid::types::Variant(util.idle);
+    return map;
+}
+
+bool
+HostAgent::publishCpuUtilization(struct mh_host_cpu_utilization *total)
+{
+    ::qpid::types::Variant::Map cpus;
+    char name[16];
+
+    if (mh_host_get_cpu_utilization(total, _cpus.empty() ? NULL : &_cpus[0],
+                                    _cpus.size()) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect CPU utilization");
+        return false;
+    }
+
+    cpus["total"] = cpu_utilization_map(*total);
+    for (size_t lpc = 0; lpc < _cpus.size(); lpc++) {
+        snprintf(name, sizeof(name), "cpu%u", (unsigned int) lpc);
+        cpus[name] = cpu_utilization_map(_cpus[lpc]);
+    }
+    publishStatistic("cpu_utilization", cpus);
+    return true;
+}
+
+void
+HostAgent::publishNumaFreeMem(void)
+{
+    const struct mh_host_topology *topology = mh_host_get_topology();
+    ::qpid::types::Variant::Map nodes;
+    char name[16];
+
+    if (mh_host_get_numa_free_mem(&_numa_free_mem[0],
+                                  _numa_free_mem.size()) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect NUMA node memory");
+        return;
+    }
+
+    for (size_t lpc = 0; lpc < _numa_free_mem.size(); lpc++) {
+        snprintf(name, sizeof(name), "node%u", topology->nodes[lpc].id);
+        nodes[name] = ::qpid::types::Variant(_numa_free_mem[lpc]);
+    }
+    publishStatistic("numa_free_mem", nodes);
+}
+
+void
+HostAgent::publishDiskIO(void)
+{
+    const struct mh_host_disk_io *io;
+    ::qpid::types::Variant::Map disks;
+    unsigned int count;
+
+    if (mh_host_disks_update(_disks, &io, &count) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect disk I/O statistics");
+        return;
+    }
+
+    for (unsigned int lpc = 0; lpc < count; lpc++) {
+        ::qpid::types::Variant::Map dev;
+
+        dev["reads"]    = ::qpid::types::Variant(io[lpc].reads);
+        dev["writes"]   = ::qpid::types::Variant(io[lpc].writes);
+        dev["read_mb"]  = ::qpid::types::Variant(io[lpc].read_mb);
+        dev["write_mb"] = ::qpid::types::Variant(io[lpc].write_mb);
+        dev["queue"]    = ::qpid::types::Variant(io[lpc].queue);
+        dev["await"]    = ::qpid::types::Variant(io[lpc].await);
+        disks[io[lpc].name] = dev;
+    }
+    publishStatistic("disk_io", disks);
+}
+
+void
+HostAgent::publishFilesystems(void)
+{
+    const struct mh_host_filesystem *list;
+    ::qpid::types::Variant::Map filesystems;
+    unsigned int count;
+
+    if (mh_host_filesystems_update(_filesystems, &list, &count) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect filesystem statistics");
+        return;
+    }
+
+    for (unsigned int lpc = 0; lpc < count; lpc++) {
+        ::qpid::types::Variant::Map fs;
+
+        fs["device"]      = ::qpid::types::Variant(list[lpc].device);
+        fs["type"]        = ::qpid::types::Variant(list[lpc].type);
+        fs["size"]        = ::qpid::types::Variant(list[lpc].size);
+        fs["free"]        = ::qpid::types::Variant(list[lpc].free);
+        fs["avail"]       = ::qpid::types::Variant(list[lpc].avail);
+        fs["inodes"]      = ::qpid::types::Variant(list[lpc].inodes);
+        fs["inodes_free"] = ::qpid::types::Variant(list[lpc].inodes_free);
+        fs["stale"]       = ::qpid::types::Variant(list[lpc].stale ? true : false);
+        filesystems[list[lpc].mount_point] = fs;
+    }
+    publishStatistic("filesystems", filesystems);
+}
+
+qpid::types::Variant::List
+HostAgent::topProcesses(unsigned int n, enum mh_host_process_sort sort)
+{
+    qpid::types::Variant::List list;
+    std::vector<struct mh_host_process> top;
+
+    if (n > MAX_TOP_PROCESSES) {
+        n = MAX_TOP_PROCESSES;
+    }
+    top.resize(n);
+    n = mh_host_processes_top(_processes, sort, n ? &top[0] : NULL, n);
+    for (unsigned int lpc = 0; lpc < n; lpc++) {
+        ::qpid::types::Variant::Map process;
+
+        process["pid"]  = ::qpid::types::Variant(top[lpc].pid);
+        process["name"] = ::qpid::types::Variant(top[lpc].name);
+        process["cpu"]  = ::qpid::types::Variant(top[lpc].cpu);
+        process["rss"]  = ::qpid::types::Variant(top[lpc].rss);
+        list.push_back(process);
+    }
+
+    return list;
+}
+
+void
+HostAgent::publishTopProcesses(void)
+{
+    ::qpid::types::Variant::Map top;
+
+    if (mh_host_processes_update(_processes) != MH_RES_SUCCESS) {
+        mh_warn("Could not collect process statistics");
+        return;
+    }
+
+    top["cpu"] = topProcesses(TOP_PROCESSES, MH_HOST_PROCESS_CPU);
+    top["rss"] = topProcesses(TOP_PROCESSES, MH_HOST_PROCESS_RSS);
+    publishStatistic("top_processes", top);
+}
+
+void
+HostAgent::publishPressure(void)
+{
+    ::qpid::types::Variant::Map pressure;
+
+    for (unsigned int lpc = 0; lpc < MH_HOST_PRESSURE_RESOURCES; lpc++) {
+        enum mh_host_pressure_resource resource =
+            (enum mh_host_pressure_resource) lpc;
+        const struct mh_host_pressure_stall *stalls[2];
+        const char *kinds[2] = { "some", "full" };
+        ::qpid::types::Variant::Map entry;
+        struct mh_host_pressure p;
+
+        if (mh_host_get_pressure(resource, &p) != MH_RES_SUCCESS) {
+            continue;
+        }
+
+        stalls[0] = &p.some;
+        stalls[1] = &p.full;
+        for (unsigned int kind = 0; kind < 2; kind++) {
+            ::qpid::types::Variant::Map stall;
+
+            stall["avg10"]  = ::qpid::types::Variant(stalls[kind]->avg10);
+            stall["avg60"]  = ::qpid::types::Variant(stalls[kind]->avg60);
+            stall["avg300"] = ::qpid::types::Variant(stalls[kind]->avg300);
+            stall["total"]  = ::qpid::types::Variant(stalls[kind]->total);
+            entry[kinds[kind]] = stall;
+        }
+        pressure[mh_host_pressure_resource_name(resource)] = entry;
+    }
+    publishStatistic("pressure", pressure);
+}
+
+enum mh_result
+HostAgent::getHistory(qpid::types::Variant::Map &args,
+                      qpid::types::Variant::Map &history)
+{
+    std::vector<enum mh_host_history_field> fields;
+    std::vector<struct mh_host_history_bucket> buckets;
+    qpid::types::Variant::List timestamps;
+    uint64_t since = 0;
+    uint32_t resolution = 0;
+    unsigned int count = 0, lpc;
+
+    if (args.count("since")) {
+        since = args["since"].asUint64() / 1000000000;
+    }
+    if (args.count("resolution")) {
+        resolution = args["resolution"].asUint32();
+    }
+
+    if (args.count("fields") && !args["fields"].asList().empty()) {
+        const qpid::types::Variant::List &names = args["fields"].asList();
+        qpid::types::Variant::List::const_iterator iter;
+
+        for (iter = names.begin(); iter != names.end(); iter++) {
+            enum mh_host_history_field field =
+                mh_host_history_field_from_name(iter->asString().c_str());
+
+            if (field == MH_HOST_HISTORY_FIELDS) {
+                mh_warn("Unknown history field '%s'", iter->asString().c_str());
+                return MH_RES_INVALID_ARGS;
+            }
+            fields.push_back(field);
+        }
+    } else {
+        for (lpc = 0; lpc < MH_HOST_HISTORY_FIELDS; lpc++) {
+            fields.push_back((enum mh_host_history_field) lpc);
+        }
+    }
+
+    buckets.resize(mh_host_history_count(_history) + 1);
+
+    for (std::vector<enum mh_host_history_field>::iterator field = fields.begin();
+         field != fields.end(); field++) {
+        qpid::types::Variant::List min, avg, max;
+        qpid::types::Variant::Map series;
+
+        count = mh_host_history_query(_history, *field, since, resolution,
+                                      &buckets[0], buckets.size());
+        for (lpc = 0; lpc < count; lpc++) {
+            min.push_back(buckets[lpc].min);
+            avg.push_back(buckets[lpc].avg);
+            max.push_back(buckets[lpc].max);
+        }
+
+        series["min"] = min;
+        series["avg"] = avg;
+        series["max"] = max;
+        history[mh_host_history_field_name(*field)] = series;
+    }
+
+    /* The intervals are the same for every field */
+    for (lpc = 0; lpc < count; lpc++) {
+        timestamps.push_back(buckets[lpc].start * 1000000000);
+    }
+    history["timestamps"] = timestamps;
+
+    return MH_RES_SUCCESS;
+}
+
+void
+HostAgent::alert_changed(const struct mh_host_alert *alert, double value,
+                         void *userdata)
+{
+    HostAgent *agent = (HostAgent *) userdata;
+
+    mh_info("Alert %s (%s) %s at %f", alert->name, alert->rule,
+            alert->active ? "raised" : "cleared", value);
+
+    qmf::Data event = qmf::Data(agent->_package.event_alert);
+    event.setProperty("timestamp", (uint64_t) time(NULL) * 1000000000);
+    event.setProperty("hostname",  mh_host_get_hostname());
+    event.setProperty("uuid",      mh_host_get_uuid("Filesystem"));
+    event.setProperty("name",      alert->name);
+    event.setProperty("rule",      alert->rule);
+    event.setProperty("active",    alert->active ? true : false);
+    event.setProperty("value",     value);
+    try {
+        agent->getSession().raiseEvent(event);
+    } catch (const qpid::messaging::ConnectionError& e) {
+        mh_log(LOG_ERR, "Connection error sending event to broker. (%s)", e.what());
+    } catch (const qpid::types::Exception& e) {
+        mh_log(LOG_ERR, "Exception sending event to broker. (%s)", e.what());
+    }
+}
+
+void
+HostAgent::pressure_fired(const struct mh_host_pressure_trigger *trigger,
+                          void *userdata)
+{
+    HostAgent *agent = (HostAgent *) userdata;
+    struct mh_host_pressure pressure;
+    double value = 0.0;
+
+    if (mh_host_get_pressure(trigger->resource, &pressure) == MH_RES_SUCCESS) {
+        value = trigger->full ? pressure.full.avg10 : pressure.some.avg10;
+    }
+
+    mh_info("Pressure trigger %s (%s) fired at %f", trigger->name,
+            trigger->rule, value);
+
+    qmf::Data event = qmf::Data(agent->_package.event_pressure);
+    event.setProperty("timestamp", (uint64_t) time(NULL) * 1000000000);
+    event.setProperty("hostname",  mh_host_get_hostname());
+    event.setProperty("uuid",      mh_host_get_uuid("Filesystem"));
+    event.setProperty("name",      trigger->name);
+    event.setProperty("rule",      trigger->rule);
+    event.setProperty("value",     value);
+    try {
+        agent->getSession().raiseEvent(event);
+    } catch (const qpid::messaging::ConnectionError& e) {
+        mh_log(LOG_ERR, "Connection error sending event to broker. (%s)", e.what());
+    } catch (const qpid::types::Exception& e) {
+        mh_log(LOG_ERR, "Exception sending event to broker. (%s)", e.what());
+    }
+}
@@ -33,6 +33,7 @@
 #include <qmf/AgentEvent.h>
 #include <qmf/AgentSession.h>
 #include <qmf/Data.h>
+#include <qmf/DataAddr.h>
 
 extern "C" {
 #include "matahari/mainloop.h"
@@ -57,10 +58,29 @@ using namespace std;
 
 namespace _qtype = ::qpid::types;
 
+/* Default number of QMF events handled per main loop iteration */
+#define MH_QMF_BATCH_SIZE 64
+
+/* Default time, in milliseconds, to spend on one batch of QMF events */
+#define MH_QMF_BATCH_BUDGET 20
+
+/*
+ * QMF events are received by a dedicated thread which blocks in
+ * AgentSession::nextEvent() and hands them over to the main loop through
+ * 'events'.  The main loop is woken up via the 'wakeup' pipe so that an idle
+ * agent does not need to poll the session.
+ */
 typedef struct mainloop_qmf_s {
         GSource source;
+        GPollFD gpoll;
         qmf::AgentSession session;
-        qmf::AgentEvent event;
+        GAsyncQueue *events;
+        GThread *receiver;
+        int wakeup[2];
+        volatile gint closed;
+        guint batch_size;
+        guint budget_ms;
+        GTimer *timer;
         guint id;
         void *user_data;
         GDestroyNotify dnotify;
@@ -84,6 +104,24 @@ mh_add_option(int code, int has_arg, const char *name, const char *description,
               void *userdata, int(*callback)(int code, const char *name,
               const char *arg, void *userdata));
 
+/**
+ * Add a command line option whose value is stored in an options map.
+ *
+ * The value is stored under the long name of the option, or as true for
+ * options without an argument.
+ *
+ * \param[in] code the short option
+ * \param[in] has_arg no_argument or required_argument
+ * \param[in] name the long option
+ * \param[in] description the help text
+ * \param[in] options the map the value is stored in
+ *
+ * \return 0 on success, -1 for an invalid short option
+ */
+int
+mh_add_map_option(int code, int has_arg, const char *name,
+                  const char *description, qpid::types::Variant::Map &options);
+
 qpid::types::Variant::Map
 mh_parse_options(const char *proc_name, int argc, char **argv,
                  qpid::types::Variant::Map &options);
@@ -99,9 +137,35 @@ mainloop_add_qmf(int priority, qmf::AgentSession session,
                                       gpointer userdata),
                  GDestroyNotify notify, gpointer userdata);
 
+/**
+ * Limit how much work the QMF source does per main loop iteration.
+ *
+ * \param[in] source the QMF source
+ * \param[in] batch_size maximum number of events to dispatch at once
+ * \param[in] budget_ms stop dispatching once this many milliseconds have
+ *            passed, 0 for no limit
+ */
+void
+mainloop_qmf_set_batch(mainloop_qmf_t *source, guint batch_size,
+                       guint budget_ms);
+
 gboolean
 mainloop_destroy_qmf(mainloop_qmf_t *source);
 
+/**
+ * Method handler that may block.
+ *
+ * \param[in]  args the arguments of the method call
+ * \param[out] results return arguments to add to the method response
+ * \param[in]  userdata data passed to MatahariAgent::runBlocking()
+ *
+ * \return MH_RES_SUCCESS to reply with methodSuccess(), anything else raises
+ *         an exception on the method call
+ */
+typedef enum mh_result (*mh_blocking_fn)(qpid::types::Variant::Map &args,
+                                         qpid::types::Variant::Map &results,
+                                         void *userdata);
+
 struct MatahariAgentImpl;
 
 class MatahariAgent
@@ -110,15 +174,92 @@ public:
     MatahariAgent();
     virtual ~MatahariAgent();
 
+    /**
+     * Register the agent's QMF schemas.
+     *
+     * Called before setup(), and again on the new session whenever the
+     * connection to the broker has been re-established.
+     *
+     * \param[in] session the QMF session
+     */
+    virtual void registerSchemas(qmf::AgentSession session) {};
+
+    /**
+     * Register the agent's own command line options.
+     *
+     * Called by init() before the command line is parsed, so that options
+     * only one agent understands are not offered by every agent.  Options
+     * added to \p options with mh_add_map_option() are then available from
+     * getOptions().
+     *
+     * \param[in] options the map the option values are stored in
+     */
+    virtual void registerOptions(qpid::types::Variant::Map &options) {};
     virtual int setup(qmf::AgentSession session) { return 0; };
+
+    /**
+     * Called once the connection to the broker has been re-established and
+     * the agent's objects have been published on the new session.
+     *
+     * \param[in] session the new QMF session
+     */
+    virtual void reconnected(qmf::AgentSession session) {};
     virtual gboolean invoke(qmf::AgentSession session, qmf::AgentEvent event,
                             gpointer user_data) { return FALSE; };
     int init(int argc, char **argv, const char* proc_name);
     void run();
 
+    /**
+     * Serve this agent's classes from another agent's session.
+     *
+     * Used by agents hosting several classes in one process.  Instead of
+     * calling init(), the hosted agent shares the parent's broker connection,
+     * session and worker pool and is set up on the parent's session.  The
+     * parent is responsible for passing method calls on to invoke().
+     *
+     * \param[in] parent the agent owning the session
+     *
+     * \return the result of setup()
+     */
+    int attach(MatahariAgent *parent);
+
 protected:
     qmf::AgentSession& getSession(void);
 
+    /**
+     * Get the options the agent was started with.
+     */
+    qpid::types::Variant::Map& getOptions(void);
+
+    /**
+     * Publish a data object on the agent's session.
+     *
+     * Objects added here are published again, with their current property
+     * values, after the connection to the broker has been re-established.
+     *
+     * \param[in] data the data object
+     * \param[in] name the object name, generated by QMF if empty
+     *
+     * \return the address of the object
+     */
+    qmf::DataAddr addData(qmf::Data &data, const std::string &name = "");
+
+    /**
+     * Handle a method call that may block for a significant amount of time.
+     *
+     * If the agent was started with --worker-threads, the handler runs on a
+     * worker thread and the reply is sent from the main loop once it is done.
+     * Otherwise it is called directly.  The handler must not use the session
+     * or any QMF data owned by the agent.
+     *
+     * \param[in] session the session the method call was received on
+     * \param[in] event the method call
+     * \param[in] fn the handler
+     * \param[in] userdata passed to the handler
+     */
+    void runBlocking(qmf::AgentSession session, qmf::AgentEvent event,
+                     mh_blocking_fn fn, void *userdata);
+
 private:
     // Disallow default copy constructor/assignment
     MatahariAgent(const MatahariAgent&);
@@ -44,11 +44,30 @@
  *             - "Agent", reset on each execution of the agent serving up this information.
  *             - "Custom", set by mh_host_set_uuid()
  *
+ * Hosts without an SMBIOS UUID use their cloud instance id as the "Hardware"
+ * UUID.  It is looked up in the background, so it is reported as
+ * "not-available" until the lookup completes.
+ *
  * \return the UUID
  */
 const char *
 mh_host_get_uuid(const char *lifetime);
 
+/** Default URL of the instance id of the cloud metadata service */
+#define MH_HOST_METADATA_URL "http://169.254.169.254/latest/meta-data/instance-id"
+
+/**
+ * Set the URL of the cloud metadata service.
+ *
+ * The instance id found there is used as the Hardware UUID of hosts without
+ * an SMBIOS UUID.  This must be called before the Hardware UUID is first
+ * requested.
+ *
+ * \param[in] url URL of the instance-id, see MH_HOST_METADATA_URL
+ */
+void
+mh_host_set_metadata_url(const char *url);
+
 /**
  * Set a custom UUID for this host.
  *
@@ -77,6 +96,94 @@ mh_host_get_cpu_model(void);
 const char *
 mh_host_get_cpu_flags(void);
 
+/**
+ * A processor cache, as seen from the first CPU.
+ */
+struct mh_host_cache {
+    /** Name of the cache, e.g. "L1d", "L1i", "L2" or "L3" */
+    char name[8];
+    /** Size of the cache, in kb */
+    uint64_t size;
+    /** List of the CPUs sharing the cache, e.g. "0,4" or "0-7" */
+    char shared_cpus[128];
+};
+
+/**
+ * A NUMA node.
+ */
+struct mh_host_numa_node {
+    unsigned int id;
+    /** List of the CPUs of the node, e.g. "0-3,8-11" */
+    char cpus[256];
+    /** Amount of memory of the node, in kb */
+    uint64_t memory;
+};
+
+#define MH_HOST_MAX_CACHES 8
+
+/**
+ * Processor and memory topology of a host.
+ */
+struct mh_host_topology {
+    /** Number of processor packages */
+    unsigned int sockets;
+    /** Number of physical cores */
+    unsigned int cores;
+    /** Number of logical CPUs */
+    unsigned int threads;
+    /** Whether simultaneous multithreading is active */
+    gboolean smt;
+    unsigned int nnodes;
+    struct mh_host_numa_node *nodes;
+    unsigned int ncaches;
+    struct mh_host_cache caches[MH_HOST_MAX_CACHES];
+};
+
+/**
+ * Get the processor and memory topology of the host.
+ *
+ * The topology is collected on the first call only.
+ *
+ * \return the topology, which must not be freed
+ */
+const struct mh_host_topology *
+mh_host_get_topology(void);
+
+/**
+ * Get the amount of available memory of each NUMA node.
+ *
+ * \param[out] free_mem the available memory of each node, in kb, in the
+ *             order of the nodes of mh_host_get_topology()
+ * \param[in]  nnodes number of entries in free_mem
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_get_numa_free_mem(uint64_t *free_mem, unsigned int nnodes);
+
+/**
+ * Check whether the host's processors support a feature.
+ *
+ * Common x86 features are detected with cpuid and kept in a bitset, other
+ * features are looked up in mh_host_get_cpu_flags().
+ *
+ * \param[in] name the feature, as named in /proc/cpuinfo (e.g. "avx2").
+ *            "sse3", "lzcnt" and "sha" are accepted as well.
+ *
+ * \return TRUE if the feature is supported
+ */
+gboolean
+mh_host_has_cpu_feature(const char *name);
+
+/**
+ * Get the x86-64 micro-architecture level of the host's processors.
+ *
+ * \return "x86-64", "x86-64-v2", "x86-64-v3" or "x86-64-v4", or an empty
+ *         string if the host is not x86-64
+ */
+const char *
+mh_host_get_isa_level(void);
+
 uint64_t
 mh_host_get_memory(void);
 
@@ -121,6 +228,626 @@ mh_host_get_load_averages(sigar_loadavg_t *avg);
 void
 mh_host_get_processes(sigar_proc_stat_t *procs);
 
+/**
+ * Host statistics collected together by mh_host_get_snapshot().
+ */
+struct mh_host_snapshot {
+    /** When the snapshot was taken, in seconds since the epoch */
+    uint64_t timestamp;
+    /** Total amount of primary memory, in kb */
+    uint64_t mem_total;
+    /** Amount of available primary memory, in kb */
+    uint64_t mem_free;
+    /** Total amount of swap, in kb */
+    uint64_t swap_total;
+    /** Amount of available swap, in kb */
+    uint64_t swap_free;
+    /** The one/five/fifteen minute load averages */
+    double loadavg[3];
+    /** Number of processes in each possible state */
+    sigar_proc_stat_t procs;
+};
+
+/**
+ * Collect the host's memory, swap, load and process statistics.
+ *
+ * This gathers the same values as mh_host_get_mem_free(),
+ * mh_host_get_swap_free(), mh_host_get_load_averages() and
+ * mh_host_get_processes(), but in a single pass.  On Linux the procfs
+ * files involved are kept open between calls, so taking a snapshot
+ * periodically does not allocate any memory.
+ *
+ * \note This function is not thread safe.
+ *
+ * \param[out] snapshot the statistics
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_get_snapshot(struct mh_host_snapshot *snapshot);
+
+/**
+ * Utilization of a CPU, in percent of its time.
+ */
+struct mh_host_cpu_utilization {
+    /** Time spent in user mode, including niced processes */
+    double user;
+    /** Time spent in the kernel, including interrupt handling */
+    double system;
+    /** Time spent idle while waiting for I/O to complete */
+    double iowait;
+    /** Time stolen by the hypervisor for other guests */
+    double steal;
+    /** Time spent idle */
+    double idle;
+};
+
+/**
+ * Get the utilization of the host's CPUs.
+ *
+ * The utilization covers the time since the previous call to this function,
+ * or since boot for the first call.  The CPU time counters from the previous
+ * call are kept in arrays allocated by the first call, so on Linux later
+ * calls take a single read of /proc/stat and no allocations.
+ *
+ * \note This function is not thread safe.
+ *
+ * \param[out] total the aggregate utilization of all CPUs
+ * \param[out] cpus the utilization of each logical CPU, may be NULL
+ * \param[in]  ncpus the number of entries in cpus, normally
+ *             mh_host_get_cpu_count().  Entries for CPUs the host doesn't
+ *             have are zeroed.
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_get_cpu_utilization(struct mh_host_cpu_utilization *total,
+                            struct mh_host_cpu_utilization *cpus, int ncpus);
+
+/**
+ * Statistics recorded by a host history.
+ */
+enum mh_host_history_field {
+    MH_HOST_HISTORY_FREE_MEM,
+    MH_HOST_HISTORY_FREE_SWAP,
+    MH_HOST_HISTORY_LOAD_1,
+    MH_HOST_HISTORY_LOAD_5,
+    MH_HOST_HISTORY_LOAD_15,
+    MH_HOST_HISTORY_PROCESSES,
+    MH_HOST_HISTORY_CPU_BUSY,
+    /** Number of fields, not a field */
+    MH_HOST_HISTORY_FIELDS
+};
+
+/**
+ * One interval of a downsampled history series.
+ */
+struct mh_host_history_bucket {
+    /** Start of the interval, in seconds since the epoch */
+    uint64_t start;
+    /** Number of samples in the interval */
+    unsigned int samples;
+    double min;
+    double avg;
+    double max;
+};
+
+/**
+ * A fixed size history of host statistics samples.
+ */
+struct mh_host_history;
+
+/**
+ * Create a host history.
+ *
+ * All the memory of the history is allocated here.  Once full, each new
+ * sample replaces the oldest one.
+ *
+ * \param[in] capacity the number of samples to keep
+ *
+ * \return the history, free it with mh_host_history_free()
+ */
+struct mh_host_history *
+mh_host_history_new(unsigned int capacity);
+
+void
+mh_host_history_free(struct mh_host_history *history);
+
+/**
+ * Get the number of samples in a host history.
+ */
+unsigned int
+mh_host_history_count(const struct mh_host_history *history);
+
+/**
+ * Record a sample in a host history.
+ *
+ * \param[in] history the history
+ * \param[in] snapshot the host statistics to record, including the timestamp
+ * \param[in] cpu the aggregate CPU utilization, or NULL if unknown
+ */
+void
+mh_host_history_add(struct mh_host_history *history,
+                    const struct mh_host_snapshot *snapshot,
+                    const struct mh_host_cpu_utilization *cpu);
+
+/**
+ * Get the name of a host history field.
+ *
+ * \return the name, which is the name of the matching Host statistic
+ *         where there is one (e.g. "free_mem", "load.1")
+ */
+const char *
+mh_host_history_field_name(enum mh_host_history_field field);
+
+/**
+ * Look up a host history field by name.
+ *
+ * \return the field, or MH_HOST_HISTORY_FIELDS if there is no such field
+ */
+enum mh_host_history_field
+mh_host_history_field_from_name(const char *name);
+
+/**
+ * Downsample one field of a host history.
+ *
+ * Samples taken at or after 'since' are grouped into intervals of
+ * 'resolution' seconds, aligned to multiples of the resolution.  Intervals
+ * without samples are skipped, so the buckets are the same for every field.
+ *
+ * \param[in]  history the history
+ * \param[in]  field the field to downsample
+ * \param[in]  since the time of the oldest samples wanted, in seconds since
+ *             the epoch
+ * \param[in]  resolution the length of each interval, in seconds
+ * \param[out] buckets the min/avg/max of each interval, oldest first
+ * \param[in]  nbuckets the number of entries in buckets.  Enough for every
+ *             sample is mh_host_history_count().
+ *
+ * \return the number of buckets filled
+ */
+unsigned int
+mh_host_history_query(const struct mh_host_history *history,
+                      enum mh_host_history_field field,
+                      uint64_t since, unsigned int resolution,
+                      struct mh_host_history_bucket *buckets,
+                      unsigned int nbuckets);
+
+/**
+ * A threshold alert on a host statistic.
+ */
+struct mh_host_alert {
+    /** Name of the alert */
+    char name[64];
+    /** The rule as given to mh_host_alerts_add() */
+    char rule[128];
+    /** The statistic checked */
+    enum mh_host_history_field field;
+    /** TRUE if the alert is raised above the threshold, FALSE if below */
+    gboolean above;
+    /** The threshold, in the units of the statistic */
+    double threshold;
+    /** The value the statistic must get back to for the alert to clear */
+    double clear;
+    /** How long a crossing must last to count, in seconds */
+    unsigned int hold;
+    /** Whether the alert is currently raised */
+    gboolean active;
+    /** Whether a crossing is being held, and since when */
+    gboolean pending;
+    uint64_t pending_since;
+};
+
+/**
+ * A set of threshold alerts.
+ */
+struct mh_host_alerts;
+
+/**
+ * Called by mh_host_alerts_check() whenever an alert is raised or cleared.
+ *
+ * \param[in] alert the alert, with active already updated
+ * \param[in] value the value of the statistic
+ * \param[in] userdata as given to mh_host_alerts_check()
+ */
+typedef void (*mh_host_alert_fn)(const struct mh_host_alert *alert,
+                                 double value, void *userdata);
+
+struct mh_host_alerts *
+mh_host_alerts_new(void);
+
+void
+mh_host_alerts_free(struct mh_host_alerts *alerts);
+
+/**
+ * Add a threshold alert.
+ *
+ * Rules have the form "<field> <|> <threshold>", where the field is one of
+ * the host history fields (see mh_host_history_field_name()).  The
+ * threshold is a number, optionally followed by:
+ *  - "%", a percentage of the total memory or swap, for free_mem and
+ *    free_swap,
+ *  - "*cores", a multiple of the number of CPUs.
+ *
+ * For example "free_mem < 5%" or "load.1 > 2*cores".
+ *
+ * \param[in] alerts the alert set
+ * \param[in] name the name of the alert, replacing any alert of that name
+ * \param[in] rule the rule
+ * \param[in] hysteresis how far back, in percent of the threshold, the
+ *            statistic must go for the alert to clear
+ * \param[in] hold how long, in seconds, a crossing of the threshold must
+ *            last before the alert is raised or cleared
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_alerts_add(struct mh_host_alerts *alerts, const char *name,
+                   const char *rule, double hysteresis, unsigned int hold);
+
+/**
+ * Remove a threshold alert.
+ *
+ * \retval MH_RES_SUCCESS the alert was removed
+ * \retval MH_RES_INVALID_ARGS there is no alert of that name
+ */
+enum mh_result
+mh_host_alerts_remove(struct mh_host_alerts *alerts, const char *name);
+
+unsigned int
+mh_host_alerts_count(const struct mh_host_alerts *alerts);
+
+/**
+ * Get an alert by index, from 0 to mh_host_alerts_count() - 1.
+ */
+const struct mh_host_alert *
+mh_host_alerts_get(const struct mh_host_alerts *alerts, unsigned int index);
+
+/**
+ * Check the alerts against new statistics.
+ *
+ * This does not allocate any memory.
+ *
+ * \param[in] alerts the alert set
+ * \param[in] snapshot the host statistics, including the timestamp
+ * \param[in] cpu the aggregate CPU utilization, or NULL if unknown
+ * \param[in] fn called for each alert raised or cleared
+ * \param[in] userdata passed to fn
+ */
+void
+mh_host_alerts_check(struct mh_host_alerts *alerts,
+                     const struct mh_host_snapshot *snapshot,
+                     const struct mh_host_cpu_utilization *cpu,
+                     mh_host_alert_fn fn, void *userdata);
+
+/**
+ * I/O statistics of a block device, averaged since the previous update.
+ */
+struct mh_host_disk_io {
+    /** Name of the device, e.g. "sda" or "dm-3" */
+    char name[32];
+    /** Reads completed per second */
+    double reads;
+    /** Writes completed per second */
+    double writes;
+    /** MB read per second */
+    double read_mb;
+    /** MB written per second */
+    double write_mb;
+    /** Average number of requests in flight */
+    double queue;
+    /** Average time to complete a request, in ms */
+    double await;
+};
+
+/** Include partitions, as well as whole disks */
+#define MH_HOST_DISK_PARTITIONS 0x1
+/** Include loop, ram and zram devices */
+#define MH_HOST_DISK_VIRTUAL    0x2
+
+/**
+ * The I/O counters of the block devices, as of the previous update.
+ */
+struct mh_host_disks;
+
+/**
+ * Start collecting block device I/O statistics.
+ *
+ * \param[in] include which devices to report other than disks, a bitwise
+ *            or of MH_HOST_DISK_PARTITIONS and MH_HOST_DISK_VIRTUAL
+ */
+struct mh_host_disks *
+mh_host_disks_new(unsigned int include);
+
+void
+mh_host_disks_free(struct mh_host_disks *disks);
+
+/**
+ * Update the I/O statistics of the block devices.
+ *
+ * The first update, and the first one after a device appears, report no
+ * I/O for it.
+ *
+ * \param[in]  disks the collector
+ * \param[out] io the statistics of each device, valid until the next update
+ * \param[out] count number of entries in io
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_disks_update(struct mh_host_disks *disks,
+                     const struct mh_host_disk_io **io, unsigned int *count);
+
+/**
+ * Capacity and inode usage of a mounted filesystem.
+ */
+struct mh_host_filesystem {
+    const char *mount_point;
+    /** The mounted device, e.g. "/dev/sda1" or "server:/export" */
+    const char *device;
+    const char *type;
+    /** Size, free and available (to unprivileged users) space, in kb */
+    uint64_t size;
+    uint64_t free;
+    uint64_t avail;
+    uint64_t inodes;
+    uint64_t inodes_free;
+    /** The values are from an earlier update, statvfs() did not complete */
+    gboolean stale;
+};
+
+/**
+ * The mounted filesystems, as of the previous update.
+ */
+struct mh_host_filesystems;
+
+/**
+ * Start collecting filesystem statistics.
+ *
+ * Only filesystems backed by a device or a network share are reported, and
+ * each of them only once, however many times it is mounted.
+ *
+ * \param[in] timeout how long, in ms, an update waits for the statistics of
+ *            a filesystem (e.g. of a hung NFS server) before reporting it
+ *            as stale
+ */
+struct mh_host_filesystems *
+mh_host_filesystems_new(unsigned int timeout);
+
+void
+mh_host_filesystems_free(struct mh_host_filesystems *filesystems);
+
+/**
+ * Update the statistics of the mounted filesystems.
+ *
+ * The mount table is only parsed again when it has changed.
+ *
+ * \param[in]  filesystems the collector
+ * \param[out] list the statistics of each filesystem, valid until the next
+ *             update
+ * \param[out] count number of entries in list
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_filesystems_update(struct mh_host_filesystems *filesystems,
+                           const struct mh_host_filesystem **list,
+                           unsigned int *count);
+
+/**
+ * How to rank processes.
+ */
+enum mh_host_process_sort {
+    /** By CPU time used since the previous update */
+    MH_HOST_PROCESS_CPU,
+    /** By resident memory */
+    MH_HOST_PROCESS_RSS,
+};
+
+/**
+ * Resource usage of a process.
+ */
+struct mh_host_process {
+    unsigned int pid;
+    char name[16];
+    /** CPU time used since the previous update, in percent of one CPU */
+    double cpu;
+    /** Resident memory, in kb */
+    uint64_t rss;
+};
+
+/**
+ * The processes of the host, as of the previous update.
+ */
+struct mh_host_processes;
+
+struct mh_host_processes *
+mh_host_processes_new(void);
+
+void
+mh_host_processes_free(struct mh_host_processes *processes);
+
+/**
+ * Update the resource usage of the processes.
+ *
+ * Processes are read once each, however many threads they have.
+ *
+ * \param[in] processes the tracker
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_processes_update(struct mh_host_processes *processes);
+
+/**
+ * Get the processes using the most resources, as of the latest update.
+ *
+ * \param[in]  processes the tracker
+ * \param[in]  sort how to rank the processes
+ * \param[out] top the top processes, highest first
+ * \param[in]  n number of entries in top
+ *
+ * \return the number of entries of top that were set
+ */
+unsigned int
+mh_host_processes_top(struct mh_host_processes *processes,
+                      enum mh_host_process_sort sort,
+                      struct mh_host_process *top, unsigned int n);
+
+/**
+ * Parse a process sort order, "cpu" (the default, if empty) or "rss".
+ *
+ * \param[in]  name the name of the sort order
+ * \param[out] sort the sort order
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+mh_host_process_sort_from_name(const char *name,
+                               enum mh_host_process_sort *sort);
+
+/**
+ * A resource the kernel reports pressure stall information (PSI) for.
+ */
+enum mh_host_pressure_resource {
+    MH_HOST_PRESSURE_CPU,
+    MH_HOST_PRESSURE_MEMORY,
+    MH_HOST_PRESSURE_IO,
+    /** Number of resources, not a resource */
+    MH_HOST_PRESSURE_RESOURCES,
+};
+
+/**
+ * Share of time tasks were stalled waiting for a resource.
+ */
+struct mh_host_pressure_stall {
+    /** Averages over the last 10, 60 and 300 seconds, in percent */
+    double avg10;
+    double avg60;
+    double avg300;
+    /** Total stall time since boot, in us */
+    uint64_t total;
+};
+
+/**
+ * Pressure stall information of a resource.
+ */
+struct mh_host_pressure {
+    /** Time at least one task was stalled */
+    struct mh_host_pressure_stall some;
+    /** Time all non-idle tasks were stalled at once (zero for cpu on older
+     *  kernels) */
+    struct mh_host_pressure_stall full;
+};
+
+/**
+ * Get the name of a pressure resource, "cpu", "memory" or "io".
+ */
+const char *
+mh_host_pressure_resource_name(enum mh_host_pressure_resource resource);
+
+/**
+ * Get the pressure stall information of a resource.
+ *
+ * \param[in]  resource the resource
+ * \param[out] pressure the pressure
+ *
+ * \retval MH_RES_SUCCESS the pressure was read
+ * \retval MH_RES_NOT_IMPLEMENTED the kernel does not report pressure
+ */
+enum mh_result
+mh_host_get_pressure(enum mh_host_pressure_resource resource,
+                     struct mh_host_pressure *pressure);
+
+/**
+ * A pressure trigger, notified by the kernel.
+ */
+struct mh_host_pressure_trigger {
+    /** Name of the trigger */
+    char name[64];
+    /** The rule as given to mh_host_pressure_triggers_add() */
+    char rule[128];
+    enum mh_host_pressure_resource resource;
+    /** TRUE to watch the time all tasks were stalled, FALSE for some */
+    gboolean full;
+    /** Stall time within the window that fires the trigger, in us */
+    uint64_t stall;
+    /** The window, in us */
+    uint64_t window;
+    /** Number of times the trigger fired */
+    uint64_t fired;
+};
+
+/**
+ * A set of pressure triggers.
+ */
+struct mh_host_pressure_triggers;
+
+/**
+ * Called from the main loop whenever a pressure trigger fires.
+ *
+ * \param[in] trigger the trigger, with fired already updated
+ * \param[in] userdata as given to mh_host_pressure_triggers_new()
+ */
+typedef void (*mh_host_pressure_fn)(const struct mh_host_pressure_trigger *trigger,
+                                    void *userdata);
+
+/**
+ * Create a set of pressure triggers.
+ *
+ * The triggers are watched by the default GLib main context.
+ *
+ * \param[in] fn called whenever a trigger fires
+ * \param[in] userdata passed to fn
+ */
+struct mh_host_pressure_triggers *
+mh_host_pressure_triggers_new(mh_host_pressure_fn fn, void *userdata);
+
+void
+mh_host_pressure_triggers_free(struct mh_host_pressure_triggers *triggers);
+
+/**
+ * Add a pressure trigger.
+ *
+ * Rules have the form "<resource> <some|full> <stall> per <window>", where
+ * the times are numbers followed by "us", "ms" or "s".  For example
+ * "memory some 150ms per 1s" fires when tasks were stalled on memory for
+ * 150ms in total within a 1 second window.  The kernel fires a trigger at
+ * most once per window, and only accepts windows from 500ms to 10s (in
+ * multiples of 2s for unprivileged processes).
+ *
+ * \param[in] triggers the trigger set
+ * \param[in] name the name of the trigger, replacing any trigger of that name
+ * \param[in] rule the rule
+ *
+ * \retval MH_RES_SUCCESS the trigger was added
+ * \retval MH_RES_INVALID_ARGS the rule is invalid or was refused by the kernel
+ * \retval MH_RES_NOT_IMPLEMENTED the kernel does not support pressure triggers
+ */
+enum mh_result
+mh_host_pressure_triggers_add(struct mh_host_pressure_triggers *triggers,
+                              const char *name, const char *rule);
+
+/**
+ * Remove a pressure trigger.
+ *
+ * \retval MH_RES_SUCCESS the trigger was removed
+ * \retval MH_RES_INVALID_ARGS there is no trigger of that name
+ */
+enum mh_result
+mh_host_pressure_triggers_remove(struct mh_host_pressure_triggers *triggers,
+                                 const char *name);
+
+unsigned int
+mh_host_pressure_triggers_count(const struct mh_host_pressure_triggers *triggers);
+
+/**
+ * Get a trigger by index, from 0 to mh_host_pressure_triggers_count() - 1.
+ */
+const struct mh_host_pressure_trigger *
+mh_host_pressure_triggers_get(const struct mh_host_pressure_triggers *triggers,
+                              unsigned int index);
+
 /**
  * Set power management profile.
  *
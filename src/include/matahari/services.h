@@ -27,6 +27,7 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "matahari/mainloop.h"
 
 /* TODO: Autodetect these two in CMakeList.txt */
@@ -102,6 +103,9 @@ enum op_status {
     LRM_OP_ERROR
 };
 
+/** Default limit of the output kept of each action, in bytes */
+#define SVC_DEFAULT_MAX_OUTPUT (128 * 1024)
+
 typedef struct svc_action_private_s svc_action_private_t;
 typedef struct svc_action_s
 {
@@ -123,8 +127,16 @@ typedef struct svc_action_s
     int sequence;
     int expected_rc;
 
+    /**
+     * Output of the action, NUL terminated.  If the action wrote more than
+     * services_set_max_output() allows, the middle is replaced by a note
+     * of how many bytes were left out.
+     */
     char          *stderr_data;
     char          *stdout_data;
+    /** Length of stderr_data and stdout_data, which may contain NULs */
+    size_t         stderr_len;
+    size_t         stdout_len;
 
     /**
      * Data stored by the creator of the action.
@@ -235,10 +247,16 @@ services_action_sync(svc_action_t *op);
 /**
  * Run an action asynchronously.
  *
+ * The action is queued if too many actions are running already (see
+ * services_set_max_running()), or if another action of the same resource
+ * is.  Actions of one resource always run in the order they were requested.
+ * Among those of different resources, queued stop actions start first, then
+ * any other actions but monitor and status ones, then those.
+ *
  * \param[in] op services action data
  * \param[in] action_callback callback for when the action completes
  *
- * \retval TRUE succesfully started execution
+ * \retval TRUE succesfully started or queued execution
  * \retval FALSE failed to start execution, no callback will be received
  */
 gboolean
@@ -247,6 +265,78 @@ services_action_async(svc_action_t *op, void (*action_callback)(svc_action_t *))
 gboolean
 services_action_cancel(const char *name, const char *action, int interval);
 
+/**
+ * Set how many asynchronous actions may run at once.
+ *
+ * \param[in] max the limit, or 0 for twice the number of CPUs
+ */
+void
+services_set_max_running(unsigned int max);
+
+/**
+ * Callback for the output of an action while it runs.
+ *
+ * \param[in] op the action
+ * \param[in] is_stderr whether the output is from stderr rather than stdout
+ * \param[in] data the output, not NUL terminated and possibly containing NULs
+ * \param[in] len the length of data
+ */
+typedef void (*svc_output_fn)(svc_action_t *op, gboolean is_stderr,
+                              const char *data, size_t len);
+
+/**
+ * Have the output of an action passed to a callback while it runs, rather
+ * than collected in stdout_data and stderr_data, which then stay NULL.
+ *
+ * Output is passed in whole lines, once per interval or once max_lines
+ * lines are pending, whichever comes first.  When the action completes,
+ * what is left is passed before the action's callback is called.
+ *
+ * \param[in] op services action data
+ * \param[in] fn the callback
+ * \param[in] interval time between batches, in ms, or 0 for a second
+ * \param[in] max_lines lines after which a batch is passed right away, or 0
+ *            for no limit
+ */
+void
+services_action_stream_output(svc_action_t *op, svc_output_fn fn,
+                              unsigned int interval, unsigned int max_lines);
+
+/**
+ * Set how much of the output of each action, on stdout and on stderr, is
+ * kept.  Of longer output, the first and last max / 2 bytes are kept.
+ *
+ * \param[in] max the limit in bytes, or 0 for SVC_DEFAULT_MAX_OUTPUT
+ */
+void
+services_set_max_output(size_t max);
+
+/**
+ * Statistics of the queue of asynchronous actions.
+ */
+struct svc_queue_stats {
+    /** Actions running, and how many may */
+    unsigned int running;
+    unsigned int max_running;
+    /** Actions waiting to start, and the most that ever waited at once */
+    unsigned int queued;
+    unsigned int max_queued;
+    /** Actions started, and how many of them had to wait */
+    uint64_t started;
+    uint64_t delayed;
+    /** Total and longest time actions waited before starting, in ms */
+    uint64_t wait_total;
+    uint64_t wait_max;
+};
+
+/**
+ * Get the statistics of the queue of asynchronous actions.
+ *
+ * \param[out] stats the statistics
+ */
+void
+services_get_queue_stats(struct svc_queue_stats *stats);
+
 static inline enum ocf_exitcode
 services_get_ocf_exitcode(char *action, int lsb_exitcode)
 {
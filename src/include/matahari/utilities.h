@@ -82,6 +82,18 @@ void
 g_list_free_full(GList *list, GDestroyNotify free_func);
 #endif
 
+#ifndef HAVE_G_GET_MONOTONIC_TIME
+/**
+ * Custom implementation of g_get_monotonic_time()
+ *
+ * This version of g_get_monotonic_time() is only used when the build system
+ * doesn't find g_get_monotonic_time() on the system, which appeared in GLib
+ * 2.28.  It falls back to the wall clock, so it is not monotonic.
+ */
+gint64
+g_get_monotonic_time(void);
+#endif
+
 #define DIMOF(a)    ((int) (sizeof(a) / sizeof(0[a])))
 
 #ifndef __GNUC__
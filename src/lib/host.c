@@ -27,8 +27,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include <glib.h>
 #include <glib/gprintf.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include "matahari/host.h"
 #include "matahari/logging.h"
 #include "host_private.h"
@@ -63,6 +68,105 @@ static cpuinfo_t cpuinfo = {
 static void
 host_get_cpu_details(void);
 
+/* CPU features tracked in the feature bitset */
+enum host_cpu_feature {
+    CPU_SSE,
+    CPU_SSE2,
+    CPU_SSE3,
+    CPU_SSSE3,
+    CPU_SSE4_1,
+    CPU_SSE4_2,
+    CPU_POPCNT,
+    CPU_CX16,
+    CPU_LAHF_LM,
+    CPU_PCLMULQDQ,
+    CPU_AES,
+    CPU_MOVBE,
+    CPU_XSAVE,
+    CPU_AVX,
+    CPU_F16C,
+    CPU_FMA,
+    CPU_RDRAND,
+    CPU_HYPERVISOR,
+    CPU_ABM,
+    CPU_BMI1,
+    CPU_BMI2,
+    CPU_AVX2,
+    CPU_SHA_NI,
+    CPU_AVX512F,
+    CPU_AVX512DQ,
+    CPU_AVX512CD,
+    CPU_AVX512BW,
+    CPU_AVX512VL,
+    CPU_FEATURES
+};
+
+#define CPU_BIT(feature) (G_GUINT64_CONSTANT(1) << (feature))
+
+/* Names as in the flags of /proc/cpuinfo */
+static const char *cpu_feature_names[CPU_FEATURES] = {
+    [CPU_SSE]        = "sse",
+    [CPU_SSE2]       = "sse2",
+    [CPU_SSE3]       = "pni",
+    [CPU_SSSE3]      = "ssse3",
+    [CPU_SSE4_1]     = "sse4_1",
+    [CPU_SSE4_2]     = "sse4_2",
+    [CPU_POPCNT]     = "popcnt",
+    [CPU_CX16]       = "cx16",
+    [CPU_LAHF_LM]    = "lahf_lm",
+    [CPU_PCLMULQDQ]  = "pclmulqdq",
+    [CPU_AES]        = "aes",
+    [CPU_MOVBE]      = "movbe",
+    [CPU_XSAVE]      = "xsave",
+    [CPU_AVX]        = "avx",
+    [CPU_F16C]       = "f16c",
+    [CPU_FMA]        = "fma",
+    [CPU_RDRAND]     = "rdrand",
+    [CPU_HYPERVISOR] = "hypervisor",
+    [CPU_ABM]        = "abm",
+    [CPU_BMI1]       = "bmi1",
+    [CPU_BMI2]       = "bmi2",
+    [CPU_AVX2]       = "avx2",
+    [CPU_SHA_NI]     = "sha_ni",
+    [CPU_AVX512F]    = "avx512f",
+    [CPU_AVX512DQ]   = "avx512dq",
+    [CPU_AVX512CD]   = "avx512cd",
+    [CPU_AVX512BW]   = "avx512bw",
+    [CPU_AVX512VL]   = "avx512vl",
+};
+
+/* Common names that differ from the /proc/cpuinfo ones */
+static const struct {
+    const char *alias;
+    enum host_cpu_feature feature;
+} cpu_feature_aliases[] = {
+    { "sse3",  CPU_SSE3 },
+    { "lzcnt", CPU_ABM },
+    { "sha",   CPU_SHA_NI },
+};
+
+/* Features required by each x86-64 micro-architecture level */
+#define ISA_LEVEL_V2 (CPU_BIT(CPU_CX16) | CPU_BIT(CPU_LAHF_LM)          \
+                      | CPU_BIT(CPU_POPCNT) | CPU_BIT(CPU_SSE3)         \
+                      | CPU_BIT(CPU_SSE4_1) | CPU_BIT(CPU_SSE4_2)       \
+                      | CPU_BIT(CPU_SSSE3))
+#define ISA_LEVEL_V3 (ISA_LEVEL_V2 | CPU_BIT(CPU_AVX) | CPU_BIT(CPU_AVX2) \
+                      | CPU_BIT(CPU_BMI1) | CPU_BIT(CPU_BMI2)           \
+                      | CPU_BIT(CPU_F16C) | CPU_BIT(CPU_FMA)            \
+                      | CPU_BIT(CPU_ABM) | CPU_BIT(CPU_MOVBE)           \
+                      | CPU_BIT(CPU_XSAVE))
+#define ISA_LEVEL_V4 (ISA_LEVEL_V3 | CPU_BIT(CPU_AVX512F)               \
+                      | CPU_BIT(CPU_AVX512BW) | CPU_BIT(CPU_AVX512CD)   \
+                      | CPU_BIT(CPU_AVX512DQ) | CPU_BIT(CPU_AVX512VL))
+
+static struct {
+    gboolean probed;
+    uint64_t bits;
+} cpu_features = {
+    .probed = FALSE,
+    .bits   = 0,
+};
+
 static void
 init(void)
 {
@@ -145,6 +249,254 @@ mh_host_get_cpu_flags(void)
     return host_os_get_cpu_flags();
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * Set the bit of a feature if the given cpuid register bit is set.  The bit
+ * numbers are spelled out as not all compilers' <cpuid.h> name them all.
+ */
+#define CPUID_FEATURE(bits, reg, bit, feature) \
+    ((bits) |= ((reg) & (1u << (bit))) ? CPU_BIT(feature) : 0)
+
+static gboolean
+host_cpu_features_cpuid(uint64_t *bits)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int max_leaf;
+    gboolean avx_usable = FALSE, avx512_usable = FALSE;
+
+    if (!(max_leaf = __get_cpuid_max(0, NULL))
+        || !__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return FALSE;
+    }
+
+    CPUID_FEATURE(*bits, edx, 25, CPU_SSE);
+    CPUID_FEATURE(*bits, edx, 26, CPU_SSE2);
+    CPUID_FEATURE(*bits, ecx, 0, CPU_SSE3);
+    CPUID_FEATURE(*bits, ecx, 1, CPU_PCLMULQDQ);
+    CPUID_FEATURE(*bits, ecx, 9, CPU_SSSE3);
+    CPUID_FEATURE(*bits, ecx, 13, CPU_CX16);
+    CPUID_FEATURE(*bits, ecx, 19, CPU_SSE4_1);
+    CPUID_FEATURE(*bits, ecx, 20, CPU_SSE4_2);
+    CPUID_FEATURE(*bits, ecx, 22, CPU_MOVBE);
+    CPUID_FEATURE(*bits, ecx, 23, CPU_POPCNT);
+    CPUID_FEATURE(*bits, ecx, 25, CPU_AES);
+    CPUID_FEATURE(*bits, ecx, 26, CPU_XSAVE);
+    CPUID_FEATURE(*bits, ecx, 30, CPU_RDRAND);
+    CPUID_FEATURE(*bits, ecx, 31, CPU_HYPERVISOR);
+
+    /*
+     * The AVX registers are only usable if the OS saves them on context
+     * switches (OSXSAVE), which it advertises in XCR0.
+     */
+    if (ecx & (1u << 27)) {
+        unsigned int xcr0_lo, xcr0_hi;
+
+        __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        avx_usable = (xcr0_lo & 0x6) == 0x6;
+        avx512_usable = (xcr0_lo & 0xe6) == 0xe6;
+    }
+
+    if (avx_usable) {
+        CPUID_FEATURE(*bits, ecx, 12, CPU_FMA);
+        CPUID_FEATURE(*bits, ecx, 28, CPU_AVX);
+        CPUID_FEATURE(*bits, ecx, 29, CPU_F16C);
+    }
+
+    if (max_leaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        CPUID_FEATURE(*bits, ebx, 3, CPU_BMI1);
+        CPUID_FEATURE(*bits, ebx, 8, CPU_BMI2);
+        CPUID_FEATURE(*bits, ebx, 29, CPU_SHA_NI);
+        if (avx_usable) {
+            CPUID_FEATURE(*bits, ebx, 5, CPU_AVX2);
+        }
+        if (avx512_usable) {
+            CPUID_FEATURE(*bits, ebx, 16, CPU_AVX512F);
+            CPUID_FEATURE(*bits, ebx, 17, CPU_AVX512DQ);
+            CPUID_FEATURE(*bits, ebx, 28, CPU_AVX512CD);
+            CPUID_FEATURE(*bits, ebx, 30, CPU_AVX512BW);
+            CPUID_FEATURE(*bits, ebx, 31, CPU_AVX512VL);
+        }
+    }
+
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        CPUID_FEATURE(*bits, ecx, 0, CPU_LAHF_LM);
+        CPUID_FEATURE(*bits, ecx, 5, CPU_ABM);
+    }
+
+    return TRUE;
+}
+#endif
+
+static gboolean
+host_cpu_flags_has(const char *flags, const char *name)
+{
+    size_t len = strlen(name);
+    const char *found = flags;
+
+    while ((found = strstr(found, name))) {
+        if ((found == flags || found[-1] == ' ')
+            && (found[len] == ' ' || found[len] == '\0')) {
+            return TRUE;
+        }
+        found += len;
+    }
+
+    return FALSE;
+}
+
+static uint64_t
+host_get_cpu_features(void)
+{
+    const char *flags;
+    int lpc;
+
+    if (cpu_features.probed) {
+        return cpu_features.bits;
+    }
+    cpu_features.probed = TRUE;
+
+#if defined(__i386__) || defined(__x86_64__)
+    if (host_cpu_features_cpuid(&cpu_features.bits)) {
+        return cpu_features.bits;
+    }
+#endif
+
+    /* Fall back to the flags reported by the OS */
+    flags = host_os_get_cpu_flags();
+    for (lpc = 0; lpc < CPU_FEATURES; lpc++) {
+        if (host_cpu_flags_has(flags, cpu_feature_names[lpc])) {
+            cpu_features.bits |= CPU_BIT(lpc);
+        }
+    }
+
+    return cpu_features.bits;
+}
+
+/*
+ * The collector is platform specific, this only gives it a public type.
+ */
+struct mh_host_filesystems *
+mh_host_filesystems_new(unsigned int timeout)
+{
+    return (struct mh_host_filesystems *) host_os_filesystems_new(timeout);
+}
+
+void
+mh_host_filesystems_free(struct mh_host_filesystems *filesystems)
+{
+    host_os_filesystems_free((struct host_filesystems *) filesystems);
+}
+
+enum mh_result
+mh_host_filesystems_update(struct mh_host_filesystems *filesystems,
+                           const struct mh_host_filesystem **list,
+                           unsigned int *count)
+{
+    if (!filesystems) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+
+    return host_os_filesystems_update((struct host_filesystems *) filesystems,
+                                      list, count);
+}
+
+const struct mh_host_topology *
+mh_host_get_topology(void)
+{
+    static struct mh_host_topology *topology = NULL;
+
+    if (topology) {
+        return topology;
+    }
+
+    topology = g_new0(struct mh_host_topology, 1);
+    if (host_os_get_topology(topology) == MH_RES_SUCCESS) {
+        return topology;
+    }
+
+    /* Assume a single socket, single node host */
+    g_free(topology->nodes);
+    memset(topology, 0, sizeof(*topology));
+
+    topology->sockets = 1;
+    topology->cores = mh_host_get_cpu_number_of_cores();
+    topology->threads = mh_host_get_cpu_count();
+    topology->smt = topology->threads > topology->cores;
+    topology->nnodes = 1;
+    topology->nodes = g_new0(struct mh_host_numa_node, 1);
+    topology->nodes[0].memory = mh_host_get_memory();
+    if (topology->threads > 1) {
+        g_snprintf(topology->nodes[0].cpus, sizeof(topology->nodes[0].cpus),
+                   "0-%u", topology->threads - 1);
+    } else {
+        g_snprintf(topology->nodes[0].cpus, sizeof(topology->nodes[0].cpus),
+                   "0");
+    }
+
+    return topology;
+}
+
+enum mh_result
+mh_host_get_numa_free_mem(uint64_t *free_mem, unsigned int nnodes)
+{
+    const struct mh_host_topology *topology = mh_host_get_topology();
+    enum mh_result res;
+
+    res = host_os_get_numa_free_mem(topology, free_mem, nnodes);
+    if (res == MH_RES_NOT_IMPLEMENTED && topology->nnodes == 1 && nnodes > 0) {
+        /* The flat topology's only node has all the memory */
+        free_mem[0] = mh_host_get_mem_free();
+        res = MH_RES_SUCCESS;
+    }
+
+    return res;
+}
+
+gboolean
+mh_host_has_cpu_feature(const char *name)
+{
+    unsigned int lpc;
+
+    if (mh_strlen_zero(name)) {
+        return FALSE;
+    }
+
+    for (lpc = 0; lpc < G_N_ELEMENTS(cpu_feature_aliases); lpc++) {
+        if (!strcasecmp(name, cpu_feature_aliases[lpc].alias)) {
+            return (host_get_cpu_features()
+                    & CPU_BIT(cpu_feature_aliases[lpc].feature)) != 0;
+        }
+    }
+
+    for (lpc = 0; lpc < CPU_FEATURES; lpc++) {
+        if (!strcasecmp(name, cpu_feature_names[lpc])) {
+            return (host_get_cpu_features() & CPU_BIT(lpc)) != 0;
+        }
+    }
+
+    return host_cpu_flags_has(host_os_get_cpu_flags(), name);
+}
+
+const char *
+mh_host_get_isa_level(void)
+{
+#if defined(__x86_64__)
+    uint64_t bits = host_get_cpu_features();
+
+    if ((bits & ISA_LEVEL_V4) == ISA_LEVEL_V4) {
+        return "x86-64-v4";
+    } else if ((bits & ISA_LEVEL_V3) == ISA_LEVEL_V3) {
+        return "x86-64-v3";
+    } else if ((bits & ISA_LEVEL_V2) == ISA_LEVEL_V2) {
+        return "x86-64-v2";
+    }
+    return "x86-64";
+#else
+    return "";
+#endif
+}
+
 int
 mh_host_get_cpu_count(void)
 {
@@ -173,6 +525,164 @@ mh_host_get_processes(sigar_proc_stat_t *procs)
     sigar_proc_stat_get(host_init.sigar, procs);
 }
 
+enum mh_result
+mh_host_get_snapshot(struct mh_host_snapshot *snapshot)
+{
+    sigar_mem_t mem;
+    sigar_swap_t swap;
+    sigar_loadavg_t avg;
+
+    snapshot->timestamp = time(NULL);
+
+    if (host_os_get_snapshot(snapshot) == MH_RES_SUCCESS) {
+        return MH_RES_SUCCESS;
+    }
+
+    init();
+
+    if (sigar_mem_get(host_init.sigar, &mem) != SIGAR_OK
+        || sigar_swap_get(host_init.sigar, &swap) != SIGAR_OK
+        || sigar_loadavg_get(host_init.sigar, &avg) != SIGAR_OK
+        || sigar_proc_stat_get(host_init.sigar, &snapshot->procs) != SIGAR_OK) {
+        return MH_RES_BACKEND_ERROR;
+    }
+
+    snapshot->mem_total = mem.total / 1024;
+    snapshot->mem_free = mem.free / 1024;
+    snapshot->swap_total = swap.total / 1024;
+    snapshot->swap_free = swap.free / 1024;
+    snapshot->loadavg[0] = avg.loadavg[0];
+    snapshot->loadavg[1] = avg.loadavg[1];
+    snapshot->loadavg[2] = avg.loadavg[2];
+
+    return MH_RES_SUCCESS;
+}
+
+/* CPU time counters at the previous mh_host_get_cpu_utilization() call */
+static struct {
+    struct host_cpu_times total;
+    struct host_cpu_times *cpus;
+    struct host_cpu_times *current;
+    int ncpus;
+} cpu_times = {
+    .cpus    = NULL,
+    .current = NULL,
+    .ncpus   = 0,
+};
+
+static enum mh_result
+host_get_cpu_times_sigar(struct host_cpu_times *total,
+                         struct host_cpu_times *cpus, int ncpus)
+{
+    sigar_cpu_t cpu;
+    sigar_cpu_list_t list;
+    unsigned long lpc;
+
+    init();
+
+    if (sigar_cpu_get(host_init.sigar, &cpu) != SIGAR_OK
+        || sigar_cpu_list_get(host_init.sigar, &list) != SIGAR_OK) {
+        return MH_RES_BACKEND_ERROR;
+    }
+
+    total->user = cpu.user + cpu.nice;
+    total->system = cpu.sys + cpu.irq + cpu.soft_irq;
+    total->iowait = cpu.wait;
+    total->steal = cpu.stolen;
+    total->idle = cpu.idle;
+
+    for (lpc = 0; lpc < list.number && lpc < (unsigned long) ncpus; lpc++) {
+        cpus[lpc].user = list.data[lpc].user + list.data[lpc].nice;
+        cpus[lpc].system = list.data[lpc].sys + list.data[lpc].irq
+                           + list.data[lpc].soft_irq;
+        cpus[lpc].iowait = list.data[lpc].wait;
+        cpus[lpc].steal = list.data[lpc].stolen;
+        cpus[lpc].idle = list.data[lpc].idle;
+    }
+
+    sigar_cpu_list_destroy(host_init.sigar, &list);
+    return MH_RES_SUCCESS;
+}
+
+static inline double
+cpu_ticks(uint64_t now, uint64_t prev)
+{
+    /* Counters can go backwards when a CPU is brought back online */
+    return now > prev ? (double) (now - prev) : 0.0;
+}
+
+static void
+host_cpu_utilization(const struct host_cpu_times *prev,
+                     const struct host_cpu_times *now,
+                     struct mh_host_cpu_utilization *util)
+{
+    double user = cpu_ticks(now->user, prev->user);
+    double system = cpu_ticks(now->system, prev->system);
+    double iowait = cpu_ticks(now->iowait, prev->iowait);
+    double steal = cpu_ticks(now->steal, prev->steal);
+    double idle = cpu_ticks(now->idle, prev->idle);
+    double sum = user + system + iowait + steal + idle;
+
+    if (sum == 0.0) {
+        memset(util, 0, sizeof(*util));
+        util->idle = 100.0;
+        return;
+    }
+
+    util->user = 100.0 * user / sum;
+    util->system = 100.0 * system / sum;
+    util->iowait = 100.0 * iowait / sum;
+    util->steal = 100.0 * steal / sum;
+    util->idle = 100.0 * idle / sum;
+}
+
+enum mh_result
+mh_host_get_cpu_utilization(struct mh_host_cpu_utilization *total,
+                            struct mh_host_cpu_utilization *cpus, int ncpus)
+{
+    struct host_cpu_times now_total, *swap;
+    enum mh_result res;
+    int lpc;
+
+    if (!cpu_times.ncpus) {
+        cpu_times.ncpus = mh_host_get_cpu_count();
+        if (cpu_times.ncpus < 1) {
+            cpu_times.ncpus = 1;
+        }
+        cpu_times.cpus = g_new0(struct host_cpu_times, cpu_times.ncpus);
+        cpu_times.current = g_new0(struct host_cpu_times, cpu_times.ncpus);
+    }
+
+    memset(&now_total, 0, sizeof(now_total));
+    memset(cpu_times.current, 0, sizeof(*cpu_times.current) * cpu_times.ncpus);
+
+    res = host_os_get_cpu_times(&now_total, cpu_times.current, cpu_times.ncpus);
+    if (res == MH_RES_NOT_IMPLEMENTED) {
+        res = host_get_cpu_times_sigar(&now_total, cpu_times.current,
+                                       cpu_times.ncpus);
+    }
+    if (res != MH_RES_SUCCESS) {
+        return res;
+    }
+
+    host_cpu_utilization(&cpu_times.total, &now_total, total);
+    for (lpc = 0; cpus && lpc < ncpus; lpc++) {
+        if (lpc < cpu_times.ncpus) {
+            host_cpu_utilization(&cpu_times.cpus[lpc], &cpu_times.current[lpc],
+                                 &cpus[lpc]);
+        } else {
+            memset(&cpus[lpc], 0, sizeof(cpus[lpc]));
+        }
+    }
+
+    cpu_times.total = now_total;
+    swap = cpu_times.cpus;
+    cpu_times.cpus = cpu_times.current;
+    cpu_times.current = swap;
+
+    return MH_RES_SUCCESS;
+}
+
 uint64_t
 mh_host_get_memory(void)
 {
@@ -250,6 +760,15 @@ mh_host_identify(void)
 }
 
 static char *custom_uuid = NULL;
+static char *metadata_url = NULL;
+
+void
+mh_host_set_metadata_url(const char *url)
+{
+    g_free(metadata_url);
+    metadata_url = g_strdup(url);
+}
+
 const char *
 mh_host_get_uuid(const char *lifetime)
 {
@@ -265,13 +784,17 @@ mh_host_get_uuid(const char *lifetime)
         }
         uuid = immutable_uuid;
     } else if (!strcasecmp("hardware", lifetime)) {
-        if (!hardware_uuid) {
+        static gboolean smbios_checked = FALSE;
+
+        if (!hardware_uuid && !smbios_checked) {
             /* Check for a UUID from SMBIOS first. */
             hardware_uuid = host_os_machine_uuid();
+            smbios_checked = TRUE;
         }
         if (!hardware_uuid) {
             /* If SMBIOS wasn't available, then maybe we're on EC2, try that. */
-            hardware_uuid = host_os_ec2_instance_id();
+            hardware_uuid = host_os_ec2_instance_id(
+                metadata_url ? metadata_url : MH_HOST_METADATA_URL);
         }
         uuid = hardware_uuid;
     } else if (!strcasecmp("reboot", lifetime)) {
@@ -0,0 +1,217 @@
+/* host_alerts.c - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "matahari/host.h"
+#include "matahari/logging.h"
+#include "matahari/utilities.h"
+#include "host_private.h"
+
+/*
+ * The rules are compiled into a flat array of struct mh_host_alert, so
+ * checking them is a walk over contiguous memory.
+ */
+struct mh_host_alerts {
+    GArray *rules;
+};
+
+struct mh_host_alerts *
+mh_host_alerts_new(void)
+{
+    struct mh_host_alerts *alerts = g_new0(struct mh_host_alerts, 1);
+
+    alerts->rules = g_array_new(FALSE, TRUE, sizeof(struct mh_host_alert));
+    return alerts;
+}
+
+void
+mh_host_alerts_free(struct mh_host_alerts *alerts)
+{
+    if (!alerts) {
+        return;
+    }
+
+    g_array_free(alerts->rules, TRUE);
+    g_free(alerts);
+}
+
+static int
+host_alerts_find(const struct mh_host_alerts *alerts, const char *name)
+{
+    unsigned int lpc;
+
+    for (lpc = 0; lpc < alerts->rules->len; lpc++) {
+        if (!strcmp(g_array_index(alerts->rules, struct mh_host_alert,
+                                  lpc).name, name)) {
+            return lpc;
+        }
+    }
+
+    return -1;
+}
+
+static enum mh_result
+host_alert_compile(struct mh_host_alert *alert, const char *rule,
+                   double hysteresis)
+{
+    char field[32] = "", op[2] = "", unit[16] = "";
+    double threshold = 0.0;
+
+    if (sscanf(rule, " %31[a-z_.0-9] %1[<>] %lf %15s",
+               field, op, &threshold, unit) < 3) {
+        mh_warn("Could not parse alert rule '%s'", rule);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    alert->field = mh_host_history_field_from_name(field);
+    if (alert->field == MH_HOST_HISTORY_FIELDS) {
+        mh_warn("Unknown statistic '%s' in alert rule '%s'", field, rule);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    if (!strcmp(unit, "%") && alert->field == MH_HOST_HISTORY_FREE_MEM) {
+        threshold = threshold * mh_host_get_memory() / 100.0;
+    } else if (!strcmp(unit, "%") && alert->field == MH_HOST_HISTORY_FREE_SWAP) {
+        threshold = threshold * mh_host_get_swap() / 100.0;
+    } else if (!strcmp(unit, "*cores")) {
+        threshold = threshold * mh_host_get_cpu_count();
+    } else if (!mh_strlen_zero(unit)
+               && !(!strcmp(unit, "%")
+                    && alert->field == MH_HOST_HISTORY_CPU_BUSY)) {
+        mh_warn("Invalid threshold unit '%s' in alert rule '%s'", unit, rule);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    alert->above = (op[0] == '>');
+    alert->threshold = threshold;
+    if (alert->above) {
+        alert->clear = threshold * (1.0 - hysteresis / 100.0);
+    } else {
+        alert->clear = threshold * (1.0 + hysteresis / 100.0);
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+mh_host_alerts_add(struct mh_host_alerts *alerts, const char *name,
+                   const char *rule, double hysteresis, unsigned int hold)
+{
+    struct mh_host_alert alert;
+    enum mh_result res;
+    int index;
+
+    if (mh_strlen_zero(name) || strlen(name) >= sizeof(alert.name)
+        || mh_strlen_zero(rule) || strlen(rule) >= sizeof(alert.rule)
+        || hysteresis < 0.0) {
+        return MH_RES_INVALID_ARGS;
+    }
+
+    memset(&alert, 0, sizeof(alert));
+    mh_string_copy(alert.name, name, sizeof(alert.name));
+    mh_string_copy(alert.rule, rule, sizeof(alert.rule));
+    alert.hold = hold;
+
+    if ((res = host_alert_compile(&alert, rule, hysteresis)) != MH_RES_SUCCESS) {
+        return res;
+    }
+
+    mh_debug("Alert %s: %s %s %f (clears at %f)", alert.name,
+             mh_host_history_field_name(alert.field), alert.above ? ">" : "<",
+             alert.threshold, alert.clear);
+
+    if ((index = host_alerts_find(alerts, name)) >= 0) {
+        g_array_index(alerts->rules, struct mh_host_alert, index) = alert;
+    } else {
+        g_array_append_val(alerts->rules, alert);
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+mh_host_alerts_remove(struct mh_host_alerts *alerts, const char *name)
+{
+    int index;
+
+    if (mh_strlen_zero(name) || (index = host_alerts_find(alerts, name)) < 0) {
+        return MH_RES_INVALID_ARGS;
+    }
+
+    g_array_remove_index(alerts->rules, index);
+    return MH_RES_SUCCESS;
+}
+
+unsigned int
+mh_host_alerts_count(const struct mh_host_alerts *alerts)
+{
+    return alerts->rules->len;
+}
+
+const struct mh_host_alert *
+mh_host_alerts_get(const struct mh_host_alerts *alerts, unsigned int index)
+{
+    if (index >= alerts->rules->len) {
+        return NULL;
+    }
+
+    return &g_array_index(alerts->rules, struct mh_host_alert, index);
+}
+
+void
+mh_host_alerts_check(struct mh_host_alerts *alerts,
+                     const struct mh_host_snapshot *snapshot,
+                     const struct mh_host_cpu_utilization *cpu,
+                     mh_host_alert_fn fn, void *userdata)
+{
+    struct mh_host_alert *alert = (struct mh_host_alert *) alerts->rules->data;
+    struct mh_host_alert *end = alert + alerts->rules->len;
+
+    for (; alert < end; alert++) {
+        double value = host_history_value(alert->field, snapshot, cpu);
+        gboolean crossed;
+
+        if (alert->active) {
+            /* Clearing needs the value back past the hysteresis band */
+            crossed = alert->above ? value < alert->clear : value > alert->clear;
+        } else {
+            crossed = alert->above ? value > alert->threshold
+                                   : value < alert->threshold;
+        }
+
+        if (!crossed) {
+            alert->pending = FALSE;
+            continue;
+        }
+
+        if (!alert->pending) {
+            alert->pending = TRUE;
+            alert->pending_since = snapshot->timestamp;
+        }
+
+        if (snapshot->timestamp - alert->pending_since >= alert->hold) {
+            alert->active = !alert->active;
+            alert->pending = FALSE;
+            fn(alert, value, userdata);
+        }
+    }
+}
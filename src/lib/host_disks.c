@@ -0,0 +1,155 @@
+/* host_disks.c - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "matahari/host.h"
+#include "matahari/utilities.h"
+#include "host_private.h"
+
+/* Block device counters are in 512 byte sectors, whatever the device */
+#define SECTORS_PER_MB 2048.0
+
+struct mh_host_disks {
+    unsigned int include;
+    /** Counters of the previous and current update, swapped each update */
+    GArray *previous;
+    GArray *current;
+    /** struct mh_host_disk_io of the reported devices */
+    GArray *io;
+    gint64 timestamp;
+};
+
+struct mh_host_disks *
+mh_host_disks_new(unsigned int include)
+{
+    struct mh_host_disks *disks = g_new0(struct mh_host_disks, 1);
+
+    disks->include = include;
+    disks->previous = g_array_new(FALSE, TRUE, sizeof(struct host_disk_counters));
+    disks->current = g_array_new(FALSE, TRUE, sizeof(struct host_disk_counters));
+    disks->io = g_array_new(FALSE, TRUE, sizeof(struct mh_host_disk_io));
+    return disks;
+}
+
+void
+mh_host_disks_free(struct mh_host_disks *disks)
+{
+    if (!disks) {
+        return;
+    }
+
+    g_array_free(disks->previous, TRUE);
+    g_array_free(disks->current, TRUE);
+    g_array_free(disks->io, TRUE);
+    g_free(disks);
+}
+
+/*
+ * Find the previous counters of a device.  Devices are listed in the same
+ * order each time, so this is usually the one at the same index.
+ */
+static const struct host_disk_counters *
+previous_counters(const GArray *previous, unsigned int index,
+                  const struct host_disk_counters *cur)
+{
+    const struct host_disk_counters *prev;
+    unsigned int lpc;
+
+    if (index < previous->len) {
+        prev = &g_array_index(previous, struct host_disk_counters, index);
+        if (prev->major == cur->major && prev->minor == cur->minor) {
+            return prev;
+        }
+    }
+
+    for (lpc = 0; lpc < previous->len; lpc++) {
+        prev = &g_array_index(previous, struct host_disk_counters, lpc);
+        if (prev->major == cur->major && prev->minor == cur->minor) {
+            return prev;
+        }
+    }
+
+    return NULL;
+}
+
+enum mh_result
+mh_host_disks_update(struct mh_host_disks *disks,
+                     const struct mh_host_disk_io **io, unsigned int *count)
+{
+    const struct host_disk_counters *cur, *prev;
+    struct mh_host_disk_io *dev;
+    enum mh_result res;
+    gint64 now = g_get_monotonic_time();
+    double elapsed_ms = (now - disks->timestamp) / 1000.0;
+    unsigned int lpc;
+    GArray *tmp;
+
+    res = host_os_get_disk_counters(disks->current, disks->previous);
+    if (res != MH_RES_SUCCESS) {
+        return res;
+    }
+
+    g_array_set_size(disks->io, 0);
+    for (lpc = 0; lpc < disks->current->len; lpc++) {
+        uint64_t requests;
+
+        cur = &g_array_index(disks->current, struct host_disk_counters, lpc);
+        if (cur->kind & ~disks->include) {
+            continue;
+        }
+
+        g_array_set_size(disks->io, disks->io->len + 1);
+        dev = &g_array_index(disks->io, struct mh_host_disk_io,
+                             disks->io->len - 1);
+        g_strlcpy(dev->name, cur->name, sizeof(dev->name));
+
+        prev = previous_counters(disks->previous, lpc, cur);
+        if (!prev || !disks->timestamp || elapsed_ms <= 0
+            || cur->reads < prev->reads || cur->writes < prev->writes) {
+            /* New device, or its counters were reset */
+            continue;
+        }
+
+        dev->reads = (cur->reads - prev->reads) * 1000.0 / elapsed_ms;
+        dev->writes = (cur->writes - prev->writes) * 1000.0 / elapsed_ms;
+        dev->read_mb = (cur->read_sectors - prev->read_sectors)
+                       / SECTORS_PER_MB * 1000.0 / elapsed_ms;
+        dev->write_mb = (cur->write_sectors - prev->write_sectors)
+                        / SECTORS_PER_MB * 1000.0 / elapsed_ms;
+        dev->queue = (cur->weighted_ms - prev->weighted_ms) / elapsed_ms;
+
+        requests = (cur->reads - prev->reads) + (cur->writes - prev->writes);
+        if (requests) {
+            dev->await = (double) ((cur->read_ms - prev->read_ms)
+                                   + (cur->write_ms - prev->write_ms))
+                         / requests;
+        }
+    }
+
+    tmp = disks->previous;
+    disks->previous = disks->current;
+    disks->current = tmp;
+    disks->timestamp = now;
+
+    *io = (const struct mh_host_disk_io *) disks->io->data;
+    *count = disks->io->len;
+    return MH_RES_SUCCESS;
+}
@@ -0,0 +1,255 @@
+/* host_history.c - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "matahari/host.h"
+#include "host_private.h"
+
+/*
+ * The samples are kept as one array per field rather than an array of
+ * structures, so that downsampling a field reads contiguous memory.
+ */
+struct mh_host_history {
+    unsigned int capacity;
+    /** Index of the next sample to write */
+    unsigned int head;
+    unsigned int count;
+    uint64_t *timestamps;
+    double *values[MH_HOST_HISTORY_FIELDS];
+};
+
+static const char *field_names[MH_HOST_HISTORY_FIELDS] = {
+    [MH_HOST_HISTORY_FREE_MEM]  = "free_mem",
+    [MH_HOST_HISTORY_FREE_SWAP] = "free_swap",
+    [MH_HOST_HISTORY_LOAD_1]    = "load.1",
+    [MH_HOST_HISTORY_LOAD_5]    = "load.5",
+    [MH_HOST_HISTORY_LOAD_15]   = "load.15",
+    [MH_HOST_HISTORY_PROCESSES] = "processes",
+    [MH_HOST_HISTORY_CPU_BUSY]  = "cpu_busy",
+};
+
+struct mh_host_history *
+mh_host_history_new(unsigned int capacity)
+{
+    struct mh_host_history *history;
+    int lpc;
+
+    if (capacity == 0) {
+        capacity = 1;
+    }
+
+    history = g_new0(struct mh_host_history, 1);
+    history->capacity = capacity;
+    history->timestamps = g_new0(uint64_t, capacity);
+    for (lpc = 0; lpc < MH_HOST_HISTORY_FIELDS; lpc++) {
+        history->values[lpc] = g_new0(double, capacity);
+    }
+
+    return history;
+}
+
+void
+mh_host_history_free(struct mh_host_history *history)
+{
+    int lpc;
+
+    if (!history) {
+        return;
+    }
+
+    for (lpc = 0; lpc < MH_HOST_HISTORY_FIELDS; lpc++) {
+        g_free(history->values[lpc]);
+    }
+    g_free(history->timestamps);
+    g_free(history);
+}
+
+unsigned int
+mh_host_history_count(const struct mh_host_history *history)
+{
+    return history->count;
+}
+
+void
+mh_host_history_add(struct mh_host_history *history,
+                    const struct mh_host_snapshot *snapshot,
+                    const struct mh_host_cpu_utilization *cpu)
+{
+    unsigned int head = history->head;
+    int lpc;
+
+    history->timestamps[head] = snapshot->timestamp;
+    for (lpc = 0; lpc < MH_HOST_HISTORY_FIELDS; lpc++) {
+        history->values[lpc][head] = host_history_value(lpc, snapshot, cpu);
+    }
+
+    history->head = (head + 1) % history->capacity;
+    if (history->count < history->capacity) {
+        history->count++;
+    }
+}
+
+double
+host_history_value(enum mh_host_history_field field,
+                   const struct mh_host_snapshot *snapshot,
+                   const struct mh_host_cpu_utilization *cpu)
+{
+    switch (field) {
+    case MH_HOST_HISTORY_FREE_MEM:
+        return snapshot->mem_free;
+    case MH_HOST_HISTORY_FREE_SWAP:
+        return snapshot->swap_free;
+    case MH_HOST_HISTORY_LOAD_1:
+        return snapshot->loadavg[0];
+    case MH_HOST_HISTORY_LOAD_5:
+        return snapshot->loadavg[1];
+    case MH_HOST_HISTORY_LOAD_15:
+        return snapshot->loadavg[2];
+    case MH_HOST_HISTORY_PROCESSES:
+        return snapshot->procs.total;
+    case MH_HOST_HISTORY_CPU_BUSY:
+        return cpu ? 100.0 - cpu->idle : 0.0;
+    default:
+        return 0.0;
+    }
+}
+
+const char *
+mh_host_history_field_name(enum mh_host_history_field field)
+{
+    if (field >= MH_HOST_HISTORY_FIELDS) {
+        return NULL;
+    }
+    return field_names[field];
+}
+
+enum mh_host_history_field
+mh_host_history_field_from_name(const char *name)
+{
+    int lpc;
+
+    for (lpc = 0; name && lpc < MH_HOST_HISTORY_FIELDS; lpc++) {
+        if (!strcmp(name, field_names[lpc])) {
+            return lpc;
+        }
+    }
+
+    return MH_HOST_HISTORY_FIELDS;
+}
+
+struct history_scan {
+    uint64_t since;
+    unsigned int resolution;
+    struct mh_host_history_bucket *buckets;
+    unsigned int nbuckets;
+    /** Number of buckets started so far */
+    unsigned int used;
+};
+
+/*
+ * Add the samples in [start, end) of the arrays to the buckets.
+ *
+ * Returns FALSE once there is no room for more buckets.
+ */
+static gboolean
+history_scan_range(struct history_scan *scan, const uint64_t *timestamps,
+                   const double *values, unsigned int start, unsigned int end)
+{
+    struct mh_host_history_bucket *bucket = NULL;
+    unsigned int lpc;
+
+    if (scan->used) {
+        bucket = &scan->buckets[scan->used - 1];
+    }
+
+    for (lpc = start; lpc < end; lpc++) {
+        uint64_t interval;
+
+        if (timestamps[lpc] < scan->since) {
+            continue;
+        }
+
+        interval = timestamps[lpc] - (timestamps[lpc] % scan->resolution);
+        if (!bucket || bucket->start != interval) {
+            if (scan->used == scan->nbuckets) {
+                return FALSE;
+            }
+            bucket = &scan->buckets[scan->used++];
+            bucket->start = interval;
+            bucket->samples = 0;
+            bucket->min = bucket->max = values[lpc];
+            bucket->avg = 0.0;
+        }
+
+        /* avg holds the sum until the scan is done */
+        bucket->samples++;
+        bucket->avg += values[lpc];
+        if (values[lpc] < bucket->min) {
+            bucket->min = values[lpc];
+        }
+        if (values[lpc] > bucket->max) {
+            bucket->max = values[lpc];
+        }
+    }
+
+    return TRUE;
+}
+
+unsigned int
+mh_host_history_query(const struct mh_host_history *history,
+                      enum mh_host_history_field field,
+                      uint64_t since, unsigned int resolution,
+                      struct mh_host_history_bucket *buckets,
+                      unsigned int nbuckets)
+{
+    struct history_scan scan = {
+        .since      = since,
+        .resolution = resolution ? resolution : 1,
+        .buckets    = buckets,
+        .nbuckets   = nbuckets,
+        .used       = 0,
+    };
+    unsigned int oldest, lpc;
+
+    if (field >= MH_HOST_HISTORY_FIELDS || !history->count) {
+        return 0;
+    }
+
+    /* The samples are in at most two contiguous runs, oldest first */
+    oldest = (history->head + history->capacity - history->count)
+             % history->capacity;
+
+    if (oldest < history->head) {
+        history_scan_range(&scan, history->timestamps, history->values[field],
+                           oldest, history->head);
+    } else if (history_scan_range(&scan, history->timestamps,
+                                  history->values[field],
+                                  oldest, history->capacity)) {
+        history_scan_range(&scan, history->timestamps, history->values[field],
+                           0, history->head);
+    }
+
+    for (lpc = 0; lpc < scan.used; lpc++) {
+        buckets[lpc].avg /= buckets[lpc].samples;
+    }
+
+    return scan.used;
+}
@@ -20,16 +20,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
 #include <sys/reboot.h>
 #include <sys/sysinfo.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/statvfs.h>
+#include <poll.h>
 
 #include <linux/reboot.h>
 #include <linux/kd.h>
@@ -40,6 +44,7 @@
 
 #include "matahari/logging.h"
 #include "matahari/host.h"
+#include "matahari/utilities.h"
 
 #include "utilities_private.h"
 #include "host_private.h"
@@ -49,99 +54,131 @@
 
 #define BUFSIZE 4096
 
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+#define PROC_PRESSURE "/proc/pressure"
+
+/*
+ * procfs files read for every host statistics snapshot.  They are opened on
+ * first use and kept open, re-reading them with pread() from the start.
+ */
+static struct {
+    int meminfo;
+    int loadavg;
+    int stat;
+    DIR *proc;
+    char buf[BUFSIZE];
+    char *stat_buf;
+    size_t stat_len;
+    int diskstats;
+    char *diskstats_buf;
+    size_t diskstats_len;
+    /** Per process counters of the last snapshot, and when they were read */
+    GArray *processes;
+    gint64 processes_time;
+} snapshot_files = {
+    .meminfo  = -1,
+    .loadavg  = -1,
+    .stat     = -1,
+    .proc     = NULL,
+    .stat_buf = NULL,
+    .stat_len = 0,
+    .diskstats     = -1,
+    .diskstats_buf = NULL,
+    .diskstats_len = 0,
+    .processes      = NULL,
+    .processes_time = 0,
+};
+
+/*
+ * Find the value of a "key : value" line of /proc/cpuinfo.
+ */
+static char *
+cpuinfo_value(char *line, const char *key)
+{
+    size_t len = strlen(key);
+    char *value;
+
+    if (strncmp(line, key, len) || (line[len] != ' ' && line[len] != '\t'
+                                    && line[len] != ':')) {
+        return NULL;
+    }
+
+    if (!(value = strchr(line + len, ':'))) {
+        return NULL;
+    }
+
+    value++;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    return value;
+}
+
 const char *
 host_os_get_cpu_flags(void)
 {
-    static const char regexstr[] = "(.*\\S)\\s*:\\s*(\\S.*)";
     static char *flags = NULL;
 
-    size_t read_chars = 0;
+    char buffer[16 * 1024];
     size_t data_length = 0;
-    char *buffer = NULL;
-    FILE *input = NULL;
-    const char *pcre_error;
-    int pcre_error_offset;
-    pcre *regex = NULL;
-    char *cur, *next;
+    ssize_t rc;
+    int fd;
+    char *cur, *next, *value;
 
     if (flags) {
         return flags;
     }
 
-    if (!(input = fopen("/proc/cpuinfo", "r"))) {
+    if ((fd = open("/proc/cpuinfo", O_RDONLY | O_CLOEXEC)) < 0) {
+        mh_perror(LOG_WARNING, "Could not open /proc/cpuinfo");
         goto done;
     }
 
-    do {
-        static const size_t chunk = 512;
-
-        buffer = realloc(buffer, chunk + data_length + 1);
-        read_chars = fread(buffer + data_length, 1, chunk, input);
-        data_length += read_chars;
-    } while (read_chars > 0);
+    /*
+     * All processors have the same flags, so only the first processor's
+     * block is needed.  It ends with an empty line.
+     */
+    while (data_length < sizeof(buffer) - 1) {
+        rc = read(fd, buffer + data_length, sizeof(buffer) - 1 - data_length);
+        if (rc <= 0) {
+            break;
+        }
+        data_length += rc;
+        buffer[data_length] = '\0';
+        if (strstr(buffer, "\n\n")) {
+            break;
+        }
+    }
+    close(fd);
 
     if (data_length == 0) {
         mh_warn("Could not read from /proc/cpuinfo");
         goto done;
     }
-
     buffer[data_length] = '\0';
 
-    regex = pcre_compile(regexstr, 0, &pcre_error, &pcre_error_offset, NULL);
-    if (!regex) {
-        mh_err("Unable to compile regular expression '%s' at offset %d: %s",
-               regexstr, pcre_error_offset, pcre_error);
-        goto done;
-    }
-
-    next = buffer;
-    while ((cur = strsep(&next, "\n"))) {
-        static const int expected = 3;
-        size_t len;
-        int match;
-        int found[9];
-
-        match = pcre_exec(regex, NULL, cur, strlen(cur),
-                          0, PCRE_NOTEMPTY, found,
-                          sizeof(found) / sizeof(found[0]));
-
-        if (match != expected) {
-            continue;
+    for (cur = buffer; cur && *cur && *cur != '\n'; cur = next) {
+        if ((next = strchr(cur, '\n'))) {
+            *next++ = '\0';
         }
 
         // PowerPC
-        if (strncmp(cur + found[2], "cpu ", 4)) {
-            char *p = strstr(cur + found[4], "altivec supported");
-            if (p && (p - cur) < found[5]) {
-                flags = strdup("altivec");
-                break;
-            }
-        }
-
-        if (strncmp(cur + found[2], "flags", 5) &&
-            strncmp(cur + found[2], "features", 8)) {
-            continue;
+        if ((value = cpuinfo_value(cur, "cpu"))
+            && strstr(value, "altivec supported")) {
+            flags = strdup("altivec");
+            break;
         }
 
-        len = 1 + found[5] - found[4];
-        if (!(flags = malloc(len))) {
-            goto done;
+        if ((value = cpuinfo_value(cur, "flags"))
+            || (value = cpuinfo_value(cur, "features"))
+            || (value = cpuinfo_value(cur, "Features"))) {
+            flags = strdup(value);
+            break;
         }
-        mh_string_copy(flags, cur + found[4], len);
-        break;
     }
 
 done:
-    if (input) {
-        fclose(input);
-    }
-
-    free(buffer);
-
-    if (regex) {
-        pcre_free(regex);
-    }
-
     if (flags == NULL) {
         flags = strdup("unknown");
     }
@@ -197,8 +234,120 @@ host_os_identify(void)
     return res;
 }
 
-char *
-host_os_machine_uuid(void)
+#define SYSFS_DMI_UUID "/sys/class/dmi/id/product_uuid"
+#define SYSFS_SMBIOS_TABLES "/sys/firmware/dmi/tables"
+#define SYSFS_SMBIOS_ENTRY "/sys/firmware/dmi/tables/smbios_entry_point"
+#define SYSFS_SMBIOS_TABLE "/sys/firmware/dmi/tables/DMI"
+
+/* Erased at boot-time, like the reboot id */
+#define HARDWARE_UUID_CACHE "/var/run/matahari-hardware-uuid"
+
+/*
+ * Read a UUID from a file, ignoring anything that isn't one, such as
+ * errors or the placeholders of unset sysfs attributes.
+ */
+static char *
+uuid_file_read(const char *file)
+{
+    gchar *contents = NULL;
+    char *uuid = NULL;
+    uuid_t buffer;
+
+    if (!g_file_get_contents(file, &contents, NULL, NULL)) {
+        return NULL;
+    }
+
+    g_strstrip(contents);
+    if (uuid_parse(contents, buffer) == 0) {
+        uuid = strdup(contents);
+    }
+
+    g_free(contents);
+    return uuid;
+}
+
+/*
+ * Get the UUID of the System Information (type 1) structure of the SMBIOS
+ * table, formatted as dmidecode does.
+ */
+static char *
+smbios_system_uuid(void)
+{
+    gchar *entry = NULL, *table = NULL;
+    gsize entry_len = 0, table_len = 0, pos = 0;
+    unsigned int version = 0;
+    char *uuid = NULL;
+
+    if (!g_file_get_contents(SYSFS_SMBIOS_ENTRY, &entry, &entry_len, NULL)
+        || !g_file_get_contents(SYSFS_SMBIOS_TABLE, &table, &table_len, NULL)) {
+        goto done;
+    }
+
+    if (entry_len >= 9 && !memcmp(entry, "_SM3_", 5)) {
+        version = (entry[7] << 8) | entry[8];
+    } else if (entry_len >= 8 && !memcmp(entry, "_SM_", 4)) {
+        version = (entry[6] << 8) | entry[7];
+    }
+
+    while (pos + 4 <= table_len) {
+        const guint8 *header = (const guint8 *) table + pos;
+        guint8 type = header[0], length = header[1];
+
+        if (length < 4 || pos + length > table_len || type == 127) {
+            break;
+        }
+
+        if (type == 1 && length >= 0x19) {
+            const guint8 *p = header + 8;
+            gboolean ones = TRUE, zeros = TRUE;
+            int lpc;
+
+            for (lpc = 0; lpc < 16; lpc++) {
+                ones = ones && p[lpc] == 0xFF;
+                zeros = zeros && p[lpc] == 0x00;
+            }
+            if (ones || zeros) {
+                /* "Not Present" or "Not Settable" */
+                break;
+            }
+
+            /* As of SMBIOS 2.6, the first three fields are little-endian */
+            if (version >= 0x0206) {
+                uuid = g_strdup_printf("%02X%02X%02X%02X-%02X%02X-%02X%02X-"
+                                       "%02X%02X-%02X%02X%02X%02X%02X%02X",
+                                       p[3], p[2], p[1], p[0], p[5], p[4],
+                                       p[7], p[6], p[8], p[9], p[10], p[11],
+                                       p[12], p[13], p[14], p[15]);
+            } else {
+                uuid = g_strdup_printf("%02X%02X%02X%02X-%02X%02X-%02X%02X-"
+                                       "%02X%02X-%02X%02X%02X%02X%02X%02X",
+                                       p[0], p[1], p[2], p[3], p[4], p[5],
+                                       p[6], p[7], p[8], p[9], p[10], p[11],
+                                       p[12], p[13], p[14], p[15]);
+            }
+            break;
+        }
+
+        /* Skip the formatted area and the strings, ended by two NULs */
+        pos += length;
+        while (pos + 1 < table_len && (table[pos] || table[pos + 1])) {
+            pos++;
+        }
+        pos += 2;
+    }
+
+done:
+    g_free(entry);
+    g_free(table);
+    return uuid;
+}
+
+/*
+ * Get the SMBIOS UUID by running dmidecode, for kernels without the DMI
+ * sysfs interface.
+ */
+static char *
+dmidecode_system_uuid(void)
 {
     gchar *output = NULL;
     gchar **lines = NULL;
@@ -273,92 +422,280 @@ cleanup:
     return uuid;
 }
 
-struct curl_write_cb_data {
+char *
+host_os_machine_uuid(void)
+{
+    char *uuid = uuid_file_read(HARDWARE_UUID_CACHE);
+    char *smbios = NULL;
+    GError *error = NULL;
+
+    if (uuid) {
+        return uuid;
+    }
+
+    /*
+     * Only readable by root.  The kernel formats it in lower case, while the
+     * UUID has always been reported in upper case, as dmidecode does.
+     */
+    if ((uuid = uuid_file_read(SYSFS_DMI_UUID))) {
+        smbios = g_ascii_strup(uuid, -1);
+        free(uuid);
+    }
+
+    if (!smbios) {
+        smbios = smbios_system_uuid();
+    }
+
+    if (!smbios) {
+        /*
+         * dmidecode reads the same tables, so it is only worth running on
+         * kernels which do not export them, not when the UUID is missing.
+         */
+        if (g_file_test(SYSFS_SMBIOS_TABLES, G_FILE_TEST_IS_DIR)) {
+            mh_debug("No SMBIOS UUID in %s", SYSFS_SMBIOS_TABLES);
+            return NULL;
+        }
+        mh_debug("No SMBIOS tables in sysfs, falling back to dmidecode");
+        return dmidecode_system_uuid();
+    }
+
+    if (g_file_set_contents(HARDWARE_UUID_CACHE, smbios, strlen(smbios),
+                            &error) == FALSE) {
+        mh_info("%s", error->message);
+        g_error_free(error);
+    }
+
+    uuid = strdup(smbios);
+    g_free(smbios);
+    return uuid;
+}
+
+/* Erased at boot-time, so that clones of an instance look it up again */
+#define EC2_INSTANCE_ID_CACHE "/var/run/matahari-ec2-instance-id"
+
+/*
+ * Lookup of the EC2 instance id, driven by a curl multi handle whose sockets
+ * and timeouts are watched by the GLib main loop.
+ */
+static struct {
+    enum {
+        METADATA_UNKNOWN,
+        METADATA_PENDING,
+        METADATA_FOUND,
+        /* Not an EC2 instance, for the lifetime of the process */
+        METADATA_NONE,
+    } state;
+    CURLM *multi;
+    CURL *curl;
+    guint timer;
     char buf[256];
     size_t used;
-};
+    char *instance_id;
+} metadata;
 
 static size_t
-curl_write_cb(void *ptr, size_t size, size_t nmemb, void *userdata)
+metadata_write_cb(void *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    struct curl_write_cb_data *buf = userdata;
-    size_t len;
-
-    len = size * nmemb;
+    size_t len = size * nmemb;
 
-    if (len >= (sizeof(buf->buf) - buf->used)) {
-        mh_err("Buffer not large enough to hold received UC2 instance ID.");
+    if (len >= (sizeof(metadata.buf) - metadata.used)) {
+        mh_err("Buffer not large enough to hold received EC2 instance ID.");
         return 0;
     }
 
-    memcpy(buf->buf + buf->used, ptr, len);
+    memcpy(metadata.buf + metadata.used, ptr, len);
+    metadata.used += len;
+    metadata.buf[metadata.used] = '\0';
 
     return len;
 }
 
-char *
-host_os_ec2_instance_id(void)
+static void
+metadata_done(CURLcode curl_res)
 {
-    CURL *curl;
-    CURLcode curl_res;
     long response = 0;
-    static const char URI[] = "http://169.254.169.254/latest/meta-data/instance-id";
-    struct curl_write_cb_data buf = {
-        .used = 0,
-    };
 
-    if (mh_curl_init() != MH_RES_SUCCESS) {
-        return NULL;
+    if (curl_res != CURLE_OK) {
+        mh_info("No EC2 instance id: request failed. (%d)", curl_res);
+    } else if (curl_easy_getinfo(metadata.curl, CURLINFO_RESPONSE_CODE,
+                                 &response) != CURLE_OK
+               || response < 200 || response > 299) {
+        mh_info("No EC2 instance id: request got response %ld", response);
+    } else if (!mh_strlen_zero(metadata.buf)) {
+        GError *error = NULL;
+
+        metadata.instance_id = strdup(g_strstrip(metadata.buf));
+        if (g_file_set_contents(EC2_INSTANCE_ID_CACHE, metadata.instance_id,
+                                strlen(metadata.instance_id), &error) == FALSE) {
+            mh_info("%s", error->message);
+            g_error_free(error);
+        }
     }
 
-    if (!(curl = curl_easy_init())) {
-        mh_warn("Failed to curl_easy_init()");
-        return NULL;
+    metadata.state = metadata.instance_id ? METADATA_FOUND : METADATA_NONE;
+
+    if (metadata.timer) {
+        g_source_remove(metadata.timer);
+        metadata.timer = 0;
     }
+    curl_multi_remove_handle(metadata.multi, metadata.curl);
+    curl_easy_cleanup(metadata.curl);
+    curl_multi_cleanup(metadata.multi);
+    metadata.curl = NULL;
+    metadata.multi = NULL;
+}
 
-    curl_res = curl_easy_setopt(curl, CURLOPT_URL, URI);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl_easy_setopt of URI '%s' failed. (%d)", URI, curl_res);
-        goto return_cleanup;
+static void
+metadata_check(void)
+{
+    CURLMsg *msg;
+    int pending;
+
+    while (metadata.multi
+           && (msg = curl_multi_info_read(metadata.multi, &pending))) {
+        if (msg->msg == CURLMSG_DONE) {
+            metadata_done(msg->data.result);
+        }
     }
+}
 
-    curl_res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl_easy_setopt of WRITEFUNCTION failed. (%d)", curl_res);
-        goto return_cleanup;
+static gboolean
+metadata_timeout(gpointer data)
+{
+    int running;
+
+    metadata.timer = 0;
+    curl_multi_socket_action(metadata.multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    metadata_check();
+    return FALSE;
+}
+
+static gboolean
+metadata_io(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    int running, action = 0;
+
+    if (condition & G_IO_IN) {
+        action |= CURL_CSELECT_IN;
+    }
+    if (condition & G_IO_OUT) {
+        action |= CURL_CSELECT_OUT;
+    }
+    if (condition & (G_IO_ERR | G_IO_HUP)) {
+        action |= CURL_CSELECT_ERR;
     }
 
-    curl_res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl_easy_setopt of WRITEDATA failed. (%d)", curl_res);
-        goto return_cleanup;
+    curl_multi_socket_action(metadata.multi, g_io_channel_unix_get_fd(channel),
+                             action, &running);
+    metadata_check();
+    return TRUE;
+}
+
+static int
+metadata_socket_cb(CURL *curl, curl_socket_t fd, int what, void *userp,
+                   void *socketp)
+{
+    guint watch = GPOINTER_TO_UINT(socketp);
+    GIOCondition condition = G_IO_ERR | G_IO_HUP;
+    GIOChannel *channel;
+
+    if (watch) {
+        g_source_remove(watch);
+        watch = 0;
     }
 
-    curl_res = curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) 3);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl_easy_setopt of TIMEOUT failed. (%d)", curl_res);
-        goto return_cleanup;
+    if (what != CURL_POLL_REMOVE) {
+        if (what & CURL_POLL_IN) {
+            condition |= G_IO_IN;
+        }
+        if (what & CURL_POLL_OUT) {
+            condition |= G_IO_OUT;
+        }
+
+        channel = g_io_channel_unix_new(fd);
+        watch = g_io_add_watch(channel, condition, metadata_io, NULL);
+        g_io_channel_unref(channel);
     }
 
-    curl_res = curl_easy_perform(curl);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl request for URI '%s' failed. (%d)", URI, curl_res);
-        goto return_cleanup;
+    curl_multi_assign(metadata.multi, fd, GUINT_TO_POINTER(watch));
+    return 0;
+}
+
+static int
+metadata_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    if (metadata.timer) {
+        g_source_remove(metadata.timer);
+        metadata.timer = 0;
     }
 
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
-    if (curl_res != CURLE_OK) {
-        mh_warn("curl_easy_getinfo for RESPONSE_CODE failed. (%d)", curl_res);
-        goto return_cleanup;
+    if (timeout_ms >= 0) {
+        metadata.timer = g_timeout_add(timeout_ms, metadata_timeout, NULL);
+    }
+    return 0;
+}
+
+static enum mh_result
+metadata_start(const char *url)
+{
+    if (mh_curl_init() != MH_RES_SUCCESS) {
+        return MH_RES_OTHER_ERROR;
+    }
+
+    if (!(metadata.multi = curl_multi_init())) {
+        mh_warn("Failed to curl_multi_init()");
+        return MH_RES_OTHER_ERROR;
+    }
+
+    if (!(metadata.curl = curl_easy_init())) {
+        mh_warn("Failed to curl_easy_init()");
+        curl_multi_cleanup(metadata.multi);
+        metadata.multi = NULL;
+        return MH_RES_OTHER_ERROR;
     }
-    if (response < 200 || response > 299) {
-        mh_warn("curl request for URI '%s' got response %ld", URI, response);
+
+    curl_easy_setopt(metadata.curl, CURLOPT_URL, url);
+    curl_easy_setopt(metadata.curl, CURLOPT_WRITEFUNCTION, metadata_write_cb);
+    curl_easy_setopt(metadata.curl, CURLOPT_TIMEOUT, (long) 3);
+    curl_easy_setopt(metadata.curl, CURLOPT_NOSIGNAL, (long) 1);
+
+    curl_multi_setopt(metadata.multi, CURLMOPT_SOCKETFUNCTION, metadata_socket_cb);
+    curl_multi_setopt(metadata.multi, CURLMOPT_TIMERFUNCTION, metadata_timer_cb);
+
+    /* Calls metadata_timer_cb(), which starts the transfer from the loop */
+    if (curl_multi_add_handle(metadata.multi, metadata.curl) != CURLM_OK) {
+        mh_warn("Failed to start request for URI '%s'", url);
+        curl_easy_cleanup(metadata.curl);
+        curl_multi_cleanup(metadata.multi);
+        metadata.curl = NULL;
+        metadata.multi = NULL;
+        return MH_RES_OTHER_ERROR;
     }
 
-return_cleanup:
-    curl_easy_cleanup(curl);
+    mh_debug("Looking up the EC2 instance id at %s", url);
+    return MH_RES_SUCCESS;
+}
+
+char *
+host_os_ec2_instance_id(const char *url)
+{
+    switch (metadata.state) {
+    case METADATA_UNKNOWN:
+        if ((metadata.instance_id = mh_file_first_line(EC2_INSTANCE_ID_CACHE))) {
+            metadata.state = METADATA_FOUND;
+            break;
+        }
+        metadata.state = metadata_start(url) == MH_RES_SUCCESS ?
+                         METADATA_PENDING : METADATA_NONE;
+        return NULL;
+    case METADATA_PENDING:
+    case METADATA_NONE:
+        return NULL;
+    case METADATA_FOUND:
+        break;
+    }
 
-    return mh_strlen_zero(buf.buf) ? NULL : strdup(buf.buf);
+    return strdup(metadata.instance_id);
 }
 
 char *
@@ -479,6 +816,11 @@ exec_command(const char *apath, char *args[], int atimeout, char **stdoutbuf,
             mh_err("kill(%d, KILL) failed: %d", pid, killrc);
         }
 
+        /* Nobody else reaps it, see child_death_dispatch() */
+        if (waitpid(pid, &status, 0) < 0) {
+            mh_perror(LOG_ERR, "waitpid(%d) failed", pid);
+        }
+
     } else if (WIFEXITED(status)) {
         if (WEXITSTATUS(status) > 0)
             res = MH_RES_BACKEND_ERROR;
@@ -596,6 +938,1066 @@ check_profile(const char *profile)
     return rc;
 }
 
+/*
+ * Read the current contents of a kept-open procfs file into buf.
+ *
+ * Returns the number of bytes read, or -1 on error, in which case the file
+ * is closed so that it is reopened by the next call.
+ */
+static ssize_t
+procfs_read(int *fd, const char *path, char *buf, size_t len)
+{
+    ssize_t rc;
+
+    if (*fd < 0 && (*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        mh_perror(LOG_ERR, "Could not open %s", path);
+        return -1;
+    }
+
+    rc = pread(*fd, buf, len - 1, 0);
+    if (rc < 0) {
+        mh_perror(LOG_ERR, "Could not read %s", path);
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    buf[rc] = '\0';
+    return rc;
+}
+
+/*
+ * Value of a "Name:   1234 kB" line of /proc/meminfo.
+ */
+static uint64_t
+meminfo_value(const char *meminfo, const char *name)
+{
+    const char *line = strstr(meminfo, name);
+
+    if (!line) {
+        return 0;
+    }
+
+    return strtoull(line + strlen(name), NULL, 10);
+}
+
+/*
+ * Walk /proc once, counting the processes by state and, if counters is not
+ * NULL, collecting the CPU time and memory of each of them.
+ */
+static enum mh_result
+walk_processes(sigar_proc_stat_t *procs, GArray *counters)
+{
+    static long ticks = 0, page_kb = 0;
+    struct host_process_counters process;
+    struct dirent *entry;
+    char path[NAME_MAX + 8], *name, *field, state;
+    unsigned long utime, stime, vsize;
+    long threads, rss;
+    ssize_t len;
+    int fd, rc;
+
+    if (!snapshot_files.proc && !(snapshot_files.proc = opendir("/proc"))) {
+        mh_perror(LOG_ERR, "Could not open /proc");
+        return MH_RES_BACKEND_ERROR;
+    }
+    if (!ticks) {
+        ticks = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    }
+
+    memset(procs, 0, sizeof(*procs));
+    if (counters) {
+        g_array_set_size(counters, 0);
+    }
+    rewinddir(snapshot_files.proc);
+
+    /* Only the processes are listed in /proc, not their threads */
+    while ((entry = readdir(snapshot_files.proc))) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/stat", entry->d_name);
+        fd = openat(dirfd(snapshot_files.proc), path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            /* The process exited in the meantime */
+            continue;
+        }
+
+        len = read(fd, snapshot_files.buf, sizeof(snapshot_files.buf) - 1);
+        close(fd);
+        if (len <= 0) {
+            continue;
+        }
+        snapshot_files.buf[len] = '\0';
+
+        /* "pid (name) state ...", the name may contain anything */
+        if (!(name = strchr(snapshot_files.buf, '('))
+            || !(field = strrchr(name, ')')) || !field[1]) {
+            continue;
+        }
+
+        /* utime and stime are the 14th and 15th fields, num_threads the
+         * 20th, starttime the 22nd and rss the 24th, the state being the
+         * 3rd */
+        memset(&process, 0, sizeof(process));
+        rc = sscanf(field + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                    "%lu %lu %*d %*d %*d %*d %ld %*d %" SCNu64 " %lu %ld",
+                    &state, &utime, &stime, &threads, &process.start_time,
+                    &vsize, &rss);
+        if (rc < 1) {
+            continue;
+        }
+
+        procs->total++;
+        switch (state) {
+        case 'R':
+            procs->running++;
+            break;
+        case 'S':
+            procs->sleeping++;
+            break;
+        case 'D':
+            procs->idle++;
+            break;
+        case 'T':
+        case 't':
+            procs->stopped++;
+            break;
+        case 'Z':
+            procs->zombie++;
+            break;
+        }
+        if (rc >= 4 && threads > 0) {
+            procs->threads += threads;
+        }
+
+        if (!counters || rc != 7) {
+            continue;
+        }
+        process.pid = strtoul(snapshot_files.buf, NULL, 10);
+        *field = '\0';
+        g_strlcpy(process.name, name + 1, sizeof(process.name));
+        process.cpu_ms = (uint64_t) (utime + stime) * 1000 / ticks;
+        process.rss = rss > 0 ? (uint64_t) rss * page_kb : 0;
+        g_array_append_val(counters, process);
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+static enum mh_result
+snapshot_processes(sigar_proc_stat_t *procs)
+{
+    enum mh_result res;
+    gint64 now;
+
+    /* Keep the per process counters for host_os_get_process_counters(),
+     * usually called right after by the same heartbeat */
+    if (!snapshot_files.processes) {
+        snapshot_files.processes =
+            g_array_new(FALSE, FALSE, sizeof(struct host_process_counters));
+    }
+
+    now = g_get_monotonic_time();
+    res = walk_processes(procs, snapshot_files.processes);
+    snapshot_files.processes_time = res == MH_RES_SUCCESS ? now : 0;
+    return res;
+}
+
+/*
+ * Parse the counters of a "cpu" line of /proc/stat, the name excluded.
+ */
+static char *
+parse_cpu_times(char *line, struct host_cpu_times *times)
+{
+    uint64_t values[8] = { 0, };
+    int lpc;
+
+    /* user nice system idle iowait irq softirq steal [guest guest_nice] */
+    for (lpc = 0; lpc < 8; lpc++) {
+        values[lpc] = strtoull(line, &line, 10);
+    }
+
+    times->user = values[0] + values[1];
+    times->system = values[2] + values[5] + values[6];
+    times->idle = values[3];
+    times->iowait = values[4];
+    times->steal = values[7];
+
+    return strchr(line, '\n');
+}
+
+enum mh_result
+host_os_get_cpu_times(struct host_cpu_times *total,
+                      struct host_cpu_times *cpus, int ncpus)
+{
+    char *line;
+    unsigned long cpu;
+
+    /*
+     * The cpu lines come first, and can take up to ~250 bytes each.  The
+     * rest of the file, which can be large, is not read.
+     */
+    if (!snapshot_files.stat_buf) {
+        snapshot_files.stat_len = 256 * (ncpus + 2);
+        snapshot_files.stat_buf = malloc(snapshot_files.stat_len);
+        if (!snapshot_files.stat_buf) {
+            return MH_RES_OTHER_ERROR;
+        }
+    }
+
+    if (procfs_read(&snapshot_files.stat, "/proc/stat",
+                    snapshot_files.stat_buf, snapshot_files.stat_len) < 0) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+
+    line = snapshot_files.stat_buf;
+    while (line && !strncmp(line, "cpu", 3)) {
+        if (line[3] == ' ') {
+            line = parse_cpu_times(line + 3, total);
+        } else {
+            cpu = strtoul(line + 3, &line, 10);
+            if (cpu < (unsigned long) ncpus) {
+                line = parse_cpu_times(line, &cpus[cpu]);
+            } else {
+                line = strchr(line, '\n');
+            }
+        }
+
+        if (line) {
+            line++;
+        }
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+/*
+ * Read a small sysfs attribute, without its trailing newline.
+ */
+static gboolean
+sysfs_read(const char *path, char *buf, size_t len)
+{
+    ssize_t rc;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return FALSE;
+    }
+
+    rc = read(fd, buf, len - 1);
+    close(fd);
+    if (rc <= 0) {
+        return FALSE;
+    }
+
+    buf[rc] = '\0';
+    if (buf[rc - 1] == '\n') {
+        buf[rc - 1] = '\0';
+    }
+    return TRUE;
+}
+
+static gboolean
+sysfs_read_uint(const char *path, unsigned int *value)
+{
+    char buf[32];
+
+    if (!sysfs_read(path, buf, sizeof(buf))) {
+        return FALSE;
+    }
+
+    *value = strtoul(buf, NULL, 10);
+    return TRUE;
+}
+
+/*
+ * Iterate over a CPU or node list such as "0-3,8,10-11".
+ *
+ * *pos must initially point at the list.  Returns FALSE at the end.
+ */
+static gboolean
+cpulist_next(const char **pos, unsigned int *range_end, unsigned int *value)
+{
+    char *end;
+
+    if (*range_end > *value) {
+        (*value)++;
+        return TRUE;
+    }
+
+    if (!**pos) {
+        return FALSE;
+    }
+
+    *value = *range_end = strtoul(*pos, &end, 10);
+    if (end == *pos) {
+        return FALSE;
+    }
+    if (*end == '-') {
+        *range_end = strtoul(end + 1, &end, 10);
+    }
+    if (*end == ',') {
+        end++;
+    }
+    *pos = end;
+    return TRUE;
+}
+
+static void
+topology_caches(struct mh_host_topology *topology)
+{
+    char path[PATH_MAX], buf[128];
+    unsigned int index, level;
+
+    for (index = 0; topology->ncaches < MH_HOST_MAX_CACHES; index++) {
+        struct mh_host_cache *cache = &topology->caches[topology->ncaches];
+
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu0/cache/index%u/level", index);
+        if (!sysfs_read_uint(path, &level)) {
+            break;
+        }
+
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu0/cache/index%u/type", index);
+        if (!sysfs_read(path, buf, sizeof(buf))) {
+            continue;
+        }
+
+        if (!strcmp(buf, "Data")) {
+            snprintf(cache->name, sizeof(cache->name), "L%ud", level);
+        } else if (!strcmp(buf, "Instruction")) {
+            snprintf(cache->name, sizeof(cache->name), "L%ui", level);
+        } else {
+            snprintf(cache->name, sizeof(cache->name), "L%u", level);
+        }
+
+        /* e.g. "32K" or "8192K" */
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu0/cache/index%u/size", index);
+        if (sysfs_read(path, buf, sizeof(buf))) {
+            char *unit;
+
+            cache->size = strtoull(buf, &unit, 10);
+            if (*unit == 'M') {
+                cache->size *= 1024;
+            }
+        }
+
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu0/cache/index%u/shared_cpu_list", index);
+        sysfs_read(path, cache->shared_cpus, sizeof(cache->shared_cpus));
+
+        topology->ncaches++;
+    }
+}
+
+static void
+topology_cores(struct mh_host_topology *topology, const char *online)
+{
+    GHashTable *packages, *cores;
+    char path[PATH_MAX];
+    const char *pos = online;
+    unsigned int cpu = 0, range_end = 0, package, core;
+
+    packages = g_hash_table_new(g_direct_hash, g_direct_equal);
+    cores = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    while (cpulist_next(&pos, &range_end, &cpu)) {
+        topology->threads++;
+
+        snprintf(path, sizeof(path),
+                 SYSFS_CPU "/cpu%u/topology/physical_package_id", cpu);
+        if (!sysfs_read_uint(path, &package)) {
+            package = 0;
+        }
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u/topology/core_id", cpu);
+        if (!sysfs_read_uint(path, &core)) {
+            core = cpu;
+        }
+
+        g_hash_table_insert(packages, GUINT_TO_POINTER(package + 1), NULL);
+        g_hash_table_insert(cores, g_strdup_printf("%u:%u", package, core), NULL);
+    }
+
+    topology->sockets = g_hash_table_size(packages);
+    topology->cores = g_hash_table_size(cores);
+
+    g_hash_table_destroy(packages);
+    g_hash_table_destroy(cores);
+}
+
+static unsigned int
+disk_kind(const struct host_disk_counters *disk, const GArray *previous,
+          unsigned int index)
+{
+    char path[PATH_MAX];
+
+    if (!strncmp(disk->name, "loop", 4) || !strncmp(disk->name, "ram", 3)
+        || !strncmp(disk->name, "zram", 4)) {
+        return MH_HOST_DISK_VIRTUAL;
+    }
+
+    /* Avoid a lookup in sysfs for the devices already seen */
+    if (index < previous->len) {
+        const struct host_disk_counters *prev =
+            &g_array_index(previous, struct host_disk_counters, index);
+
+        if (prev->major == disk->major && prev->minor == disk->minor) {
+            return prev->kind;
+        }
+    }
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+             disk->major, disk->minor);
+    return access(path, F_OK) == 0 ? MH_HOST_DISK_PARTITIONS : 0;
+}
+
+enum mh_result
+host_os_get_disk_counters(GArray *counters, const GArray *previous)
+{
+    struct host_disk_counters disk;
+    ssize_t rc;
+    char *line;
+
+    /* Grow the buffer until the whole file fits */
+    for (;;) {
+        if (!snapshot_files.diskstats_buf) {
+            snapshot_files.diskstats_len = snapshot_files.diskstats_len ?
+                                           snapshot_files.diskstats_len * 2 :
+                                           BUFSIZE;
+            snapshot_files.diskstats_buf = malloc(snapshot_files.diskstats_len);
+            if (!snapshot_files.diskstats_buf) {
+                return MH_RES_OTHER_ERROR;
+            }
+        }
+
+        rc = procfs_read(&snapshot_files.diskstats, "/proc/diskstats",
+                         snapshot_files.diskstats_buf,
+                         snapshot_files.diskstats_len);
+        if (rc < 0) {
+            return MH_RES_NOT_IMPLEMENTED;
+        }
+        if ((size_t) rc < snapshot_files.diskstats_len - 1) {
+            break;
+        }
+
+        free(snapshot_files.diskstats_buf);
+        snapshot_files.diskstats_buf = NULL;
+    }
+
+    g_array_set_size(counters, 0);
+    for (line = snapshot_files.diskstats_buf; line && *line; ) {
+        /* major minor name reads merged sectors ms writes merged sectors ms
+         * in_flight io_ms weighted_ms ... */
+        memset(&disk, 0, sizeof(disk));
+        if (sscanf(line, "%u %u %31s %" SCNu64 " %*u %" SCNu64 " %" SCNu64
+                   " %" SCNu64 " %*u %" SCNu64 " %" SCNu64 " %*u %*u %" SCNu64,
+                   &disk.major, &disk.minor, disk.name, &disk.reads,
+                   &disk.read_sectors, &disk.read_ms, &disk.writes,
+                   &disk.write_sectors, &disk.write_ms,
+                   &disk.weighted_ms) == 10) {
+            disk.kind = disk_kind(&disk, previous, counters->len);
+            g_array_append_val(counters, disk);
+        }
+
+        if ((line = strchr(line, '\n'))) {
+            line++;
+        }
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+host_os_get_process_counters(GArray *counters, gint64 since,
+                             gint64 *timestamp)
+{
+    sigar_proc_stat_t procs;
+
+    /* Reuse the walk of a snapshot taken since */
+    if (snapshot_files.processes_time > since) {
+        g_array_set_size(counters, 0);
+        g_array_append_vals(counters, snapshot_files.processes->data,
+                            snapshot_files.processes->len);
+        *timestamp = snapshot_files.processes_time;
+        return MH_RES_SUCCESS;
+    }
+
+    *timestamp = g_get_monotonic_time();
+    return walk_processes(&procs, counters);
+}
+
+/* Filesystem types without a device that are still worth reporting */
+static const char *network_filesystems[] = {
+    "nfs", "nfs4", "cifs", "smb3", "ceph", "glusterfs", "fuse.glusterfs",
+    "fuse.sshfs", "9p", NULL,
+};
+
+/*
+ * A statvfs() call, shared between the collector and the thread running it,
+ * which may outlive the collector if the filesystem hangs.  Protected by
+ * statvfs_lock.
+ */
+struct statvfs_job {
+    int refs;
+    gboolean pending;
+    /** The update that started the call */
+    unsigned int update;
+    int rc;
+    struct statvfs buf;
+    char *mount_point;
+};
+
+static GMutex *statvfs_lock = NULL;
+static GCond *statvfs_done = NULL;
+static GThreadPool *statvfs_pool = NULL;
+
+/*
+ * Threads running statvfs() at once.  A hung filesystem keeps its thread
+ * for as long as it hangs, further calls queue up behind the busy ones.
+ */
+#define STATVFS_THREADS 8
+
+struct host_filesystems {
+    /** /proc/self/mountinfo, polled for changes to the mount table */
+    int mountinfo;
+    unsigned int timeout;
+    /** Filesystem types without a device, from /proc/filesystems */
+    GHashTable *nodev;
+    /** struct mh_host_filesystem, and the statvfs_job of each */
+    GArray *list;
+    GPtrArray *jobs;
+    unsigned int updates;
+};
+
+static void
+statvfs_job_unref(struct statvfs_job *job)
+{
+    /* Called with statvfs_lock held */
+    if (--job->refs == 0) {
+        g_free(job->mount_point);
+        g_free(job);
+    }
+}
+
+static void
+statvfs_run(gpointer data, gpointer user_data)
+{
+    struct statvfs_job *job = data;
+    struct statvfs buf;
+    int rc;
+
+    rc = statvfs(job->mount_point, &buf);
+
+    g_mutex_lock(statvfs_lock);
+    job->rc = rc;
+    job->buf = buf;
+    job->pending = FALSE;
+    g_cond_broadcast(statvfs_done);
+    statvfs_job_unref(job);
+    g_mutex_unlock(statvfs_lock);
+}
+
+static void
+filesystems_clear(struct host_filesystems *fs)
+{
+    struct mh_host_filesystem *entry;
+    unsigned int lpc;
+
+    for (lpc = 0; lpc < fs->list->len; lpc++) {
+        entry = &g_array_index(fs->list, struct mh_host_filesystem, lpc);
+        g_free((char *) entry->device);
+        g_free((char *) entry->type);
+    }
+    g_array_set_size(fs->list, 0);
+
+    g_mutex_lock(statvfs_lock);
+    for (lpc = 0; lpc < fs->jobs->len; lpc++) {
+        statvfs_job_unref(g_ptr_array_index(fs->jobs, lpc));
+    }
+    g_mutex_unlock(statvfs_lock);
+    g_ptr_array_set_size(fs->jobs, 0);
+}
+
+/*
+ * Undo the octal escapes of spaces, tabs, newlines and backslashes.
+ */
+static void
+mountinfo_unescape(char *str)
+{
+    char *out = str;
+
+    for (; *str; str++, out++) {
+        if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3'
+            && str[2] >= '0' && str[2] <= '7' && str[3] >= '0' && str[3] <= '7') {
+            *out = ((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0');
+            str += 3;
+        } else {
+            *out = *str;
+        }
+    }
+    *out = '\0';
+}
+
+static gboolean
+filesystem_is_real(struct host_filesystems *fs, const char *type)
+{
+    int lpc;
+
+    if (!g_hash_table_lookup(fs->nodev, type)) {
+        return TRUE;
+    }
+
+    for (lpc = 0; network_filesystems[lpc]; lpc++) {
+        if (!strcmp(type, network_filesystems[lpc])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void
+mountinfo_parse(struct host_filesystems *fs)
+{
+    GHashTable *seen, *hung;
+    GHashTableIter iter;
+    gpointer value;
+    gchar *contents = NULL;
+    gchar **lines;
+    int lpc;
+
+    /*
+     * Keep the calls still hanging, by mount point, so that the filesystems
+     * which are still mounted are neither retried nor waited for again.
+     */
+    hung = g_hash_table_new(g_str_hash, g_str_equal);
+    g_mutex_lock(statvfs_lock);
+    for (lpc = 0; lpc < (int) fs->jobs->len; lpc++) {
+        struct statvfs_job *job = g_ptr_array_index(fs->jobs, lpc);
+
+        if (job->pending) {
+            job->refs++;
+            g_hash_table_insert(hung, job->mount_point, job);
+        }
+    }
+    g_mutex_unlock(statvfs_lock);
+
+    filesystems_clear(fs);
+
+    if (!g_file_get_contents("/proc/self/mountinfo", &contents, NULL, NULL)) {
+        mh_warn("Could not read /proc/self/mountinfo");
+        goto done;
+    }
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    lines = g_strsplit(contents, "\n", 0);
+    g_free(contents);
+
+    for (lpc = 0; lines[lpc]; lpc++) {
+        /* id parent major:minor root mount_point options [optional...] -
+         * type device super_options */
+        char **fields = g_strsplit(lines[lpc], " ", 0);
+        struct mh_host_filesystem entry;
+        struct statvfs_job *job;
+        int sep = 6, nfields = g_strv_length(fields);
+
+        while (sep < nfields && strcmp(fields[sep], "-")) {
+            sep++;
+        }
+
+        if (sep + 2 >= nfields || !filesystem_is_real(fs, fields[sep + 1])
+            || g_hash_table_lookup(seen, fields[2])) {
+            /* Pseudo filesystem, or a bind mount of one already listed */
+            g_strfreev(fields);
+            continue;
+        }
+        g_hash_table_insert(seen, g_strdup(fields[2]), GINT_TO_POINTER(1));
+
+        mountinfo_unescape(fields[4]);
+        mountinfo_unescape(fields[sep + 2]);
+
+        job = g_hash_table_lookup(hung, fields[4]);
+        if (job) {
+            /* Our reference moves to fs->jobs */
+            g_hash_table_remove(hung, fields[4]);
+        } else {
+            job = g_new0(struct statvfs_job, 1);
+            job->refs = 1;
+            job->mount_point = g_strdup(fields[4]);
+            job->rc = -1;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.mount_point = job->mount_point;
+        entry.device = g_strdup(fields[sep + 2]);
+        entry.type = g_strdup(fields[sep + 1]);
+        entry.stale = TRUE;
+
+        g_array_append_val(fs->list, entry);
+        g_ptr_array_add(fs->jobs, job);
+        g_strfreev(fields);
+    }
+
+    g_strfreev(lines);
+    g_hash_table_destroy(seen);
+    mh_debug("Found %u filesystems in the mount table", fs->list->len);
+
+done:
+    /* Unmounted in the meantime */
+    g_mutex_lock(statvfs_lock);
+    g_hash_table_iter_init(&iter, hung);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        statvfs_job_unref(value);
+    }
+    g_mutex_unlock(statvfs_lock);
+    g_hash_table_destroy(hung);
+}
+
+struct host_filesystems *
+host_os_filesystems_new(unsigned int timeout)
+{
+    struct host_filesystems *fs;
+    gchar *contents = NULL;
+    gchar **lines;
+    GError *error = NULL;
+    int lpc;
+
+    if (!statvfs_pool) {
+        if (!g_thread_supported()) {
+            g_thread_init(NULL);
+        }
+        statvfs_pool = g_thread_pool_new(statvfs_run, NULL, STATVFS_THREADS,
+                                         FALSE, &error);
+        if (!statvfs_pool) {
+            mh_err("Could not start the filesystem statistics threads: %s",
+                   error->message);
+            g_error_free(error);
+            return NULL;
+        }
+        statvfs_lock = g_mutex_new();
+        statvfs_done = g_cond_new();
+    }
+
+    fs = g_new0(struct host_filesystems, 1);
+    fs->timeout = timeout;
+    fs->list = g_array_new(FALSE, TRUE, sizeof(struct mh_host_filesystem));
+    fs->jobs = g_ptr_array_new();
+    fs->nodev = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    /* "nodev\tproc" or "\text4" */
+    if (g_file_get_contents("/proc/filesystems", &contents, NULL, NULL)) {
+        lines = g_strsplit(contents, "\n", 0);
+        for (lpc = 0; lines[lpc]; lpc++) {
+            if (!strncmp(lines[lpc], "nodev\t", 6)) {
+                g_hash_table_insert(fs->nodev, g_strdup(lines[lpc] + 6),
+                                    GINT_TO_POINTER(1));
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+
+    fs->mountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    mountinfo_parse(fs);
+    return fs;
+}
+
+void
+host_os_filesystems_free(struct host_filesystems *fs)
+{
+    if (!fs) {
+        return;
+    }
+
+    filesystems_clear(fs);
+    g_array_free(fs->list, TRUE);
+    g_ptr_array_free(fs->jobs, TRUE);
+    g_hash_table_destroy(fs->nodev);
+    if (fs->mountinfo >= 0) {
+        close(fs->mountinfo);
+    }
+    g_free(fs);
+}
+
+enum mh_result
+host_os_filesystems_update(struct host_filesystems *fs,
+                           const struct mh_host_filesystem **list,
+                           unsigned int *count)
+{
+    struct pollfd pfd = { .fd = fs->mountinfo, .events = POLLPRI };
+    struct mh_host_filesystem *entry;
+    struct statvfs_job *job;
+    unsigned int lpc, pending = 0;
+    GTimeVal deadline;
+
+    /* The mount table changed since it was parsed */
+    if (fs->mountinfo < 0
+        || (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))) {
+        mountinfo_parse(fs);
+    }
+
+    g_mutex_lock(statvfs_lock);
+    fs->updates++;
+
+    /*
+     * Filesystems still hanging from an earlier update are neither retried
+     * nor waited for again.
+     */
+    for (lpc = 0; lpc < fs->jobs->len; lpc++) {
+        job = g_ptr_array_index(fs->jobs, lpc);
+        if (!job->pending) {
+            job->pending = TRUE;
+            job->update = fs->updates;
+            job->refs++;
+            g_thread_pool_push(statvfs_pool, job, NULL);
+            pending++;
+        }
+    }
+
+    g_get_current_time(&deadline);
+    g_time_val_add(&deadline, fs->timeout * 1000);
+    while (pending > 0
+           && g_cond_timed_wait(statvfs_done, statvfs_lock, &deadline)) {
+        for (pending = 0, lpc = 0; lpc < fs->jobs->len; lpc++) {
+            job = g_ptr_array_index(fs->jobs, lpc);
+            if (job->pending && job->update == fs->updates) {
+                pending++;
+            }
+        }
+    }
+
+    for (lpc = 0; lpc < fs->list->len; lpc++) {
+        entry = &g_array_index(fs->list, struct mh_host_filesystem, lpc);
+        job = g_ptr_array_index(fs->jobs, lpc);
+
+        if (job->pending || job->rc != 0) {
+            entry->stale = TRUE;
+            continue;
+        }
+
+        entry->size = (uint64_t) job->buf.f_blocks * job->buf.f_frsize / 1024;
+        entry->free = (uint64_t) job->buf.f_bfree * job->buf.f_frsize / 1024;
+        entry->avail = (uint64_t) job->buf.f_bavail * job->buf.f_frsize / 1024;
+        entry->inodes = job->buf.f_files;
+        entry->inodes_free = job->buf.f_ffree;
+        entry->stale = FALSE;
+    }
+
+    g_mutex_unlock(statvfs_lock);
+
+    *list = (const struct mh_host_filesystem *) fs->list->data;
+    *count = fs->list->len;
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+host_os_get_topology(struct mh_host_topology *topology)
+{
+    char online[256], path[PATH_MAX];
+    unsigned int smt, node = 0, range_end = 0, lpc = 0;
+    const char *pos;
+
+    if (!sysfs_read(SYSFS_CPU "/online", online, sizeof(online))) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+
+    topology_cores(topology, online);
+
+    if (sysfs_read_uint(SYSFS_CPU "/smt/active", &smt)) {
+        topology->smt = smt != 0;
+    } else {
+        topology->smt = topology->threads > topology->cores;
+    }
+
+    topology_caches(topology);
+
+    if (!sysfs_read(SYSFS_NODE "/online", path, sizeof(path))) {
+        /* No NUMA support, the whole host is one node */
+        topology->nnodes = 1;
+        topology->nodes = g_new0(struct mh_host_numa_node, 1);
+        mh_string_copy(topology->nodes[0].cpus, online,
+                       sizeof(topology->nodes[0].cpus));
+        topology->nodes[0].memory = mh_host_get_memory();
+        return MH_RES_SUCCESS;
+    }
+
+    for (pos = path; cpulist_next(&pos, &range_end, &node); ) {
+        topology->nnodes++;
+    }
+
+    topology->nodes = g_new0(struct mh_host_numa_node, topology->nnodes);
+    range_end = node = 0;
+    for (pos = path; cpulist_next(&pos, &range_end, &node); lpc++) {
+        struct mh_host_numa_node *numa = &topology->nodes[lpc];
+        char file[PATH_MAX];
+
+        numa->id = node;
+
+        snprintf(file, sizeof(file), SYSFS_NODE "/node%u/cpulist", node);
+        sysfs_read(file, numa->cpus, sizeof(numa->cpus));
+
+        snprintf(file, sizeof(file), SYSFS_NODE "/node%u/meminfo", node);
+        if (sysfs_read(file, snapshot_files.buf, sizeof(snapshot_files.buf))) {
+            /* "Node 0 MemTotal:       16303972 kB" */
+            numa->memory = meminfo_value(snapshot_files.buf, "MemTotal:");
+        }
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+host_os_get_numa_free_mem(const struct mh_host_topology *topology,
+                          uint64_t *free_mem, unsigned int nnodes)
+{
+    static int *fds = NULL;
+    char file[PATH_MAX];
+    unsigned int lpc;
+
+    if (topology->nnodes == 1 && !g_file_test(SYSFS_NODE, G_FILE_TEST_IS_DIR)) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+
+    /* The meminfo files are kept open, like the ones of the snapshots */
+    if (!fds) {
+        fds = g_new(int, topology->nnodes);
+        for (lpc = 0; lpc < topology->nnodes; lpc++) {
+            fds[lpc] = -1;
+        }
+    }
+
+    for (lpc = 0; lpc < nnodes && lpc < topology->nnodes; lpc++) {
+        snprintf(file, sizeof(file), SYSFS_NODE "/node%u/meminfo",
+                 topology->nodes[lpc].id);
+        if (procfs_read(&fds[lpc], file, snapshot_files.buf,
+                        sizeof(snapshot_files.buf)) < 0) {
+            return MH_RES_BACKEND_ERROR;
+        }
+        free_mem[lpc] = meminfo_value(snapshot_files.buf, "MemFree:");
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+/*
+ * Parse a "some avg10=0.12 avg60=0.05 avg300=0.01 total=123456" line.
+ */
+static gboolean
+pressure_line(const char *text, const char *kind,
+              struct mh_host_pressure_stall *stall)
+{
+    const char *line = strstr(text, kind);
+
+    return line && sscanf(line + strlen(kind),
+                          " avg10=%lf avg60=%lf avg300=%lf total=%" SCNu64,
+                          &stall->avg10, &stall->avg60, &stall->avg300,
+                          &stall->total) == 4;
+}
+
+enum mh_result
+host_os_get_pressure(enum mh_host_pressure_resource resource,
+                     struct mh_host_pressure *pressure)
+{
+    static int fds[MH_HOST_PRESSURE_RESOURCES] = { -1, -1, -1 };
+    char path[PATH_MAX], buf[256];
+
+    snprintf(path, sizeof(path), PROC_PRESSURE "/%s",
+             mh_host_pressure_resource_name(resource));
+
+    /* Kernels without PSI are common enough not to complain about */
+    if (fds[resource] < 0
+        && (fds[resource] = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT || errno == EOPNOTSUPP) {
+            return MH_RES_NOT_IMPLEMENTED;
+        }
+        mh_perror(LOG_ERR, "Could not open %s", path);
+        return MH_RES_BACKEND_ERROR;
+    }
+
+    if (procfs_read(&fds[resource], path, buf, sizeof(buf)) < 0) {
+        return MH_RES_BACKEND_ERROR;
+    }
+
+    memset(pressure, 0, sizeof(*pressure));
+    if (!pressure_line(buf, "some", &pressure->some)) {
+        mh_err("Could not parse %s", path);
+        return MH_RES_BACKEND_ERROR;
+    }
+    /* Before Linux 5.13 cpu only has a "some" line */
+    pressure_line(buf, "full", &pressure->full);
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+host_os_pressure_trigger_open(const struct mh_host_pressure_trigger *trigger,
+                              int *fd)
+{
+    char path[PATH_MAX], buf[64];
+    int len, err;
+
+    snprintf(path, sizeof(path), PROC_PRESSURE "/%s",
+             mh_host_pressure_resource_name(trigger->resource));
+
+    *fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (*fd < 0) {
+        if (errno == ENOENT || errno == EOPNOTSUPP) {
+            mh_info("The kernel does not support pressure triggers");
+            return MH_RES_NOT_IMPLEMENTED;
+        }
+        mh_perror(LOG_ERR, "Could not open %s", path);
+        return MH_RES_BACKEND_ERROR;
+    }
+
+    /*
+     * The trigger is registered on this fd, with the times in us, and goes
+     * away when it is closed.  The kernel wants the terminating NUL too.
+     */
+    len = snprintf(buf, sizeof(buf), "%s %" PRIu64 " %" PRIu64,
+                   trigger->full ? "full" : "some", trigger->stall,
+                   trigger->window);
+    if (write(*fd, buf, len + 1) < 0) {
+        err = errno;
+        mh_perror(LOG_ERR, "Could not register pressure trigger '%s' with %s",
+                  buf, path);
+        close(*fd);
+        *fd = -1;
+        return err == EINVAL ? MH_RES_INVALID_ARGS : MH_RES_BACKEND_ERROR;
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+host_os_get_snapshot(struct mh_host_snapshot *snapshot)
+{
+    char *next;
+
+    if (procfs_read(&snapshot_files.meminfo, "/proc/meminfo",
+                    snapshot_files.buf, sizeof(snapshot_files.buf)) < 0) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+    snapshot->mem_total = meminfo_value(snapshot_files.buf, "MemTotal:");
+    snapshot->mem_free = meminfo_value(snapshot_files.buf, "MemFree:");
+    snapshot->swap_total = meminfo_value(snapshot_files.buf, "SwapTotal:");
+    snapshot->swap_free = meminfo_value(snapshot_files.buf, "SwapFree:");
+
+    if (procfs_read(&snapshot_files.loadavg, "/proc/loadavg",
+                    snapshot_files.buf, sizeof(snapshot_files.buf)) < 0) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+    snapshot->loadavg[0] = strtod(snapshot_files.buf, &next);
+    snapshot->loadavg[1] = strtod(next, &next);
+    snapshot->loadavg[2] = strtod(next, &next);
+
+    if (snapshot_processes(&snapshot->procs) != MH_RES_SUCCESS) {
+        return MH_RES_NOT_IMPLEMENTED;
+    }
+
+    return MH_RES_SUCCESS;
+}
+
 enum mh_result
 host_os_set_power_profile(const char *profile)
 {
@@ -0,0 +1,306 @@
+/* host_pressure.c - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "matahari/host.h"
+#include "matahari/logging.h"
+#include "matahari/mainloop.h"
+#include "host_private.h"
+
+static const char *pressure_resources[MH_HOST_PRESSURE_RESOURCES] = {
+    "cpu", "memory", "io",
+};
+
+/*
+ * A registered trigger.  The kernel does the threshold checking, the main
+ * loop only wakes up when a trigger fires, so there is nothing to poll.
+ */
+struct pressure_watch {
+    struct mh_host_pressure_trigger trigger;
+    struct mh_host_pressure_triggers *triggers;
+    int fd;
+    mainloop_fd_t *source;
+};
+
+struct mh_host_pressure_triggers {
+    /** struct pressure_watch *, which the main loop sources point to */
+    GPtrArray *watches;
+    mh_host_pressure_fn fn;
+    void *userdata;
+};
+
+const char *
+mh_host_pressure_resource_name(enum mh_host_pressure_resource resource)
+{
+    if (resource >= MH_HOST_PRESSURE_RESOURCES) {
+        return NULL;
+    }
+    return pressure_resources[resource];
+}
+
+enum mh_result
+mh_host_get_pressure(enum mh_host_pressure_resource resource,
+                     struct mh_host_pressure *pressure)
+{
+    if (resource >= MH_HOST_PRESSURE_RESOURCES) {
+        return MH_RES_INVALID_ARGS;
+    }
+    return host_os_get_pressure(resource, pressure);
+}
+
+static void
+pressure_watch_free(gpointer data)
+{
+    struct pressure_watch *watch = data;
+
+    if (watch->source) {
+        mainloop_destroy_fd(watch->source);
+    }
+    if (watch->fd >= 0) {
+        close(watch->fd);
+    }
+    g_free(watch);
+}
+
+struct mh_host_pressure_triggers *
+mh_host_pressure_triggers_new(mh_host_pressure_fn fn, void *userdata)
+{
+    struct mh_host_pressure_triggers *triggers =
+        g_new0(struct mh_host_pressure_triggers, 1);
+
+    triggers->watches = g_ptr_array_new_with_free_func(pressure_watch_free);
+    triggers->fn = fn;
+    triggers->userdata = userdata;
+    return triggers;
+}
+
+void
+mh_host_pressure_triggers_free(struct mh_host_pressure_triggers *triggers)
+{
+    if (!triggers) {
+        return;
+    }
+
+    g_ptr_array_free(triggers->watches, TRUE);
+    g_free(triggers);
+}
+
+static int
+pressure_triggers_find(const struct mh_host_pressure_triggers *triggers,
+                       const char *name)
+{
+    const struct pressure_watch *watch;
+    unsigned int lpc;
+
+    for (lpc = 0; lpc < triggers->watches->len; lpc++) {
+        watch = g_ptr_array_index(triggers->watches, lpc);
+        if (!strcmp(watch->trigger.name, name)) {
+            return lpc;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Parse a time such as "150ms" into us.
+ */
+static gboolean
+pressure_time(const char *text, uint64_t *us)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+
+    if (unit == text || value <= 0) {
+        return FALSE;
+    }
+
+    if (!strcmp(unit, "ms")) {
+        value *= 1000;
+    } else if (!strcmp(unit, "s")) {
+        value *= 1000000;
+    } else if (strcmp(unit, "us")) {
+        return FALSE;
+    }
+
+    /* Rounded, so that e.g. "0.15s" is 150000us */
+    *us = value + 0.5;
+    return *us > 0;
+}
+
+static enum mh_result
+pressure_trigger_compile(struct mh_host_pressure_trigger *trigger,
+                         const char *rule)
+{
+    char resource[16] = "", kind[8] = "", stall[32] = "", per[8] = "";
+    char window[32] = "";
+    unsigned int lpc;
+
+    if (sscanf(rule, " %15s %7s %31s %7s %31s", resource, kind, stall, per,
+               window) != 5 || strcmp(per, "per")) {
+        mh_warn("Invalid pressure trigger '%s'", rule);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    for (lpc = 0; lpc < MH_HOST_PRESSURE_RESOURCES; lpc++) {
+        if (!strcmp(resource, pressure_resources[lpc])) {
+            break;
+        }
+    }
+    if (lpc == MH_HOST_PRESSURE_RESOURCES) {
+        mh_warn("Unknown pressure resource '%s'", resource);
+        return MH_RES_INVALID_ARGS;
+    }
+    trigger->resource = lpc;
+
+    if (!strcmp(kind, "some") || !strcmp(kind, "full")) {
+        trigger->full = !strcmp(kind, "full");
+    } else {
+        mh_warn("Pressure triggers are 'some' or 'full', not '%s'", kind);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    if (!pressure_time(stall, &trigger->stall)
+        || !pressure_time(window, &trigger->window)
+        || trigger->stall > trigger->window) {
+        mh_warn("Invalid pressure trigger times in '%s'", rule);
+        return MH_RES_INVALID_ARGS;
+    }
+
+    return MH_RES_SUCCESS;
+}
+
+static gboolean
+pressure_dispatch(int fd, gpointer userdata)
+{
+    struct pressure_watch *watch = userdata;
+    GPollFD *gpoll = &watch->source->gpoll;
+
+    if (gpoll->revents & (G_IO_ERR | G_IO_NVAL)) {
+        /* e.g. the cgroup went away, the trigger will not fire again */
+        mh_warn("Pressure trigger %s (%s) is no longer monitored",
+                watch->trigger.name, watch->trigger.rule);
+
+        /*
+         * Destroying the source here is safe, the main loop holds a
+         * reference until this returns.  Returning FALSE instead would
+         * make mainloop_fd_dispatch() drop our reference a second time.
+         */
+        mainloop_destroy_fd(watch->source);
+        watch->source = NULL;
+        close(watch->fd);
+        watch->fd = -1;
+        return TRUE;
+    }
+
+    if (gpoll->revents & G_IO_PRI) {
+        watch->trigger.fired++;
+        mh_debug("Pressure trigger %s (%s) fired", watch->trigger.name,
+                 watch->trigger.rule);
+        if (watch->triggers->fn) {
+            watch->triggers->fn(&watch->trigger, watch->triggers->userdata);
+        }
+    }
+
+    return TRUE;
+}
+
+enum mh_result
+mh_host_pressure_triggers_add(struct mh_host_pressure_triggers *triggers,
+                              const char *name, const char *rule)
+{
+    struct pressure_watch *watch;
+    enum mh_result res;
+    int index;
+
+    if (!name || !name[0] || !rule) {
+        return MH_RES_INVALID_ARGS;
+    }
+
+    watch = g_new0(struct pressure_watch, 1);
+    watch->triggers = triggers;
+    watch->fd = -1;
+    g_strlcpy(watch->trigger.name, name, sizeof(watch->trigger.name));
+    g_strlcpy(watch->trigger.rule, rule, sizeof(watch->trigger.rule));
+
+    res = pressure_trigger_compile(&watch->trigger, rule);
+    if (res == MH_RES_SUCCESS) {
+        res = host_os_pressure_trigger_open(&watch->trigger, &watch->fd);
+    }
+    if (res != MH_RES_SUCCESS) {
+        pressure_watch_free(watch);
+        return res;
+    }
+
+    watch->source = mainloop_add_fd(G_PRIORITY_HIGH, watch->fd,
+                                    pressure_dispatch, NULL, watch);
+    /*
+     * Pressure files are always readable, only wait for the trigger to
+     * fire, or for the file to go away.
+     */
+    watch->source->gpoll.events = G_IO_PRI | G_IO_ERR | G_IO_NVAL;
+
+    index = pressure_triggers_find(triggers, name);
+    if (index >= 0) {
+        g_ptr_array_remove_index(triggers->watches, index);
+    }
+    g_ptr_array_add(triggers->watches, watch);
+
+    mh_info("Added pressure trigger %s (%s)", name, rule);
+    return MH_RES_SUCCESS;
+}
+
+enum mh_result
+mh_host_pressure_triggers_remove(struct mh_host_pressure_triggers *triggers,
+                                 const char *name)
+{
+    int index = pressure_triggers_find(triggers, name);
+
+    if (index < 0) {
+        return MH_RES_INVALID_ARGS;
+    }
+
+    g_ptr_array_remove_index(triggers->watches, index);
+    return MH_RES_SUCCESS;
+}
+
+unsigned int
+mh_host_pressure_triggers_count(const struct mh_host_pressure_triggers *triggers)
+{
+    return triggers->watches->len;
+}
+
+const struct mh_host_pressure_trigger *
+mh_host_pressure_triggers_get(const struct mh_host_pressure_triggers *triggers,
+                              unsigned int index)
+{
+    const struct pressure_watch *watch;
+
+    if (index >= triggers->watches->len) {
+        return NULL;
+    }
+
+    watch = g_ptr_array_index(triggers->watches, index);
+    return &watch->trigger;
+}
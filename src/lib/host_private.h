@@ -29,6 +29,7 @@
 #ifndef __MH_HOST_PRIVATE_H__
 #define __MH_HOST_PRIVATE_H__
 
+#include <stdint.h>
 #include <glib.h>
 
 #define TIMEOUT 10
@@ -71,8 +72,19 @@ host_os_identify(void);
 char *
 host_os_machine_uuid(void);
 
+/**
+ * Get the EC2 instance id of the host.
+ *
+ * On Linux, this does not block: the first call starts looking the instance
+ * id up from the metadata service in the background, using the GLib main
+ * loop, and NULL is returned until the lookup has succeeded.
+ *
+ * \param[in] url URL of the instance-id of the metadata service
+ *
+ * \return the instance id, or NULL if it is not (yet) known
+ */
 char *
-host_os_ec2_instance_id(void);
+host_os_ec2_instance_id(const char *url);
 
 char *
 host_os_custom_uuid(void);
@@ -86,6 +98,185 @@ host_os_agent_uuid(void);
 int
 host_os_set_custom_uuid(const char *uuid);
 
+/**
+ * CPU time counters, in platform specific units.
+ */
+struct host_cpu_times {
+    uint64_t user;
+    uint64_t system;
+    uint64_t iowait;
+    uint64_t steal;
+    uint64_t idle;
+};
+
+/**
+ * Platform specific collection of CPU time counters.
+ *
+ * \param[out] total the counters of all CPUs together
+ * \param[out] cpus the counters of each logical CPU
+ * \param[in]  ncpus number of entries in cpus
+ *
+ * \retval MH_RES_SUCCESS the counters were collected
+ * \retval MH_RES_NOT_IMPLEMENTED the generic sigar based collection
+ *         should be used instead
+ */
+enum mh_result
+host_os_get_cpu_times(struct host_cpu_times *total,
+                      struct host_cpu_times *cpus, int ncpus);
+
+struct host_disk_counters {
+    unsigned int major;
+    unsigned int minor;
+    char name[32];
+    /** MH_HOST_DISK_PARTITIONS and/or MH_HOST_DISK_VIRTUAL, if it is one */
+    unsigned int kind;
+    uint64_t reads;
+    uint64_t read_sectors;
+    uint64_t read_ms;
+    uint64_t writes;
+    uint64_t write_sectors;
+    uint64_t write_ms;
+    /** Sum of the time spent by each request in flight */
+    uint64_t weighted_ms;
+};
+
+/**
+ * Platform specific collection of block device I/O counters.
+ *
+ * \param[out] counters array of struct host_disk_counters, emptied and then
+ *             filled with every block device
+ * \param[in]  previous the counters of the previous call, in the same order
+ *             unless devices were added or removed
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+host_os_get_disk_counters(GArray *counters, const GArray *previous);
+
+struct host_process_counters {
+    unsigned int pid;
+    char name[16];
+    /** Time the process started after boot, to tell reused pids apart */
+    uint64_t start_time;
+    /** User and system CPU time, in ms */
+    uint64_t cpu_ms;
+    /** Resident memory, in kb */
+    uint64_t rss;
+};
+
+/**
+ * Platform specific collection of the counters of every process.
+ *
+ * The counters may come from an earlier collection, such as the one made for
+ * a host statistics snapshot, as long as it happened after \p since.
+ *
+ * \param[out] counters array of struct host_process_counters, emptied and
+ *             then filled with every process, preferably ordered by pid
+ * \param[in]  since monotonic time, in microseconds, of the previous
+ *             collection, 0 if there was none
+ * \param[out] timestamp monotonic time, in microseconds, the counters were
+ *             collected at
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+host_os_get_process_counters(GArray *counters, gint64 since,
+                             gint64 *timestamp);
+
+struct host_filesystems;
+
+/**
+ * Platform specific implementation of mh_host_filesystems_new().
+ */
+struct host_filesystems *
+host_os_filesystems_new(unsigned int timeout);
+
+void
+host_os_filesystems_free(struct host_filesystems *filesystems);
+
+/**
+ * Platform specific implementation of mh_host_filesystems_update().
+ */
+enum mh_result
+host_os_filesystems_update(struct host_filesystems *filesystems,
+                           const struct mh_host_filesystem **list,
+                           unsigned int *count);
+
+/**
+ * Platform specific collection of pressure stall information.
+ *
+ * \param[in]  resource the resource
+ * \param[out] pressure the pressure
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+host_os_get_pressure(enum mh_host_pressure_resource resource,
+                     struct mh_host_pressure *pressure);
+
+/**
+ * Platform specific registration of a kernel pressure trigger.
+ *
+ * \param[in]  trigger the trigger to register
+ * \param[out] fd a file descriptor that polls priority data (POLLPRI) when
+ *             the trigger fires, and unregisters the trigger when closed
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+host_os_pressure_trigger_open(const struct mh_host_pressure_trigger *trigger,
+                              int *fd);
+
+/**
+ * Platform specific collection of the host topology.
+ *
+ * \param[out] topology the topology, zeroed by the caller
+ *
+ * \retval MH_RES_SUCCESS the topology was collected
+ * \retval MH_RES_NOT_IMPLEMENTED a flat topology should be assumed instead
+ */
+enum mh_result
+host_os_get_topology(struct mh_host_topology *topology);
+
+/**
+ * Platform specific collection of the available memory of NUMA nodes.
+ *
+ * \param[in]  topology the topology from host_os_get_topology()
+ * \param[out] free_mem the available memory of each node, in kb
+ * \param[in]  nnodes number of entries in free_mem
+ *
+ * \return see enum mh_result
+ */
+enum mh_result
+host_os_get_numa_free_mem(const struct mh_host_topology *topology,
+                          uint64_t *free_mem, unsigned int nnodes);
+
+/**
+ * Get the value of a host history field from a snapshot.
+ *
+ * \param[in] field the field
+ * \param[in] snapshot the host statistics
+ * \param[in] cpu the aggregate CPU utilization, or NULL if unknown
+ *
+ * \return the value
+ */
+double
+host_history_value(enum mh_host_history_field field,
+                   const struct mh_host_snapshot *snapshot,
+                   const struct mh_host_cpu_utilization *cpu);
+
+/**
+ * Platform specific collection of a host statistics snapshot.
+ *
+ * \param[out] snapshot the statistics, except for the timestamp
+ *
+ * \retval MH_RES_SUCCESS all statistics were collected
+ * \retval MH_RES_NOT_IMPLEMENTED the generic sigar based collection
+ *         should be used instead
+ */
+enum mh_result
+host_os_get_snapshot(struct mh_host_snapshot *snapshot);
+
 enum mh_result
 host_os_set_power_profile(const char *profile);
 
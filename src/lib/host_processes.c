@@ -0,0 +1,266 @@
+/* host_processes.c - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "matahari/host.h"
+#include "host_private.h"
+
+/*
+ * The counters of the previous and current update are kept ordered by pid,
+ * so that matching the processes of both is a single merge, without a
+ * lookup table to maintain.
+ */
+struct mh_host_processes {
+    GArray *previous;
+    GArray *current;
+    /** struct mh_host_process of the latest update */
+    GArray *usage;
+    /** Scratch space for ranking usage */
+    GPtrArray *ranked;
+    gint64 timestamp;
+};
+
+typedef int (*process_cmp_fn)(const struct mh_host_process *a,
+                              const struct mh_host_process *b);
+
+struct mh_host_processes *
+mh_host_processes_new(void)
+{
+    struct mh_host_processes *processes = g_new0(struct mh_host_processes, 1);
+
+    processes->previous = g_array_new(FALSE, TRUE,
+                                      sizeof(struct host_process_counters));
+    processes->current = g_array_new(FALSE, TRUE,
+                                     sizeof(struct host_process_counters));
+    processes->usage = g_array_new(FALSE, TRUE, sizeof(struct mh_host_process));
+    processes->ranked = g_ptr_array_new();
+    return processes;
+}
+
+void
+mh_host_processes_free(struct mh_host_processes *processes)
+{
+    if (!processes) {
+        return;
+    }
+
+    g_array_free(processes->previous, TRUE);
+    g_array_free(processes->current, TRUE);
+    g_array_free(processes->usage, TRUE);
+    g_ptr_array_free(processes->ranked, TRUE);
+    g_free(processes);
+}
+
+static int
+counters_pid_cmp(const void *a, const void *b)
+{
+    const struct host_process_counters *pa = a, *pb = b;
+
+    return pa->pid < pb->pid ? -1 : pa->pid > pb->pid;
+}
+
+enum mh_result
+mh_host_processes_update(struct mh_host_processes *processes)
+{
+    const struct host_process_counters *cur, *prev;
+    struct mh_host_process *usage;
+    gint64 now = 0;
+    double elapsed_ms;
+    unsigned int lpc, next = 0;
+    gboolean sorted = TRUE;
+    enum mh_result res;
+    GArray *tmp;
+
+    /* Measured between the collections, not between the calls */
+    res = host_os_get_process_counters(processes->current,
+                                       processes->timestamp, &now);
+    if (res != MH_RES_SUCCESS) {
+        return res;
+    }
+    elapsed_ms = (now - processes->timestamp) / 1000.0;
+
+    for (lpc = 1; lpc < processes->current->len && sorted; lpc++) {
+        sorted = g_array_index(processes->current, struct host_process_counters,
+                               lpc - 1).pid
+                 < g_array_index(processes->current, struct host_process_counters,
+                                 lpc).pid;
+    }
+    if (!sorted) {
+        qsort(processes->current->data, processes->current->len,
+              sizeof(struct host_process_counters), counters_pid_cmp);
+    }
+
+    g_array_set_size(processes->usage, processes->current->len);
+    for (lpc = 0; lpc < processes->current->len; lpc++) {
+        cur = &g_array_index(processes->current, struct host_process_counters, lpc);
+        usage = &g_array_index(processes->usage, struct mh_host_process, lpc);
+
+        usage->pid = cur->pid;
+        g_strlcpy(usage->name, cur->name, sizeof(usage->name));
+        usage->rss = cur->rss;
+        usage->cpu = 0.0;
+
+        while (next < processes->previous->len
+               && g_array_index(processes->previous, struct host_process_counters,
+                                next).pid < cur->pid) {
+            next++;
+        }
+        if (next == processes->previous->len || !processes->timestamp
+            || elapsed_ms <= 0) {
+            continue;
+        }
+
+        prev = &g_array_index(processes->previous, struct host_process_counters,
+                              next);
+        if (prev->pid == cur->pid && prev->start_time == cur->start_time
+            && cur->cpu_ms >= prev->cpu_ms) {
+            usage->cpu = (cur->cpu_ms - prev->cpu_ms) * 100.0 / elapsed_ms;
+        }
+    }
+
+    tmp = processes->previous;
+    processes->previous = processes->current;
+    processes->current = tmp;
+    processes->timestamp = now;
+    return MH_RES_SUCCESS;
+}
+
+static int
+process_cpu_cmp(const struct mh_host_process *a, const struct mh_host_process *b)
+{
+    if (a->cpu != b->cpu) {
+        return a->cpu > b->cpu ? 1 : -1;
+    }
+    return a->rss > b->rss ? 1 : a->rss < b->rss ? -1 : 0;
+}
+
+static int
+process_rss_cmp(const struct mh_host_process *a, const struct mh_host_process *b)
+{
+    if (a->rss != b->rss) {
+        return a->rss > b->rss ? 1 : -1;
+    }
+    return a->cpu > b->cpu ? 1 : a->cpu < b->cpu ? -1 : 0;
+}
+
+/*
+ * Move the n highest ranked processes to the front of items, in no
+ * particular order, as std::nth_element would.
+ */
+static void
+select_top(gpointer *items, int len, int n, process_cmp_fn cmp)
+{
+    int left = 0, right = len - 1;
+
+    while (left < right) {
+        const struct mh_host_process *pivot = items[left + (right - left) / 2];
+        int i = left, j = right;
+
+        while (i <= j) {
+            while (cmp(items[i], pivot) > 0) {
+                i++;
+            }
+            while (cmp(items[j], pivot) < 0) {
+                j--;
+            }
+            if (i <= j) {
+                gpointer swap = items[i];
+                items[i++] = items[j];
+                items[j--] = swap;
+            }
+        }
+
+        if (n - 1 <= j) {
+            right = j;
+        } else if (n - 1 >= i) {
+            left = i;
+        } else {
+            break;
+        }
+    }
+}
+
+/* Highest first */
+static int
+ranked_cpu_cmp(const void *a, const void *b)
+{
+    return process_cpu_cmp(*(const struct mh_host_process * const *) b,
+                           *(const struct mh_host_process * const *) a);
+}
+
+static int
+ranked_rss_cmp(const void *a, const void *b)
+{
+    return process_rss_cmp(*(const struct mh_host_process * const *) b,
+                           *(const struct mh_host_process * const *) a);
+}
+
+unsigned int
+mh_host_processes_top(struct mh_host_processes *processes,
+                      enum mh_host_process_sort sort,
+                      struct mh_host_process *top, unsigned int n)
+{
+    unsigned int lpc;
+
+    if (n > processes->usage->len) {
+        n = processes->usage->len;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    g_ptr_array_set_size(processes->ranked, processes->usage->len);
+    for (lpc = 0; lpc < processes->usage->len; lpc++) {
+        g_ptr_array_index(processes->ranked, lpc) =
+            &g_array_index(processes->usage, struct mh_host_process, lpc);
+    }
+
+    if (sort == MH_HOST_PROCESS_RSS) {
+        select_top(processes->ranked->pdata, processes->ranked->len, n,
+                   process_rss_cmp);
+        qsort(processes->ranked->pdata, n, sizeof(gpointer), ranked_rss_cmp);
+    } else {
+        select_top(processes->ranked->pdata, processes->ranked->len, n,
+                   process_cpu_cmp);
+        qsort(processes->ranked->pdata, n, sizeof(gpointer), ranked_cpu_cmp);
+    }
+
+    for (lpc = 0; lpc < n; lpc++) {
+        top[lpc] = *(struct mh_host_process *)
+                   g_ptr_array_index(processes->ranked, lpc);
+    }
+    return n;
+}
+
+enum mh_result
+mh_host_process_sort_from_name(const char *name,
+                               enum mh_host_process_sort *sort)
+{
+    if (!name || !name[0] || !strcmp(name, "cpu")) {
+        *sort = MH_HOST_PROCESS_CPU;
+    } else if (!strcmp(name, "rss")) {
+        *sort = MH_HOST_PROCESS_RSS;
+    } else {
+        return MH_RES_INVALID_ARGS;
+    }
+    return MH_RES_SUCCESS;
+}
@@ -158,23 +158,29 @@ host_os_machine_uuid(void)
 }
 
 char *
-host_os_ec2_instance_id(void)
+host_os_ec2_instance_id(const char *url)
 {
-    static const char URI[] = "http://169.254.169.254/latest/meta-data/instance-id";
+    static gboolean tried = FALSE;
     HINTERNET internet = NULL;
     HINTERNET open_url = NULL;
     DWORD bytes_read = 0;
     char buf[256] = "";
 
+    /* Not an EC2 instance, don't wait for the timeout again */
+    if (tried) {
+        return NULL;
+    }
+    tried = TRUE;
+
     internet = InternetOpenA("Matahari", INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
     if (!internet) {
         mh_err("Failed to open the internets (%lu)", (unsigned long) GetLastError());
         return NULL;
     }
 
-    open_url = InternetOpenUrlA(internet, URI, NULL, 0, INTERNET_FLAG_RELOAD, 0);
+    open_url = InternetOpenUrlA(internet, url, NULL, 0, INTERNET_FLAG_RELOAD, 0);
     if (!open_url) {
-        mh_err("Failed to open URL '%s' (%lu)", URI, (unsigned long) GetLastError());
+        mh_err("Failed to open URL '%s' (%lu)", url, (unsigned long) GetLastError());
         goto return_cleanup;
     }
 
@@ -520,6 +526,79 @@ get_profiles(GList **names, GList **guids)
     return rc;
 }
 
+enum mh_result
+host_os_get_disk_counters(GArray *counters, const GArray *previous)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_process_counters(GArray *counters, gint64 since,
+                             gint64 *timestamp)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+struct host_filesystems *
+host_os_filesystems_new(unsigned int timeout)
+{
+    return NULL;
+}
+
+void
+host_os_filesystems_free(struct host_filesystems *filesystems)
+{
+}
+
+enum mh_result
+host_os_filesystems_update(struct host_filesystems *filesystems,
+                           const struct mh_host_filesystem **list,
+                           unsigned int *count)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_pressure(enum mh_host_pressure_resource resource,
+                     struct mh_host_pressure *pressure)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_pressure_trigger_open(const struct mh_host_pressure_trigger *trigger,
+                              int *fd)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_topology(struct mh_host_topology *topology)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_numa_free_mem(const struct mh_host_topology *topology,
+                          uint64_t *free_mem, unsigned int nnodes)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_cpu_times(struct host_cpu_times *total,
+                      struct host_cpu_times *cpus, int ncpus)
+{
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
+enum mh_result
+host_os_get_snapshot(struct mh_host_snapshot *snapshot)
+{
+    /* sigar is as good as it gets here */
+    return MH_RES_NOT_IMPLEMENTED;
+}
+
 enum mh_result
 host_os_set_power_profile(const char *profile)
 {
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <signal.h>
@@ -438,56 +439,100 @@ mainloop_add_child(pid_t pid, int timeout, const char *desc, void * privatedata,
 }
 
 #if __linux__
-static void
-child_death_dispatch(int sig)
+/*
+ * Reap a tracked process if it exited, and run its callback.
+ */
+static gboolean
+child_reap(pid_t pid)
 {
-    int status = 0;
-    while (TRUE) {
-        pid_t pid = wait3(&status, WNOHANG, NULL);
-        if (pid > 0) {
-            int signo = 0, exitcode = 0;
-
-            mainloop_child_t *p = g_hash_table_lookup(mainloop_process_table,
-                                                      GINT_TO_POINTER(pid));
-            mh_trace("Managed process %d exited: %p", pid, p);
-            if (p == NULL) {
-                continue;
-            }
+    int status = 0, signo = 0, exitcode = 0;
+    mainloop_child_t *p = NULL;
+    pid_t rc = waitpid(pid, &status, WNOHANG);
 
-            if (WIFEXITED(status)) {
-                exitcode = WEXITSTATUS(status);
-                mh_trace("Managed process %d (%s) exited with rc=%d", pid,
-                         p->desc, exitcode);
+    if (rc == 0) {
+        return FALSE;
 
-            } else if (WIFSIGNALED(status)) {
-                signo = WTERMSIG(status);
-                mh_trace("Managed process %d (%s) exited with signal=%d", pid,
-                         p->desc, signo);
-            }
+    } else if (rc < 0) {
+        if (errno != ECHILD) {
+            mh_perror(LOG_ERR, "waitpid(%d) failed", pid);
+        }
+        return FALSE;
+    }
+
+    p = g_hash_table_lookup(mainloop_process_table, GINT_TO_POINTER(pid));
+    mh_trace("Managed process %d exited: %p", pid, p);
+    if (p == NULL) {
+        /* Removed by the callback of an earlier entry */
+        return TRUE;
+    }
+
+    if (WIFEXITED(status)) {
+        exitcode = WEXITSTATUS(status);
+        mh_trace("Managed process %d (%s) exited with rc=%d", pid,
+                 p->desc, exitcode);
+
+    } else if (WIFSIGNALED(status)) {
+        signo = WTERMSIG(status);
+        mh_trace("Managed process %d (%s) exited with signal=%d", pid,
+                 p->desc, signo);
+    }
 #ifdef WCOREDUMP
-            if (WCOREDUMP(status)) {
-                mh_err("Managed process %d (%s) dumped core", pid, p->desc);
-            }
+    if (WCOREDUMP(status)) {
+        mh_err("Managed process %d (%s) dumped core", pid, p->desc);
+    }
 #endif
-            if (p->timerid != 0) {
-                mh_trace("Removing timer %d", p->timerid);
-                g_source_remove(p->timerid);
-                p->timerid = 0;
-            }
-            p->callback(p, status, signo, exitcode);
-            g_hash_table_remove(mainloop_process_table, GINT_TO_POINTER(pid));
-            mh_trace("Removed process entry for %d", pid);
-            return;
+    if (p->timerid != 0) {
+        mh_trace("Removing timer %d", p->timerid);
+        g_source_remove(p->timerid);
+        p->timerid = 0;
+    }
+    p->callback(p, status, signo, exitcode);
+    g_hash_table_remove(mainloop_process_table, GINT_TO_POINTER(pid));
+    mh_trace("Removed process entry for %d", pid);
+    return TRUE;
+}
 
-        } else {
-            if (errno == EAGAIN) {
-                continue;
-            } else if (errno != ECHILD) {
-                mh_perror(LOG_ERR, "wait3() failed");
+static void
+child_death_dispatch(int sig)
+{
+    GList *pids = NULL, *iter = NULL;
+    siginfo_t info;
+
+    /*
+     * Only reap the processes we are tracking.  Anything else, such as a
+     * command being waited for synchronously on a worker thread, must keep
+     * its exit status for whoever is waiting on it.  Peek at the children
+     * which exited, without reaping them, and reap them while they are
+     * ours.
+     */
+    while (TRUE) {
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+            if (errno != ECHILD) {
+                mh_perror(LOG_ERR, "waitid() failed");
             }
+            return;
+        }
+        if (info.si_pid == 0) {
+            /* Nothing else exited */
+            return;
+        }
+        if (!g_hash_table_lookup(mainloop_process_table,
+                                 GINT_TO_POINTER(info.si_pid))
+            || !child_reap(info.si_pid)) {
             break;
         }
     }
+
+    /*
+     * A child somebody else waits for hides the others from waitid() until
+     * it is reaped, check the processes we track one by one.
+     */
+    pids = g_hash_table_get_keys(mainloop_process_table);
+    for (iter = pids; iter != NULL; iter = iter->next) {
+        child_reap(GPOINTER_TO_INT(iter->data));
+    }
+    g_list_free(pids);
 }
 #endif
 
@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <cstdlib>
+#include <time.h>
 
 #include <qpid/sys/Time.h>
 #include <qpid/agent/ManagementAgent.h>
@@ -50,6 +51,8 @@ extern "C" {
 #ifndef WIN32
 #include <sys/socket.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
 #ifdef MH_SSL
 #include <secmod.h>
 #endif
@@ -62,6 +65,16 @@ using namespace std;
 
 typedef qpid::types::Variant::Map OptionsMap;
 
+/* Default number of brokers of the same SRV priority connected to at once */
+#define MH_CONNECT_PARALLEL 3
+
+/* Default delay, in milliseconds, between racing connection attempts */
+#define MH_CONNECT_STAGGER 250
+
+/* Bounds, in milliseconds, of the delay between reconnection attempts */
+#define MH_BACKOFF_BASE 1000
+#define MH_BACKOFF_CAP (300 * 1000)
+
 
 struct MatahariAgentImpl {
     GMainLoop *_mainloop;
@@ -72,6 +85,52 @@ struct MatahariAgentImpl {
 
     qmf::Data _agent_instance;
     void registerAgent(void);
+
+    MatahariAgent *_agent;
+    std::string _proc_name;
+    OptionsMap _options;
+    OptionsMap _amqp_options;
+    void openSession(void);
+    void addSource(void);
+
+    /* Data objects added with MatahariAgent::addData() */
+    std::vector<std::pair<qmf::Data, std::string> > _data;
+    /* Agents hosted on our session, see MatahariAgent::attach() */
+    std::vector<MatahariAgentImpl *> _children;
+
+    /* Reconnection state, see disconnected() */
+    guint _reconnect_timer;
+    guint _backoff;
+    uint32_t _reconnects;
+    time_t _disconnected_at;
+    uint64_t _disconnected_time;
+    void disconnected(void);
+    void scheduleReconnect(void);
+    void startReconnect(void);
+    bool reconnect(qpid::messaging::Connection amqp);
+    void updateConnectionStats(void);
+
+    /* Set when hosted by another agent, see MatahariAgent::attach() */
+    MatahariAgentImpl *_parent;
+
+    /* Worker pool for blocking method handlers, see runBlocking() */
+    GThreadPool *_workers;
+    volatile gint _workers_active;
+    uint32_t _workers_peak;
+    uint64_t _workers_completed;
+    void updateWorkerStats(void);
+};
+
+/* A blocking method call handed to the worker pool */
+struct mh_blocking_call {
+    MatahariAgentImpl *impl;
+    qmf::AgentSession session;
+    qmf::AgentEvent event;
+    qpid::types::Variant::Map args;
+    qpid::types::Variant::Map results;
+    mh_blocking_fn fn;
+    void *userdata;
+    enum mh_result res;
 };
 
 
@@ -127,20 +186,42 @@ static gboolean
 mh_qpid_callback(qmf::AgentSession session, qmf::AgentEvent event,
                  gpointer user_data)
 {
-    MatahariAgent *agent = (MatahariAgent*) user_data;
+    MatahariAgentImpl *impl = (MatahariAgentImpl *) user_data;
     mh_trace("Qpid message recieved");
     if (event.hasDataAddr()) {
         mh_trace("Message is for %s (type: %s)",
                  event.getDataAddr().getName().c_str(),
                  event.getDataAddr().getAgentName().c_str());
     }
-    return agent->invoke(session, event, user_data);
+    return impl->_agent->invoke(session, event, impl->_agent);
 }
 
 static void
 mh_qpid_disconnect(gpointer user_data)
 {
+    MatahariAgentImpl *impl = (MatahariAgentImpl *) user_data;
+
     mh_err("Qpid connection closed");
+    impl->disconnected();
+}
+
+/*
+ * Decorrelated jitter: each delay is picked at random between the base and
+ * three times the previous delay.  The generator is seeded from the host UUID
+ * so that agents restarting together spread out instead of retrying in
+ * lockstep.
+ */
+static guint
+mh_backoff_next(guint previous)
+{
+    static GRand *backoff_rand = NULL;
+    guint upper = MIN(MAX(previous, MH_BACKOFF_BASE) * 3, MH_BACKOFF_CAP);
+
+    if (backoff_rand == NULL) {
+        backoff_rand = g_rand_new_with_seed(g_str_hash(mh_uuid()));
+    }
+
+    return g_rand_int_range(backoff_rand, MH_BACKOFF_BASE, upper + 1);
 }
 
 
@@ -188,8 +269,11 @@ map_option(int code, const char *name, const char *arg, void *userdata)
     } else if(strcmp(name, "dns-srv") == 0) {
         (*options)["dns-srv"] = 1;
 
-    } else {
+    } else if (arg) {
         (*options)[name] = arg;
+
+    } else {
+        (*options)[name] = true;
     }
     return 0;
 }
@@ -234,16 +318,196 @@ int print_help(int code, const char *name, const char *arg, void *userdata)
     return 0;
 }
 
+/*
+ * Connection attempts to the brokers of one SRV priority group are raced
+ * against each other.  Each attempt runs on its own thread, the first one to
+ * open its connection wins and the others close theirs as soon as they
+ * complete.  qpid offers no way to interrupt a pending open(), so losing
+ * attempts cannot be stopped any earlier.
+ */
+struct mh_connect_race {
+    GMutex *lock;
+    GCond *done;
+    int refs;
+    int pending;
+    bool won;
+    qpid::messaging::Connection winner;
+};
+
+struct mh_connect_attempt {
+    struct mh_connect_race *race;
+    std::string url;
+    OptionsMap options;
+};
+
+static void
+mh_connect_race_unref(struct mh_connect_race *race)
+{
+    bool last = false;
+
+    g_mutex_lock(race->lock);
+    last = (--race->refs == 0);
+    g_mutex_unlock(race->lock);
+
+    if (last) {
+        g_cond_free(race->done);
+        g_mutex_free(race->lock);
+        delete race;
+    }
+}
+
+static gpointer
+mh_connect_attempt_run(gpointer data)
+{
+    struct mh_connect_attempt *attempt = (struct mh_connect_attempt *) data;
+    struct mh_connect_race *race = attempt->race;
+    qpid::messaging::Connection amqp;
+    bool opened = false;
+
+    try {
+        amqp = qpid::messaging::Connection(attempt->url, attempt->options);
+        amqp.open();
+        opened = true;
+
+    } catch (const std::exception& err) {
+        mh_debug("Could not connect to %s: %s", attempt->url.c_str(),
+                 err.what());
+    }
+
+    g_mutex_lock(race->lock);
+    if (opened && !race->won) {
+        mh_trace("Connected to %s", attempt->url.c_str());
+        race->won = true;
+        race->winner = amqp;
+        opened = false;
+    }
+    race->pending--;
+    g_cond_signal(race->done);
+    g_mutex_unlock(race->lock);
+
+    if (opened) {
+        /* Another broker answered first */
+        mh_trace("Dropping connection to %s", attempt->url.c_str());
+        try {
+            amqp.close();
+        } catch (const std::exception&) {
+        }
+    }
+
+    mh_connect_race_unref(race);
+    delete attempt;
+    return NULL;
+}
+
+/*
+ * Connect to one of the given brokers, which all share the same SRV priority.
+ * Up to 'parallel' attempts are running at any time, each started 'stagger'
+ * milliseconds after the previous one unless that one failed sooner.
+ */
+static qpid::messaging::Connection
+mh_connect_group(const std::vector<std::string> &urls, OptionsMap &amqp_options,
+                 int parallel, int stagger, bool verbose)
+{
+    struct mh_connect_race *race = NULL;
+    qpid::messaging::Connection amqp;
+    size_t next = 0;
+
+    if (urls.size() == 1) {
+        /* Nothing to race against */
+        if (verbose) {
+            mh_info("Trying: %s", urls[0].c_str());
+        }
+        try {
+            amqp = qpid::messaging::Connection(urls[0], amqp_options);
+            amqp.open();
+        } catch (const std::exception& err) {
+            mh_debug("Could not connect to %s: %s", urls[0].c_str(),
+                     err.what());
+        }
+        return amqp;
+    }
+
+    race = new mh_connect_race;
+    race->lock = g_mutex_new();
+    race->done = g_cond_new();
+    race->refs = 1;
+    race->pending = 0;
+    race->won = false;
+
+    g_mutex_lock(race->lock);
+    while (!race->won && (race->pending > 0 || next < urls.size())) {
+        if (next < urls.size() && race->pending < parallel) {
+            struct mh_connect_attempt *attempt = new mh_connect_attempt;
+            GError *error = NULL;
+            GTimeVal deadline;
+
+            attempt->race = race;
+            attempt->url = urls[next++];
+            attempt->options = amqp_options;
+
+            if (verbose) {
+                mh_info("Trying: %s", attempt->url.c_str());
+            }
+
+            race->refs++;
+            race->pending++;
+            if (g_thread_create(mh_connect_attempt_run, attempt, FALSE,
+                                &error) == NULL) {
+                mh_err("Could not start a connection attempt to %s: %s",
+                       attempt->url.c_str(),
+                       error ? error->message : "unknown error");
+                if (error) {
+                    g_error_free(error);
+                }
+                race->refs--;
+                race->pending--;
+                delete attempt;
+                continue;
+            }
+
+            /* Give this attempt a head start before racing the next one */
+            g_get_current_time(&deadline);
+            g_time_val_add(&deadline, stagger * 1000);
+            while (!race->won && race->pending > 0
+                   && g_cond_timed_wait(race->done, race->lock, &deadline)) {
+                if (race->pending < parallel && !race->won) {
+                    /* An attempt failed early, move on */
+                    break;
+                }
+            }
+
+        } else {
+            g_cond_wait(race->done, race->lock);
+        }
+    }
+
+    if (race->won) {
+        amqp = race->winner;
+        race->winner = qpid::messaging::Connection();
+    }
+    g_mutex_unlock(race->lock);
+
+    mh_connect_race_unref(race);
+    return amqp;
+}
+
 qpid::messaging::Connection
 mh_connect(OptionsMap mh_options, OptionsMap amqp_options, int retry)
 {
     int retries = 0;
-    int backoff = 0;
+    guint backoff = 0;
+    int parallel = MH_CONNECT_PARALLEL;
+    int stagger = MH_CONNECT_STAGGER;
     GList *srv_records = NULL, *cur_srv_record = NULL;
     struct mh_dnssrv_record *record;
     GError *error = NULL;
     int status;
 
+    /* Brokers are connected to from separate threads, see mh_connect_group() */
+    if (!g_thread_supported()) {
+        g_thread_init(NULL);
+    }
+
     /* Attempt to initiate k5start for credential renewal's without
      * prompting for a password each time an agent is run
      */
@@ -304,62 +568,93 @@ mh_connect(OptionsMap mh_options, OptionsMap amqp_options, int retry)
             query << mh_dnsdomainname();
         }
 
-        if ((cur_srv_record = srv_records = mh_dnssrv_lookup(query.str().c_str()))) {
+        if ((srv_records = mh_dnssrv_lookup(query.str().c_str()))) {
             mh_info("SRV query successful: %s", query.str().c_str());
         } else {
             mh_info("SRV query not successful: %s", query.str().c_str());
         }
     }
 
+    if (mh_options.count("connect-parallel")) {
+        parallel = atoi(mh_options["connect-parallel"].asString().c_str());
+        if (parallel < 1) {
+            parallel = 1;
+        }
+    }
+    if (mh_options.count("connect-stagger")) {
+        stagger = atoi(mh_options["connect-stagger"].asString().c_str());
+    }
+
     while (true) {
-        std::stringstream url;
+        std::vector<std::string> group;
+        qpid::messaging::Connection amqp;
+
+        /*
+         * SRV records are sorted by priority.  Lower priority brokers are only
+         * tried once every broker of a higher priority group has failed.
+         */
+        cur_srv_record = srv_records;
+        do {
+            uint16_t priority = 0;
+
+            group.clear();
+            if (cur_srv_record) {
+                record = (struct mh_dnssrv_record *) cur_srv_record->data;
+                priority = mh_dnssrv_record_get_priority(record);
+            }
 
-        if (srv_records) {
-            /* Use the result of a DNS SRV lookup. */
+            while (cur_srv_record) {
+                std::stringstream url;
 
-            record = (struct mh_dnssrv_record *) cur_srv_record->data;
+                record = (struct mh_dnssrv_record *) cur_srv_record->data;
+                if (mh_dnssrv_record_get_priority(record) != priority) {
+                    break;
+                }
 
-            url << "amqp:" << mh_options["protocol"];
-            url << ":" << mh_dnssrv_record_get_host(record);
-            url << ":" << mh_dnssrv_record_get_port(record);
+                url << "amqp:" << mh_options["protocol"];
+                url << ":" << mh_dnssrv_record_get_host(record);
+                url << ":" << mh_dnssrv_record_get_port(record);
+                group.push_back(url.str());
 
-            cur_srv_record = cur_srv_record->next;
-            if (!cur_srv_record) {
-                cur_srv_record = srv_records;
+                cur_srv_record = cur_srv_record->next;
             }
-        } else if (mh_options.count("servername")) {
-            /* Use the explicitly specified broker hostname or IP address. */
-            url << "amqp:" << mh_options["protocol"] << ":" << mh_options["servername"] << ":" << mh_options["serverport"] ;
-        } else {
-            /* If nothing else, try localhost */
-            url << "amqp:" << mh_options["protocol"] << ":localhost:" << mh_options["serverport"] ;
-        }
+
+            if (group.empty()) {
+                std::stringstream url;
+
+                if (mh_options.count("servername")) {
+                    /* Use the explicitly specified broker hostname or IP address. */
+                    url << "amqp:" << mh_options["protocol"] << ":" << mh_options["servername"] << ":" << mh_options["serverport"] ;
+                } else {
+                    /* If nothing else, try localhost */
+                    url << "amqp:" << mh_options["protocol"] << ":localhost:" << mh_options["serverport"] ;
+                }
+                group.push_back(url.str());
+            }
+
+            amqp = mh_connect_group(group, amqp_options, parallel, stagger,
+                                    retries < 5);
+            if (amqp.isValid() && amqp.isOpen()) {
+                g_list_free_full(srv_records, mh_dnssrv_record_free);
+                return amqp;
+            }
+
+        } while (cur_srv_record);
 
         retries++;
-        qpid::messaging::Connection amqp = qpid::messaging::Connection(url.str(), amqp_options);
-        if(retries < 5) {
-            mh_info("Trying: %s", url.str().c_str());
-        } else if(retries == 5) {
+        if (retries == 5) {
             mh_warn("Cannot find a QMF broker - will keep retrying silently");
-        } else {
-            backoff = retries % 300;
         }
 
-        try {
-            amqp.open();
-            g_list_free_full(srv_records, mh_dnssrv_record_free);
-            return amqp;
-
-        } catch (const std::exception& err) {
-            if(!retry) {
-                goto bail;
-
-            } else if(backoff) {
-                g_usleep(backoff * G_USEC_PER_SEC);
-            }
+        if (!retry) {
+            break;
         }
+
+        backoff = mh_backoff_next(backoff);
+        mh_debug("Retrying in %.1fs", backoff / 1000.0);
+        g_usleep(backoff * 1000);
     }
-  bail:
+
     g_list_free_full(srv_records, mh_dnssrv_record_free);
     return NULL;
 }
@@ -456,6 +751,11 @@ mh_parse_options(const char *proc_name, int argc, char **argv, OptionsMap &optio
     mh_add_option('D', no_argument,       "dns-srv",                "interpret the value of --broker as a domain name for DNS SRV lookups", &options, map_option);
     mh_add_option('p', required_argument, "port",                   "specify broker port", &options, map_option);
     mh_add_option('v', no_argument,       "verbose",                "Increase the log level", NULL, map_option);
+    mh_add_option('e', required_argument, "event-batch",            "maximum number of QMF events handled per main loop iteration", &options, map_option);
+    mh_add_option('c', required_argument, "connect-parallel",       "number of brokers found via DNS SRV to try connecting to at once", &options, map_option);
+    mh_add_option('C', required_argument, "connect-stagger",        "time, in milliseconds, between starting parallel connection attempts", &options, map_option);
+    mh_add_option('w', required_argument, "worker-threads",         "number of threads used for blocking method calls (default: 0, handle them on the main loop)", &options, map_option);
+    mh_add_option('E', required_argument, "event-budget",           "time, in milliseconds, to spend handling QMF events per main loop iteration (0 for no limit)", &options, map_option);
 
     mh_add_option('u', required_argument, "username",  "username to use for authentication to the broker", &amqp_options, connection_option);
     mh_add_option('P', required_argument, "password",  "username to use for authentication to the broker", &amqp_options, connection_option);
@@ -584,6 +884,13 @@ mh_add_option(int code, int has_arg, const char *name, const char *description,
     return -1;
 }
 
+int
+mh_add_map_option(int code, int has_arg, const char *name,
+                  const char *description, OptionsMap &options)
+{
+    return mh_add_option(code, has_arg, name, description, &options, map_option);
+}
+
 int
 mh_should_daemonize(int code, const char *name, const char *arg, void *userdata)
 {
@@ -620,6 +927,11 @@ qmf::AgentSession& MatahariAgent::getSession(void)
     return _impl->_agent_session;
 }
 
+qpid::types::Variant::Map& MatahariAgent::getOptions(void)
+{
+    return _impl->_parent ? _impl->_parent->_options : _impl->_options;
+}
+
 void
 MatahariAgentImpl::registerAgent(void)
 {
@@ -640,14 +952,358 @@ MatahariAgentImpl::registerAgent(void)
         data_Agent.addProperty(prop);
     }
 
+    {
+        qmf::SchemaProperty prop("worker_threads", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Size of the worker pool for blocking method calls");
+        data_Agent.addProperty(prop);
+    }
+    {
+        qmf::SchemaProperty prop("worker_queue_depth", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Blocking method calls waiting for a worker");
+        data_Agent.addProperty(prop);
+    }
+    {
+        qmf::SchemaProperty prop("worker_queue_peak", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Highest number of blocking method calls waiting for a worker");
+        data_Agent.addProperty(prop);
+    }
+    {
+        qmf::SchemaProperty prop("worker_active", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Blocking method calls currently running");
+        data_Agent.addProperty(prop);
+    }
+    {
+        qmf::SchemaProperty prop("worker_completed", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Blocking method calls completed by the worker pool");
+        data_Agent.addProperty(prop);
+    }
+
+    {
+        qmf::SchemaProperty prop("reconnects", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setDesc("Number of times the broker connection was re-established");
+        data_Agent.addProperty(prop);
+    }
+    {
+        qmf::SchemaProperty prop("disconnected_time", qmf::SCHEMA_DATA_INT);
+        prop.setAccess(qmf::ACCESS_READ_ONLY);
+        prop.setUnit("seconds");
+        prop.setDesc("Total time spent without a broker connection");
+        data_Agent.addProperty(prop);
+    }
+
     _agent_session.registerSchema(data_Agent);
 
-    _agent_instance = qmf::Data(data_Agent);
-    _agent_instance.setProperty("uuid", mh_uuid());
-    _agent_instance.setProperty("hostname", mh_hostname());
+    /* After reconnecting, the existing object is published again */
+    if (!_agent_instance.isValid()) {
+        _agent_instance = qmf::Data(data_Agent);
+        _agent_instance.setProperty("uuid", mh_uuid());
+        _agent_instance.setProperty("hostname", mh_hostname());
+    }
+    updateWorkerStats();
+    updateConnectionStats();
     _agent_session.addData(_agent_instance);
 }
 
+void
+MatahariAgentImpl::updateConnectionStats(void)
+{
+    _agent_instance.setProperty("reconnects", _reconnects);
+    _agent_instance.setProperty("disconnected_time", _disconnected_time);
+}
+
+void
+MatahariAgentImpl::openSession(void)
+{
+    _agent_session = qmf::AgentSession(_amqp_connection);
+    _agent_session.setVendor("matahariproject.org");
+    _agent_session.setProduct(_proc_name);
+    _agent_session.setAttribute("uuid", mh_uuid());
+    _agent_session.setAttribute("hostname", mh_hostname());
+
+    _agent_session.open();
+}
+
+void
+MatahariAgentImpl::addSource(void)
+{
+    _qpid_source = mainloop_add_qmf(G_PRIORITY_HIGH, _agent_session,
+                                    mh_qpid_callback, mh_qpid_disconnect,
+                                    this);
+    if (_qpid_source
+        && (_options.count("event-batch") || _options.count("event-budget"))) {
+        guint batch = MH_QMF_BATCH_SIZE;
+        guint budget = MH_QMF_BATCH_BUDGET;
+
+        if (_options.count("event-batch")) {
+            batch = atoi(_options["event-batch"].asString().c_str());
+        }
+        if (_options.count("event-budget")) {
+            budget = atoi(_options["event-budget"].asString().c_str());
+        }
+        mainloop_qmf_set_batch(_qpid_source, batch, budget);
+    }
+}
+
+/*
+ * Called from the main loop once the QMF source has lost its session.  The
+ * session is re-created from a timer so that the rest of the agent keeps
+ * running while the broker is away.
+ */
+void
+MatahariAgentImpl::disconnected(void)
+{
+    /* The source is destroyed once we return */
+    _qpid_source = NULL;
+    _disconnected_at = time(NULL);
+
+    try {
+        _agent_session.close();
+    } catch (const std::exception& err) {
+        mh_trace("Could not close the QMF session: %s", err.what());
+    }
+    try {
+        _amqp_connection.close();
+    } catch (const std::exception& err) {
+        mh_trace("Could not close the broker connection: %s", err.what());
+    }
+
+    _backoff = 0;
+    scheduleReconnect();
+}
+
+/*
+ * A reconnection attempt.  Connecting can block for a long time (Kerberos
+ * credentials, DNS SRV lookups, unresponsive brokers), so it runs in its
+ * own thread and the result is handled on the main loop.
+ */
+struct mh_reconnect_attempt {
+    MatahariAgentImpl *impl;
+    OptionsMap options;
+    OptionsMap amqp_options;
+    qpid::messaging::Connection amqp;
+};
+
+static gboolean
+mh_reconnect_complete(gpointer data)
+{
+    struct mh_reconnect_attempt *attempt = (struct mh_reconnect_attempt *) data;
+
+    if (!attempt->impl->reconnect(attempt->amqp)) {
+        attempt->impl->scheduleReconnect();
+    }
+    delete attempt;
+    return FALSE;
+}
+
+static gpointer
+mh_reconnect_run(gpointer data)
+{
+    struct mh_reconnect_attempt *attempt = (struct mh_reconnect_attempt *) data;
+
+    attempt->amqp = mh_connect(attempt->options, attempt->amqp_options, FALSE);
+    g_idle_add(mh_reconnect_complete, attempt);
+    return NULL;
+}
+
+static gboolean
+mh_reconnect_timer(gpointer data)
+{
+    MatahariAgentImpl *impl = (MatahariAgentImpl *) data;
+
+    impl->_reconnect_timer = 0;
+    impl->startReconnect();
+    return FALSE;
+}
+
+void
+MatahariAgentImpl::scheduleReconnect(void)
+{
+    _backoff = mh_backoff_next(_backoff);
+    mh_info("Reconnecting to the broker in %.1fs", _backoff / 1000.0);
+    _reconnect_timer = g_timeout_add(_backoff, mh_reconnect_timer, this);
+}
+
+void
+MatahariAgentImpl::startReconnect(void)
+{
+    struct mh_reconnect_attempt *attempt = new mh_reconnect_attempt;
+    GError *error = NULL;
+
+    attempt->impl = this;
+    attempt->options = _options;
+    attempt->amqp_options = _amqp_options;
+    /*
+     * Fail rather than let qpid retry forever, the next attempt is
+     * scheduled with back-off
+     */
+    attempt->amqp_options["reconnect"] = false;
+
+    if (g_thread_create(mh_reconnect_run, attempt, FALSE, &error) == NULL) {
+        mh_err("Could not start a reconnection attempt: %s",
+               error ? error->message : "unknown error");
+        if (error) {
+            g_error_free(error);
+        }
+        delete attempt;
+        scheduleReconnect();
+    }
+}
+
+/*
+ * Restore the QMF session over a new broker connection, on the main loop.
+ */
+bool
+MatahariAgentImpl::reconnect(qpid::messaging::Connection amqp)
+{
+    std::vector<std::pair<qmf::Data, std::string> >::iterator data;
+    std::vector<MatahariAgentImpl *>::iterator child;
+
+    if (!amqp.isValid() || !amqp.isOpen()) {
+        return false;
+    }
+
+    _amqp_connection = amqp;
+    try {
+        openSession();
+        registerAgent();
+
+        /* Publish everything the agent and its hosted agents had published */
+        _agent->registerSchemas(_agent_session);
+        for (child = _children.begin(); child != _children.end(); child++) {
+            (*child)->_amqp_connection = _amqp_connection;
+            (*child)->_agent_session = _agent_session;
+            (*child)->_agent->registerSchemas(_agent_session);
+        }
+        for (data = _data.begin(); data != _data.end(); data++) {
+            _agent_session.addData(data->first, data->second);
+        }
+
+    } catch (const std::exception& err) {
+        mh_err("Could not restore the QMF session: %s", err.what());
+        try {
+            _agent_session.close();
+            _amqp_connection.close();
+        } catch (const std::exception&) {
+        }
+        return false;
+    }
+
+    _reconnects++;
+    _disconnected_time += time(NULL) - _disconnected_at;
+    updateConnectionStats();
+    addSource();
+
+    _agent->reconnected(_agent_session);
+    for (child = _children.begin(); child != _children.end(); child++) {
+        (*child)->_agent->reconnected(_agent_session);
+    }
+
+    mh_info("Reconnected to the broker after %ld seconds",
+            (long) (time(NULL) - _disconnected_at));
+    return true;
+}
+
+void
+MatahariAgentImpl::updateWorkerStats(void)
+{
+    uint32_t queued = 0;
+
+    if (_workers) {
+        queued = g_thread_pool_unprocessed(_workers);
+        _agent_instance.setProperty("worker_threads",
+                                    (uint32_t) g_thread_pool_get_max_threads(_workers));
+    } else {
+        _agent_instance.setProperty("worker_threads", (uint32_t) 0);
+    }
+
+    if (queued > _workers_peak) {
+        _workers_peak = queued;
+    }
+
+    _agent_instance.setProperty("worker_queue_depth", queued);
+    _agent_instance.setProperty("worker_queue_peak", _workers_peak);
+    _agent_instance.setProperty("worker_active",
+                                (uint32_t) g_atomic_int_get(&_workers_active));
+    _agent_instance.setProperty("worker_completed", _workers_completed);
+}
+
+static void
+mh_blocking_reply(struct mh_blocking_call *call)
+{
+    qpid::types::Variant::Map::iterator iter;
+
+    if (call->res != MH_RES_SUCCESS) {
+        call->session.raiseException(call->event, mh_result_to_str(call->res));
+        return;
+    }
+
+    for (iter = call->results.begin(); iter != call->results.end(); iter++) {
+        call->event.addReturnArgument(iter->first, iter->second);
+    }
+    call->session.methodSuccess(call->event);
+}
+
+static gboolean
+mh_blocking_complete(gpointer data)
+{
+    struct mh_blocking_call *call = (struct mh_blocking_call *) data;
+    MatahariAgentImpl *impl = call->impl;
+
+    mh_blocking_reply(call);
+    delete call;
+
+    impl->_workers_completed++;
+    impl->updateWorkerStats();
+    return FALSE;
+}
+
+static void
+mh_blocking_run(gpointer data, gpointer user_data)
+{
+    struct mh_blocking_call *call = (struct mh_blocking_call *) data;
+    MatahariAgentImpl *impl = (MatahariAgentImpl *) user_data;
+
+    g_atomic_int_inc(&impl->_workers_active);
+    call->res = call->fn(call->args, call->results, call->userdata);
+    g_atomic_int_add(&impl->_workers_active, -1);
+
+    /* Only the main loop may talk to the session */
+    g_idle_add(mh_blocking_complete, call);
+}
+
+void
+MatahariAgent::runBlocking(qmf::AgentSession session, qmf::AgentEvent event,
+                           mh_blocking_fn fn, void *userdata)
+{
+    struct mh_blocking_call *call = new mh_blocking_call;
+    MatahariAgentImpl *impl = _impl->_parent ? _impl->_parent : _impl;
+
+    call->impl = impl;
+    call->session = session;
+    call->event = event;
+    call->args = event.getArguments();
+    call->fn = fn;
+    call->userdata = userdata;
+    call->res = MH_RES_SUCCESS;
+
+    if (impl->_workers == NULL) {
+        call->res = fn(call->args, call->results, userdata);
+        mh_blocking_reply(call);
+        delete call;
+        return;
+    }
+
+    mh_trace("Queueing %s for the worker pool", event.getMethodName().c_str());
+    g_thread_pool_push(impl->_workers, call, NULL);
+    impl->updateWorkerStats();
+}
+
 static bool
 mh_hastty(void)
 {
@@ -666,12 +1322,25 @@ MatahariAgent::init(int argc, char **argv, const char* proc_name)
     std::stringstream logname;
     logname << "matahari-" << proc_name;
 
+    /* QMF events are received on a separate thread, see mainloop_add_qmf() */
+    if (!g_thread_supported()) {
+        g_thread_init(NULL);
+    }
+
     /* Set up basic logging */
     mh_log_init(proc_name, mh_log_level, mh_hastty());
     mh_add_option('d', no_argument, "daemon", "run as a daemon", NULL, mh_should_daemonize);
+    this->registerOptions(options);
 
     OptionsMap amqp_options = mh_parse_options(proc_name, argc, argv, options);
 
+    /*
+     * A lost connection is re-established by scheduleReconnect(), with
+     * jittered back-off and the agent's data published again, rather than
+     * by qpid, which retries without jitter and behind the agent's back.
+     */
+    amqp_options["reconnect"] = false;
+
 
     /* Re-initialize logging now that we've completed option processing */
     mh_log_init(strdup(logname.str().c_str()), mh_log_level, mh_hastty());
@@ -679,17 +1348,16 @@ MatahariAgent::init(int argc, char **argv, const char* proc_name)
     // Set up the cleanup handler for sigint
     signal(SIGINT, shutdown);
 
-    _impl->_amqp_connection = mh_connect(options, amqp_options, TRUE);
+    _impl->_agent = this;
+    _impl->_proc_name = proc_name;
+    _impl->_options = options;
+    _impl->_amqp_options = amqp_options;
 
-    _impl->_agent_session = qmf::AgentSession(_impl->_amqp_connection);
-    _impl->_agent_session.setVendor("matahariproject.org");
-    _impl->_agent_session.setProduct(proc_name);
-    _impl->_agent_session.setAttribute("uuid", mh_uuid());
-    _impl->_agent_session.setAttribute("hostname", mh_hostname());
-
-    _impl->_agent_session.open();
+    _impl->_amqp_connection = mh_connect(options, amqp_options, TRUE);
+    _impl->openSession();
 
     /* Do any setup required by our agent */
+    this->registerSchemas(_impl->_agent_session);
     if (this->setup(_impl->_agent_session) < 0) {
         mh_err("Failed to set up broker connection to %s for %s\n",
                options["servername"].asString().c_str(), proc_name);
@@ -697,17 +1365,57 @@ MatahariAgent::init(int argc, char **argv, const char* proc_name)
         goto return_cleanup;
     }
 
+    if (options.count("worker-threads")) {
+        int threads = atoi(options["worker-threads"].asString().c_str());
+        GError *error = NULL;
+
+        if (threads > 0) {
+            _impl->_workers = g_thread_pool_new(mh_blocking_run, _impl, threads,
+                                                FALSE, &error);
+            if (_impl->_workers == NULL) {
+                mh_err("Could not create a pool of %d worker threads: %s",
+                       threads, error ? error->message : "unknown error");
+                if (error) {
+                    g_error_free(error);
+                }
+            } else {
+                mh_info("Using %d worker threads for blocking method calls",
+                        threads);
+            }
+        }
+    }
+
     _impl->registerAgent();
 
     _impl->_mainloop = g_main_new(FALSE);
-    _impl->_qpid_source = mainloop_add_qmf(G_PRIORITY_HIGH, _impl->_agent_session,
-                                           mh_qpid_callback, mh_qpid_disconnect,
-                                           this);
+    _impl->addSource();
 
 return_cleanup:
     return res;
 }
 
+int
+MatahariAgent::attach(MatahariAgent *parent)
+{
+    _impl->_agent = this;
+    _impl->_parent = parent->_impl;
+    _impl->_amqp_connection = parent->_impl->_amqp_connection;
+    _impl->_agent_session = parent->_impl->_agent_session;
+    parent->_impl->_children.push_back(_impl);
+
+    this->registerSchemas(_impl->_agent_session);
+    return this->setup(_impl->_agent_session);
+}
+
+qmf::DataAddr
+MatahariAgent::addData(qmf::Data &data, const std::string &name)
+{
+    MatahariAgentImpl *impl = _impl->_parent ? _impl->_parent : _impl;
+
+    impl->_data.push_back(std::make_pair(data, name));
+    return _impl->_agent_session.addData(data, name);
+}
+
 void
 MatahariAgent::run()
 {
@@ -715,45 +1423,152 @@ MatahariAgent::run()
     g_main_run(_impl->_mainloop);
 }
 
+static void
+mainloop_qmf_wakeup(mainloop_qmf_t *qmf)
+{
+#ifdef WIN32
+    g_main_context_wakeup(g_source_get_context((GSource *) qmf));
+#else
+    static const char token = 0;
+
+    /* A full pipe already guarantees a wakeup, so EAGAIN can be ignored */
+    if (write(qmf->wakeup[1], &token, sizeof(token)) < 0
+        && errno != EAGAIN && errno != EINTR) {
+        mh_perror(LOG_ERR, "Could not wake up the main loop");
+    }
+#endif
+}
+
+static gpointer
+mainloop_qmf_receive(gpointer user_data)
+{
+    mainloop_qmf_t *qmf = (mainloop_qmf_t *) user_data;
+
+    mh_trace("Receiving QMF events for source %p", qmf);
+    while (g_atomic_int_get(&qmf->closed) == FALSE) {
+        qmf::AgentEvent event;
+
+        try {
+            /*
+             * Block until an event arrives.  The timeout only exists so
+             * that a destroyed source is noticed eventually, it does not
+             * wake up the main loop.
+             */
+            if (!qmf->session.nextEvent(event,
+                                        qpid::messaging::Duration::MINUTE)) {
+                continue;
+            }
+
+        } catch (const std::exception& err) {
+            mh_err("Could not receive QMF events: %s", err.what());
+            g_atomic_int_set(&qmf->closed, TRUE);
+            mainloop_qmf_wakeup(qmf);
+            break;
+        }
+
+        g_async_queue_push(qmf->events, new qmf::AgentEvent(event));
+        mainloop_qmf_wakeup(qmf);
+    }
+
+    mh_trace("Stopped receiving QMF events for source %p", qmf);
+    g_source_unref((GSource *) qmf);
+    return NULL;
+}
+
+static gboolean
+mainloop_qmf_pending(mainloop_qmf_t *qmf)
+{
+    return g_async_queue_length(qmf->events) > 0
+           || g_atomic_int_get(&qmf->closed);
+}
+
 static gboolean
 mainloop_qmf_prepare(GSource* source, gint *timeout)
 {
     mainloop_qmf_t *qmf = (mainloop_qmf_t *) source;
-    if (qmf->event) {
-        return TRUE;
-    }
 
-    *timeout = 1;
-    return FALSE;
+    /* Nothing to poll for, the receiver thread will wake us up */
+    *timeout = -1;
+    return mainloop_qmf_pending(qmf);
 }
 
 static gboolean
 mainloop_qmf_check(GSource* source)
 {
     mainloop_qmf_t *qmf = (mainloop_qmf_t *) source;
-    if (qmf->event) {
-        return TRUE;
+    return mainloop_qmf_pending(qmf);
+}
 
-    } else if (qmf->session.nextEvent(qmf->event,
-                                      qpid::messaging::Duration::IMMEDIATE)) {
-        return TRUE;
+static void
+mainloop_qmf_drain(mainloop_qmf_t *qmf)
+{
+#ifndef WIN32
+    char buffer[64];
+
+    if (qmf->gpoll.revents == 0) {
+        return;
     }
-    return FALSE;
+
+    while (read(qmf->wakeup[0], buffer, sizeof(buffer)) > 0) {
+        /* Discard wakeup tokens */;
+    }
+    qmf->gpoll.revents = 0;
+#endif
 }
 
 static gboolean
 mainloop_qmf_dispatch(GSource *source, GSourceFunc callback, gpointer userdata)
 {
     mainloop_qmf_t *qmf = (mainloop_qmf_t *) source;
+    qmf::AgentEvent *event = NULL;
+    guint handled = 0;
+
     mh_trace("%p", source);
-    if (qmf->dispatch != NULL) {
-        qmf::AgentEvent event = qmf->event;
-        qmf->event = NULL;
+    mainloop_qmf_drain(qmf);
+    g_timer_start(qmf->timer);
+
+    /*
+     * Handle pending events in batches so that a burst of method calls does
+     * not cost a full main loop iteration each, but stop once the batch or
+     * the time budget is used up so that timers and child sources still get
+     * a chance to run.  Anything left over keeps the source ready.
+     */
+    while (handled < qmf->batch_size) {
+        event = (qmf::AgentEvent *) g_async_queue_try_pop(qmf->events);
+        if (event == NULL) {
+            break;
+        }
 
-        if (qmf->dispatch(qmf->session, event, qmf->user_data) == FALSE) {
+        if (qmf->dispatch != NULL
+            && qmf->dispatch(qmf->session, *event, qmf->user_data) == FALSE) {
+            delete event;
+            g_atomic_int_set(&qmf->closed, TRUE);
             g_source_unref(source); /* Really? */
             return FALSE;
         }
+
+        delete event;
+        handled++;
+
+        if (qmf->budget_ms
+            && g_timer_elapsed(qmf->timer, NULL) * 1000 >= qmf->budget_ms) {
+            break;
+        }
+    }
+
+    if (handled > 1) {
+        mh_trace("Dispatched %u QMF events in %.3fs", handled,
+                 g_timer_elapsed(qmf->timer, NULL));
+    }
+
+    if (handled == 0 && g_atomic_int_get(&qmf->closed)) {
+        mh_info("QMF source %d closed", qmf->id);
+        if (qmf->dnotify) {
+            qmf->dnotify(qmf->user_data);
+            qmf->dnotify = NULL;
+        }
+        g_source_unref(source); /* Really? */
+        return FALSE;
     }
 
     return TRUE;
@@ -763,11 +1578,28 @@ static void
 mainloop_qmf_destroy(GSource *source)
 {
     mainloop_qmf_t *qmf = (mainloop_qmf_t *) source;
+    qmf::AgentEvent *event = NULL;
+
     mh_trace("%p", source);
 
-    if (qmf->dnotify) {
-        qmf->dnotify(qmf->user_data);
+    while ((event = (qmf::AgentEvent *) g_async_queue_try_pop(qmf->events))) {
+        delete event;
     }
+    g_async_queue_unref(qmf->events);
+    qmf->events = NULL;
+    g_timer_destroy(qmf->timer);
+    qmf->timer = NULL;
+
+#ifndef WIN32
+    for (int lpc = 0; lpc < 2; lpc++) {
+        if (qmf->wakeup[lpc] >= 0) {
+            close(qmf->wakeup[lpc]);
+        }
+    }
+#endif
+
+    /* Release our reference to the session */
+    qmf->session = qmf::AgentSession();
 }
 
 static GSourceFuncs mainloop_qmf_funcs = {
@@ -784,6 +1616,7 @@ mainloop_add_qmf(int priority, qmf::AgentSession session,
                  GDestroyNotify notify, gpointer userdata)
 {
     GSource *source = NULL;
+    GError *error = NULL;
     mainloop_qmf_t *qmf_source = NULL;
     MH_ASSERT(sizeof(mainloop_qmf_t) > sizeof(GSource));
     source = g_source_new(&mainloop_qmf_funcs, sizeof(mainloop_qmf_t));
@@ -791,8 +1624,32 @@ mainloop_add_qmf(int priority, qmf::AgentSession session,
 
     qmf_source = (mainloop_qmf_t *) source;
     qmf_source->id = 0;
-    qmf_source->event = NULL;
+    qmf_source->closed = FALSE;
     qmf_source->session = session;
+    qmf_source->events = g_async_queue_new();
+    qmf_source->timer = g_timer_new();
+    qmf_source->batch_size = MH_QMF_BATCH_SIZE;
+    qmf_source->budget_ms = MH_QMF_BATCH_BUDGET;
+
+#ifndef WIN32
+    qmf_source->wakeup[0] = qmf_source->wakeup[1] = -1;
+    if (pipe(qmf_source->wakeup) < 0) {
+        mh_perror(LOG_ERR, "pipe() failed");
+        /* mainloop_qmf_destroy() cleans up */
+        g_source_unref(source);
+        return NULL;
+    }
+    for (int lpc = 0; lpc < 2; lpc++) {
+        fcntl(qmf_source->wakeup[lpc], F_SETFL,
+              fcntl(qmf_source->wakeup[lpc], F_GETFL) | O_NONBLOCK);
+        fcntl(qmf_source->wakeup[lpc], F_SETFD, FD_CLOEXEC);
+    }
+
+    qmf_source->gpoll.fd = qmf_source->wakeup[0];
+    qmf_source->gpoll.events = G_IO_IN|G_IO_ERR|G_IO_HUP;
+    qmf_source->gpoll.revents = 0;
+    g_source_add_poll(source, &qmf_source->gpoll);
+#endif
 
     /*
      * Normally we'd use g_source_set_callback() to specify the dispatch
@@ -807,13 +1664,45 @@ mainloop_add_qmf(int priority, qmf::AgentSession session,
     g_source_set_can_recurse(source, FALSE);
 
     qmf_source->id = g_source_attach(source, NULL);
+
+    /* The receiver thread holds its own reference until it exits */
+    g_source_ref(source);
+    qmf_source->receiver = g_thread_create(mainloop_qmf_receive, qmf_source,
+                                           FALSE, &error);
+    if (qmf_source->receiver == NULL) {
+        mh_crit("Could not start the QMF receiver thread: %s",
+                error ? error->message : "unknown error");
+        if (error) {
+            g_error_free(error);
+        }
+        g_source_unref(source);
+        mainloop_destroy_qmf(qmf_source);
+        return NULL;
+    }
+
     mh_info("Added source: %d", qmf_source->id);
     return qmf_source;
 }
 
+void
+mainloop_qmf_set_batch(mainloop_qmf_t *source, guint batch_size,
+                       guint budget_ms)
+{
+    source->batch_size = batch_size ? batch_size : 1;
+    source->budget_ms = budget_ms;
+    mh_debug("Dispatching up to %u QMF events per iteration (budget: %ums)",
+             source->batch_size, source->budget_ms);
+}
+
 gboolean
 mainloop_destroy_qmf(mainloop_qmf_t *source)
 {
+    g_atomic_int_set(&source->closed, TRUE);
+    if (source->dnotify) {
+        source->dnotify(source->user_data);
+        source->dnotify = NULL;
+    }
+
     g_source_remove(source->id);
     source->id = 0;
     g_source_unref((GSource *) source);
@@ -20,6 +20,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -28,6 +31,7 @@
 #include "matahari/logging.h"
 #include "matahari/mainloop.h"
 #include "matahari/services.h"
+#include "matahari/utilities.h"
 #include "services_private.h"
 #include "sigar.h"
 
@@ -38,6 +42,34 @@ MH_TRACE_INIT_DATA(mh_services);
 static int operations = 0;
 GHashTable *recurring_actions = NULL;
 
+/*
+ * Asynchronous actions are started as long as fewer than max_running are
+ * running and no other action of the same resource is.  The others wait,
+ * in the order they were requested, per resource: only the first waiting
+ * action of each resource is in one of the lanes, so that the lanes rank
+ * actions of different resources but never reorder those of one resource.
+ */
+enum action_lane {
+    LANE_STOP,
+    LANE_DEFAULT,
+    LANE_MONITOR,
+    LANES
+};
+
+static struct {
+    GQueue lanes[LANES];
+    /** Resources with an action running, by name */
+    GHashTable *busy;
+    /** GQueue of the waiting actions of each resource, by name */
+    GHashTable *waiting;
+    /** Order in which actions were queued */
+    guint64 order;
+    guint idle;
+    struct svc_queue_stats stats;
+} scheduler;
+
+static size_t max_output = SVC_DEFAULT_MAX_OUTPUT;
+
 svc_action_t *
 services_action_create(const char *name, const char *action, int interval,
                        int timeout)
@@ -159,6 +191,448 @@ mh_services_action_create_generic(const char *exec, const char *args[])
     return op;
 }
 
+void
+services_set_max_output(size_t max)
+{
+    max_output = max ? max : SVC_DEFAULT_MAX_OUTPUT;
+}
+
+static void
+output_tail_append(struct svc_output *output, const char *data, size_t len)
+{
+    size_t size = output->max - output->max / 2;
+    size_t first;
+
+    if (len >= size) {
+        memcpy(output->tail, data + len - size, size);
+        output->tail_pos = 0;
+        output->tail_len = size;
+        return;
+    }
+
+    first = MIN(len, size - output->tail_pos);
+    memcpy(output->tail + output->tail_pos, data, first);
+    memcpy(output->tail, data + first, len - first);
+    output->tail_pos = (output->tail_pos + len) % size;
+    output->tail_len = MIN(output->tail_len + len, size);
+}
+
+void
+services_output_append(struct svc_output *output, const char *data,
+                       size_t len)
+{
+    size_t keep;
+
+    if (!output->total) {
+        output->max = max_output;
+    }
+    output->total += len;
+
+    if (!output->tail && output->head_len + len <= output->max) {
+        if (output->head_len + len > output->head_size) {
+            /* Doubled, so that appending is linear overall */
+            output->head_size = MAX(1024, output->head_size);
+            while (output->head_len + len > output->head_size) {
+                output->head_size *= 2;
+            }
+            output->head_size = MIN(output->head_size, output->max);
+            output->head = realloc(output->head, output->head_size);
+        }
+        memcpy(output->head + output->head_len, data, len);
+        output->head_len += len;
+        return;
+    }
+
+    if (!output->tail) {
+        /* Too much output: from now on, only keep the head and the tail */
+        keep = output->max / 2;
+        output->tail = malloc(output->max - keep);
+
+        if (output->head_len > keep) {
+            output_tail_append(output, output->head + keep,
+                               output->head_len - keep);
+            output->head_len = keep;
+        } else {
+            size_t more = MIN(keep - output->head_len, len);
+
+            if (output->head_size < keep) {
+                output->head_size = keep;
+                output->head = realloc(output->head, output->head_size);
+            }
+            memcpy(output->head + output->head_len, data, more);
+            output->head_len += more;
+            data += more;
+            len -= more;
+        }
+    }
+
+    output_tail_append(output, data, len);
+}
+
+char *
+services_output_finish(struct svc_output *output, size_t *len)
+{
+    size_t size = output->max - output->max / 2;
+    char note[64];
+    int note_len;
+    char *data;
+
+    *len = 0;
+    if (!output->total) {
+        return NULL;
+    }
+
+    if (!output->tail) {
+        data = realloc(output->head, output->head_len + 1);
+        data[output->head_len] = 0;
+        *len = output->head_len;
+        output->head = NULL;
+        services_output_clear(output);
+        return data;
+    }
+
+    note_len = snprintf(note, sizeof(note), "\n[... %llu bytes left out ...]\n",
+                        (unsigned long long) (output->total - output->head_len
+                                              - output->tail_len));
+
+    *len = output->head_len + note_len + output->tail_len;
+    data = malloc(*len + 1);
+    memcpy(data, output->head, output->head_len);
+    memcpy(data + output->head_len, note, note_len);
+
+    /* Oldest first: the ring is only in order once it has filled up */
+    if (output->tail_len < size) {
+        memcpy(data + output->head_len + note_len, output->tail,
+               output->tail_len);
+    } else {
+        memcpy(data + output->head_len + note_len,
+               output->tail + output->tail_pos, size - output->tail_pos);
+        memcpy(data + output->head_len + note_len + size - output->tail_pos,
+               output->tail, output->tail_pos);
+    }
+    data[*len] = 0;
+
+    mh_info("Kept %llu of %llu bytes of output",
+            (unsigned long long) (*len - note_len),
+            (unsigned long long) output->total);
+    services_output_clear(output);
+    return data;
+}
+
+void
+services_output_clear(struct svc_output *output)
+{
+    free(output->head);
+    free(output->tail);
+    memset(output, 0, sizeof(*output));
+}
+
+/* Output passed at once, complete line or not, to bound what is pending */
+#define STREAM_MAX_PENDING (64 * 1024)
+
+void
+services_action_stream_output(svc_action_t *op, svc_output_fn fn,
+                              unsigned int interval, unsigned int max_lines)
+{
+    op->opaque->output_fn = fn;
+    op->opaque->output_interval = interval ? interval : 1000;
+    op->opaque->output_max_lines = max_lines;
+}
+
+/*
+ * Pass the complete lines pending on a stream, or everything.
+ */
+static void
+output_stream_pass(svc_action_t *op, enum svc_stream stream, gboolean all)
+{
+    GString *pending = op->opaque->output_pending[stream];
+    size_t len;
+
+    if (!pending || !pending->len) {
+        return;
+    }
+
+    len = pending->len;
+    if (!all) {
+        /* Up to the last newline */
+        while (len > 0 && pending->str[len - 1] != '\n') {
+            len--;
+        }
+        if (!len) {
+            return;
+        }
+    }
+
+    op->opaque->output_fn(op, stream == SVC_STREAM_STDERR, pending->str, len);
+    g_string_erase(pending, 0, len);
+    op->opaque->output_lines[stream] = 0;
+}
+
+static gboolean
+output_stream_timer(gpointer data)
+{
+    svc_action_t *op = data;
+
+    op->opaque->output_timer = 0;
+    output_stream_pass(op, SVC_STREAM_STDOUT, FALSE);
+    output_stream_pass(op, SVC_STREAM_STDERR, FALSE);
+    return FALSE;
+}
+
+void
+services_output_stream(svc_action_t *op, gboolean is_stderr,
+                       const char *data, size_t len)
+{
+    enum svc_stream stream = is_stderr ? SVC_STREAM_STDERR : SVC_STREAM_STDOUT;
+    GString *pending = op->opaque->output_pending[stream];
+    const char *next = data;
+
+    if (!pending) {
+        pending = op->opaque->output_pending[stream] = g_string_new(NULL);
+    }
+    g_string_append_len(pending, data, len);
+
+    while ((next = memchr(next, '\n', data + len - next))) {
+        op->opaque->output_lines[stream]++;
+        next++;
+    }
+
+    if (pending->len > STREAM_MAX_PENDING) {
+        output_stream_pass(op, stream, TRUE);
+
+    } else if (op->opaque->output_max_lines
+               && op->opaque->output_lines[stream]
+                  >= op->opaque->output_max_lines) {
+        output_stream_pass(op, stream, FALSE);
+    }
+
+    if (pending->len && !op->opaque->output_timer) {
+        op->opaque->output_timer = g_timeout_add(op->opaque->output_interval,
+                                                 output_stream_timer, op);
+    }
+}
+
+void
+services_output_stream_flush(svc_action_t *op)
+{
+    if (op->opaque->output_timer) {
+        g_source_remove(op->opaque->output_timer);
+        op->opaque->output_timer = 0;
+    }
+    if (op->opaque->output_fn) {
+        output_stream_pass(op, SVC_STREAM_STDOUT, TRUE);
+        output_stream_pass(op, SVC_STREAM_STDERR, TRUE);
+    }
+}
+
+static enum action_lane
+action_lane(const svc_action_t *op)
+{
+    if (op->action == NULL) {
+        return LANE_DEFAULT;
+    } else if (strcmp(op->action, "stop") == 0) {
+        return LANE_STOP;
+    } else if (strcmp(op->action, "monitor") == 0
+               || strcmp(op->action, "status") == 0) {
+        return LANE_MONITOR;
+    }
+    return LANE_DEFAULT;
+}
+
+static unsigned int
+default_max_running(void)
+{
+    sigar_cpu_info_list_t cpus;
+    unsigned int ncpus = 1;
+    sigar_t *sigar;
+
+    if (sigar_open(&sigar) == SIGAR_OK) {
+        if (sigar_cpu_info_list_get(sigar, &cpus) == SIGAR_OK) {
+            if (cpus.number > 0) {
+                ncpus = cpus.number;
+            }
+            sigar_cpu_info_list_destroy(sigar, &cpus);
+        }
+        sigar_close(sigar);
+    }
+
+    return 2 * ncpus;
+}
+
+static gboolean
+action_busy(const svc_action_t *op)
+{
+    return op->rsc && scheduler.busy
+           && g_hash_table_lookup(scheduler.busy, op->rsc);
+}
+
+static void
+action_release(svc_action_t *op)
+{
+    op->opaque->running = FALSE;
+    scheduler.stats.running--;
+    if (op->rsc) {
+        g_hash_table_remove(scheduler.busy, op->rsc);
+    }
+}
+
+static gboolean
+action_start(svc_action_t *op)
+{
+    uint64_t waited = (g_get_monotonic_time() - op->opaque->queued_at) / 1000;
+
+    scheduler.stats.started++;
+    scheduler.stats.wait_total += waited;
+    if (waited > scheduler.stats.wait_max) {
+        scheduler.stats.wait_max = waited;
+    }
+
+    if (!services_os_action_execute(op, FALSE)) {
+        return FALSE;
+    }
+
+    /* Some platforms complete the action right away */
+    if (op->pid == 0) {
+        return TRUE;
+    }
+
+    op->opaque->running = TRUE;
+    scheduler.stats.running++;
+    if (op->rsc) {
+        g_hash_table_insert(scheduler.busy, op->rsc, op);
+    }
+    return TRUE;
+}
+
+static gint
+action_order(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const svc_action_t *op_a = a;
+    const svc_action_t *op_b = b;
+
+    return op_a->opaque->queue_order < op_b->opaque->queue_order ? -1 : 1;
+}
+
+static void
+lane_insert(svc_action_t *op)
+{
+    g_queue_insert_sorted(&scheduler.lanes[action_lane(op)], op,
+                          action_order, NULL);
+}
+
+static void
+action_enqueue(svc_action_t *op)
+{
+    GQueue *waiting = NULL;
+
+    op->opaque->queued = TRUE;
+    op->opaque->queue_order = ++scheduler.order;
+    scheduler.stats.delayed++;
+    scheduler.stats.queued++;
+    if (scheduler.stats.queued > scheduler.stats.max_queued) {
+        scheduler.stats.max_queued = scheduler.stats.queued;
+    }
+
+    if (op->rsc) {
+        waiting = g_hash_table_lookup(scheduler.waiting, op->rsc);
+        if (waiting) {
+            /* Behind an earlier action of the resource, out of the lanes */
+            g_queue_push_tail(waiting, op);
+            return;
+        }
+        waiting = g_queue_new();
+        g_queue_push_tail(waiting, op);
+        g_hash_table_insert(scheduler.waiting, strdup(op->rsc), waiting);
+    }
+
+    lane_insert(op);
+}
+
+static void
+action_dequeue(svc_action_t *op)
+{
+    GQueue *waiting = NULL;
+
+    op->opaque->queued = FALSE;
+    scheduler.stats.queued--;
+
+    if (op->rsc) {
+        waiting = g_hash_table_lookup(scheduler.waiting, op->rsc);
+    }
+    if (waiting && g_queue_peek_head(waiting) != op) {
+        g_queue_remove(waiting, op);
+        return;
+    }
+
+    g_queue_remove(&scheduler.lanes[action_lane(op)], op);
+    if (!waiting) {
+        return;
+    }
+
+    g_queue_pop_head(waiting);
+    if (g_queue_is_empty(waiting)) {
+        g_hash_table_remove(scheduler.waiting, op->rsc);
+    } else {
+        /* The next action of the resource takes its place */
+        lane_insert(g_queue_peek_head(waiting));
+    }
+}
+
+/*
+ * Take the first queued action of the highest lane whose resource is idle.
+ */
+static svc_action_t *
+next_action(void)
+{
+    svc_action_t *op;
+    GList *iter;
+    int lane;
+
+    for (lane = 0; lane < LANES; lane++) {
+        for (iter = scheduler.lanes[lane].head; iter; iter = iter->next) {
+            op = iter->data;
+            if (!action_busy(op)) {
+                action_dequeue(op);
+                return op;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+schedule_actions(void)
+{
+    svc_action_t *op;
+
+    while (scheduler.stats.running < scheduler.stats.max_running
+           && (op = next_action())) {
+        if (action_start(op)) {
+            continue;
+        }
+
+        /* The caller was told the action was queued, so it gets a result */
+        mh_err("Could not start queued action %s", op->id);
+        op->status = LRM_OP_ERROR;
+        op->rc = OCF_UNKNOWN_ERROR;
+        if (op->opaque->callback) {
+            op->opaque->callback(op);
+        }
+        if (!op->interval) {
+            services_action_free(op);
+        }
+    }
+}
+
+static gboolean
+schedule_idle(gpointer data)
+{
+    scheduler.idle = 0;
+    schedule_actions();
+    return FALSE;
+}
+
 void
 services_action_free(svc_action_t *op)
 {
@@ -178,6 +652,18 @@ services_action_free(svc_action_t *op)
         op->opaque->stdout_gsource = NULL;
     }
 
+    if (op->opaque->queued) {
+        action_dequeue(op);
+    }
+
+    /* Freed while running, e.g. cancelled: let the next action have its slot */
+    if (op->opaque->running) {
+        action_release(op);
+        if (!scheduler.idle) {
+            scheduler.idle = g_idle_add(schedule_idle, NULL);
+        }
+    }
+
     free(op->id);
     free(op->opaque->exec);
 
@@ -194,6 +680,17 @@ services_action_free(svc_action_t *op)
 
     free(op->stdout_data);
     free(op->stderr_data);
+    services_output_clear(&op->opaque->stdout_output);
+    services_output_clear(&op->opaque->stderr_output);
+
+    if (op->opaque->output_timer) {
+        g_source_remove(op->opaque->output_timer);
+    }
+    for (i = 0; i < DIMOF(op->opaque->output_pending); i++) {
+        if (op->opaque->output_pending[i]) {
+            g_string_free(op->opaque->output_pending[i], TRUE);
+        }
+    }
 
     if (op->params) {
         g_hash_table_destroy(op->params);
@@ -240,7 +737,62 @@ services_action_async(svc_action_t* op, void (*action_callback)(svc_action_t *))
         g_hash_table_replace(recurring_actions, op->id, op);
     }
 
-    return services_os_action_execute(op, FALSE);
+    if (scheduler.busy == NULL) {
+        scheduler.busy = g_hash_table_new(g_str_hash, g_str_equal);
+        scheduler.waiting = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                  free,
+                                                  (GDestroyNotify) g_queue_free);
+        if (!scheduler.stats.max_running) {
+            scheduler.stats.max_running = default_max_running();
+        }
+    }
+
+    op->opaque->queued_at = g_get_monotonic_time();
+
+    /*
+     * With a free slot, anything queued is waiting for its resource, so
+     * this action does not get ahead of any it could have waited for,
+     * unless it is for that resource
+     */
+    if (scheduler.stats.running < scheduler.stats.max_running
+        && !action_busy(op)
+        && !(op->rsc && g_hash_table_lookup(scheduler.waiting, op->rsc))) {
+        return action_start(op);
+    }
+
+    mh_debug("Queueing %s, %u actions running", op->id,
+             scheduler.stats.running);
+    action_enqueue(op);
+    return TRUE;
+}
+
+void
+services_action_finished(svc_action_t *op)
+{
+    if (!op->opaque->running) {
+        return;
+    }
+
+    action_release(op);
+    schedule_actions();
+}
+
+void
+services_set_max_running(unsigned int max)
+{
+    scheduler.stats.max_running = max ? max : default_max_running();
+    if (scheduler.busy) {
+        schedule_actions();
+    }
+}
+
+void
+services_get_queue_stats(struct svc_queue_stats *stats)
+{
+    *stats = scheduler.stats;
+    if (!stats->max_running) {
+        stats->max_running = default_max_running();
+    }
 }
 
 gboolean
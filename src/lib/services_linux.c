@@ -21,10 +21,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "matahari/logging.h"
@@ -47,54 +51,60 @@ set_fd_opts(int fd, int opts)
     }
 }
 
+/*
+ * Read at most max_reads chunks of what is available from a pipe of a child.
+ *
+ * Returns FALSE once the child closed it.
+ */
 static gboolean
-read_output(int fd, gpointer user_data)
+read_pipe(svc_action_t *op, int fd, int max_reads)
 {
-    char * data = NULL;
-    int rc = 0, len = 0;
-    gboolean is_err = FALSE;
-    svc_action_t* op = (svc_action_t *) user_data;
-    char buf[500];
-    static const size_t buf_read_len = sizeof(buf) - 1;
-
-    mh_trace("%p", op);
-
-    if (fd == op->opaque->stderr_fd) {
-        is_err = TRUE;
-        if (op->stderr_data) {
-            len = strlen(op->stderr_data);
-            data = op->stderr_data;
-        }
-    } else if (op->stdout_data) {
-        len = strlen(op->stdout_data);
-        data = op->stdout_data;
+    gboolean is_stderr = (fd == op->opaque->stderr_fd);
+    struct svc_output *output = &op->opaque->stdout_output;
+    char buf[4096];
+    ssize_t rc;
+    int reads = 0;
+
+    if (is_stderr) {
+        output = &op->opaque->stderr_output;
     }
 
-    do {
-        rc = read(fd, buf, buf_read_len);
+    while (reads < max_reads) {
+        rc = read(fd, buf, sizeof(buf));
         if (rc > 0) {
-            buf[rc] = 0;
-            data = realloc(data, len + rc + 1);
-            sprintf(data + len, "%s", buf);
-            len += rc;
+            if (op->opaque->output_fn) {
+                services_output_stream(op, is_stderr, buf, rc);
+            } else {
+                services_output_append(output, buf, rc);
+            }
+            reads++;
+
+        } else if (rc < 0 && errno == EINTR) {
+            continue;
+
+        } else if (rc < 0 && errno == EAGAIN) {
+            return TRUE;
 
-        } else if (errno != EINTR) {
+        } else {
             /* error or EOF
              * Cleanup happens in pipe_done()
              */
-            rc = FALSE;
-            break;
+            return FALSE;
         }
+    }
 
-    } while (rc == buf_read_len || rc < 0);
+    return TRUE;
+}
 
-    if (data != NULL && is_err) {
-        op->stderr_data = data;
-    } else if (data != NULL) {
-        op->stdout_data = data;
-    }
+static gboolean
+read_output(int fd, gpointer user_data)
+{
+    svc_action_t* op = (svc_action_t *) user_data;
 
-    return rc;
+    mh_trace("%p", op);
+
+    /* Give other sources a turn if the child keeps writing */
+    return read_pipe(op, fd, 16);
 }
 
 static void
@@ -123,49 +133,228 @@ pipe_err_done(gpointer user_data)
 }
 
 static void
-set_ocf_env(gpointer key, gpointer value, gpointer user_data)
+add_ocf_env(GPtrArray *env, const char *name, const char *value)
 {
-    if (setenv(key, value, 1) != 0) {
-        mh_err("setenv failed in raexecocf.");
-    }
+    g_ptr_array_add(env, g_strdup_printf("%s=%s", name, value));
 }
 
 static void
-set_ocf_env_with_prefix(gpointer key, gpointer value, gpointer user_data)
+add_ocf_param(gpointer key, gpointer value, gpointer user_data)
 {
-    /* TODO: Add OCF_RESKEY_ prefix to 'key' */
     char buffer[500];
     snprintf(buffer, sizeof(buffer), "OCF_RESKEY_%s", (char *) key);
-    set_ocf_env(buffer, value, user_data);
+    add_ocf_env(user_data, buffer, value);
 }
 
-static void
-add_OCF_env_vars(svc_action_t *op)
+/*
+ * Environment of an OCF action: the OCF variables, followed by the agent's
+ * own environment without any variables of the same name.  It is built
+ * before spawning, so that the child has nothing left to do but exec.
+ *
+ * Returns NULL if the action simply inherits the agent's environment, or a
+ * vector to free with g_strfreev().
+ */
+static char **
+action_envp(svc_action_t *op)
 {
+    GPtrArray *env;
+    unsigned int nocf, lpc;
+    char **var;
+    size_t len;
+
     if (!op->standard || strcasecmp("ocf", op->standard) != 0) {
-        return;
+        return NULL;
     }
 
+    env = g_ptr_array_new();
     if (op->params) {
-        g_hash_table_foreach(op->params, set_ocf_env_with_prefix, NULL);
+        g_hash_table_foreach(op->params, add_ocf_param, env);
     }
 
-    set_ocf_env("OCF_RA_VERSION_MAJOR", "1", NULL);
-    set_ocf_env("OCF_RA_VERSION_MINOR", "0", NULL);
-    set_ocf_env("OCF_ROOT", OCF_ROOT, NULL);
+    add_ocf_env(env, "OCF_RA_VERSION_MAJOR", "1");
+    add_ocf_env(env, "OCF_RA_VERSION_MINOR", "0");
+    add_ocf_env(env, "OCF_ROOT", OCF_ROOT);
 
     if (op->rsc) {
-        set_ocf_env("OCF_RESOURCE_INSTANCE", op->rsc, NULL);
+        add_ocf_env(env, "OCF_RESOURCE_INSTANCE", op->rsc);
     }
 
     if (op->agent != NULL) {
-        set_ocf_env("OCF_RESOURCE_TYPE", op->agent, NULL);
+        add_ocf_env(env, "OCF_RESOURCE_TYPE", op->agent);
     }
 
     /* Notes: this is not added to specification yet. Sept 10,2004 */
     if (op->provider != NULL) {
-        set_ocf_env("OCF_RESOURCE_PROVIDER", op->provider, NULL);
+        add_ocf_env(env, "OCF_RESOURCE_PROVIDER", op->provider);
+    }
+
+    nocf = env->len;
+    for (var = environ; *var; var++) {
+        len = strcspn(*var, "=") + 1;
+        for (lpc = 0; lpc < nocf; lpc++) {
+            if (!strncmp(g_ptr_array_index(env, lpc), *var, len)) {
+                break;
+            }
+        }
+        if (lpc == nocf) {
+            g_ptr_array_add(env, g_strdup(*var));
+        }
+    }
+
+    g_ptr_array_add(env, NULL);
+    return (char **) g_ptr_array_free(env, FALSE);
+}
+
+/*
+ * Whether the kernel has close_range(2) (Linux 5.9), checked once.
+ */
+static gboolean
+have_close_range(void)
+{
+    static int supported = -1;
+
+    if (supported < 0) {
+#ifdef SYS_close_range
+        /* An empty range past any open fd only checks for the syscall */
+        supported = syscall(SYS_close_range, ~0U, ~0U, 0) == 0;
+#else
+        supported = FALSE;
+#endif
+    }
+
+    return supported;
+}
+
+/*
+ * Highest open fd of the agent, for closing them one by one when the
+ * kernel lacks close_range().  Only the fds actually open are listed, so
+ * this does not depend on RLIMIT_NOFILE, which may be over a million.
+ */
+static int
+highest_open_fd(void)
+{
+    struct dirent *entry;
+    int fd, highest = STDERR_FILENO;
+    DIR *dir = opendir("/proc/self/fd");
+
+    if (!dir) {
+        return getdtablesize() - 1;
+    }
+
+    while ((entry = readdir(dir))) {
+        fd = atoi(entry->d_name);
+        if (fd > highest) {
+            highest = fd;
+        }
+    }
+
+    closedir(dir);
+    return highest;
+}
+
+/*
+ * The child side of services_os_action_execute(), run between vfork() and
+ * exec.  It shares the memory of the agent, so it must not allocate, log
+ * or return.
+ */
+static void
+action_child(svc_action_t *op, int stdout_fd, int stderr_fd, char **envp,
+             int highest_fd, const sigset_t *mask)
+{
+    struct sigaction sa;
+    int rc, lpc;
+
+    /* Man: The call setpgrp() is equivalent to setpgid(0,0)
+     * _and_ compiles on BSD variants too
+     * need to investigate if it works the same too.
+     */
+    setpgid(0, 0);
+
+    /*
+     * The agent's handlers must not run in here, and the RA gets default
+     * dispositions and the agent's signal mask, as with fork() and exec
+     */
+    for (lpc = 1; lpc < NSIG; lpc++) {
+        if (sigaction(lpc, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN
+            && sa.sa_handler != SIG_DFL) {
+            sa.sa_handler = SIG_DFL;
+            sigaction(lpc, &sa, NULL);
+        }
     }
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    /* dup2() clears close-on-exec, unless the fd is already in place */
+    if ((stdout_fd == STDOUT_FILENO ? fcntl(stdout_fd, F_SETFD, 0)
+         : dup2(stdout_fd, STDOUT_FILENO)) < 0
+        || (stderr_fd == STDERR_FILENO ? fcntl(stderr_fd, F_SETFD, 0)
+            : dup2(stderr_fd, STDERR_FILENO)) < 0) {
+        _exit(OCF_UNKNOWN_ERROR);
+    }
+
+    /* close all descriptors except stdin/out/err */
+#ifdef SYS_close_range
+    if (highest_fd < 0) {
+        syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+    }
+#endif
+    for (lpc = highest_fd; lpc > STDERR_FILENO; lpc--) {
+        close(lpc);
+    }
+
+    /* execute the RA */
+    if (envp) {
+        execvpe(op->opaque->exec, op->opaque->args, envp);
+    } else {
+        execvp(op->opaque->exec, op->opaque->args);
+    }
+
+    switch (errno) { /* see execve(2) */
+    case ENOENT:  /* No such file or directory */
+    case EISDIR:   /* Is a directory */
+        rc = OCF_NOT_INSTALLED;
+        break;
+    case EACCES:   /* permission denied (various errors) */
+        rc = OCF_INSUFFICIENT_PRIV;
+        break;
+    default:
+        rc = OCF_UNKNOWN_ERROR;
+        break;
+    }
+    _exit(rc);
+}
+
+/*
+ * Read whatever is left in the pipes of a child that exited, stop watching
+ * them, and hand the output over to the action.
+ */
+static void
+finish_output(svc_action_t *op)
+{
+    /* Limited, in case a child that is still around keeps writing */
+    if (op->opaque->stdout_fd >= 0) {
+        read_pipe(op, op->opaque->stdout_fd, 256);
+    }
+    if (op->opaque->stderr_fd >= 0) {
+        read_pipe(op, op->opaque->stderr_fd, 256);
+    }
+
+    if (op->opaque->stdout_gsource) {
+        mainloop_destroy_fd(op->opaque->stdout_gsource);
+        op->opaque->stdout_gsource = NULL;
+    }
+    if (op->opaque->stderr_gsource) {
+        mainloop_destroy_fd(op->opaque->stderr_gsource);
+        op->opaque->stderr_gsource = NULL;
+    }
+
+    services_output_stream_flush(op);
+
+    free(op->stdout_data);
+    op->stdout_data = services_output_finish(&op->opaque->stdout_output,
+                                             &op->stdout_len);
+    free(op->stderr_data);
+    op->stderr_data = services_output_finish(&op->opaque->stderr_output,
+                                             &op->stderr_len);
 }
 
 static gboolean recurring_action_timer(gpointer data)
@@ -174,8 +363,8 @@ static gboolean recurring_action_timer(gpointer data)
     mh_debug("Scheduling another invokation of %s", op->id);
 
     /* Clean out the old result */
-    free(op->stdout_data); op->stdout_data = NULL;
-    free(op->stderr_data); op->stderr_data = NULL;
+    free(op->stdout_data); op->stdout_data = NULL; op->stdout_len = 0;
+    free(op->stderr_data); op->stderr_data = NULL; op->stderr_len = 0;
 
     services_action_async(op, NULL);
     return FALSE;
@@ -193,6 +382,8 @@ operation_finished(mainloop_child_t *p, int status, int signo, int exitcode)
     op->status = LRM_OP_DONE;
     MH_ASSERT(op->pid == p->pid);
 
+    finish_output(op);
+
     if (signo) {
         if (p->timeout) {
             mh_warn("%s:%d - timed out after %dms", op->id, op->pid,
@@ -249,6 +440,9 @@ operation_finished(mainloop_child_t *p, int status, int signo, int exitcode)
 
     op->pid = 0;
 
+    /* Let a queued action have the slot, even if the callback queues more */
+    services_action_finished(op);
+
     if (op->opaque->callback) {
         op->opaque->callback(op);
     }
@@ -265,73 +459,52 @@ operation_finished(mainloop_child_t *p, int status, int signo, int exitcode)
 gboolean
 services_os_action_execute(svc_action_t* op, gboolean synchronous)
 {
-    int rc, lpc;
     int stdout_fd[2];
     int stderr_fd[2];
-
-    if (pipe(stdout_fd) < 0) {
+    int highest_fd = -1;
+    sigset_t all, mask;
+    char **envp;
+
+    /*
+     * The read ends must not leak into the child, nor any pipe into the
+     * children of other actions started meanwhile
+     */
+    if (pipe2(stdout_fd, O_CLOEXEC) < 0) {
         mh_perror(LOG_ERR, "pipe() failed");
     }
 
-    if (pipe(stderr_fd) < 0) {
+    if (pipe2(stderr_fd, O_CLOEXEC) < 0) {
         mh_perror(LOG_ERR, "pipe() failed");
     }
 
-    op->pid = fork();
-    switch (op->pid) {
-    case -1:
-        mh_perror(LOG_ERR, "fork() failed");
+    envp = action_envp(op);
+    if (!have_close_range()) {
+        highest_fd = highest_open_fd();
+    }
+
+    /*
+     * vfork() rather than fork(): the agent is not copied, and resumes as
+     * soon as the child has exec'ed, in microseconds.  Signals are blocked
+     * until the child has reset their handlers.
+     */
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &mask);
+
+    op->pid = vfork();
+    if (op->pid == 0) {
+        action_child(op, stdout_fd[1], stderr_fd[1], envp, highest_fd, &mask);
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    g_strfreev(envp);
+
+    if (op->pid < 0) {
+        mh_perror(LOG_ERR, "vfork() failed");
         close(stdout_fd[0]);
         close(stdout_fd[1]);
         close(stderr_fd[0]);
         close(stderr_fd[1]);
         return FALSE;
-
-    case 0:                /* Child */
-        /* Man: The call setpgrp() is equivalent to setpgid(0,0)
-         * _and_ compiles on BSD variants too
-         * need to investigate if it works the same too.
-         */
-        setpgid(0, 0);
-        close(stdout_fd[0]);
-        close(stderr_fd[0]);
-        if (STDOUT_FILENO != stdout_fd[1]) {
-            if (dup2(stdout_fd[1], STDOUT_FILENO) != STDOUT_FILENO) {
-                mh_perror(LOG_ERR, "dup2() failed (stdout)");
-            }
-            close(stdout_fd[1]);
-        }
-        if (STDERR_FILENO != stderr_fd[1]) {
-            if (dup2(stderr_fd[1], STDERR_FILENO) != STDERR_FILENO) {
-                mh_perror(LOG_ERR, "dup2() failed (stderr)");
-            }
-            close(stderr_fd[1]);
-        }
-
-        /* close all descriptors except stdin/out/err and channels to logd */
-        for (lpc = getdtablesize() - 1; lpc > STDERR_FILENO; lpc--) {
-            close(lpc);
-        }
-
-        /* Setup environment correctly */
-        add_OCF_env_vars(op);
-
-        /* execute the RA */
-        execvp(op->opaque->exec, op->opaque->args);
-
-        switch (errno) { /* see execve(2) */
-        case ENOENT:  /* No such file or directory */
-        case EISDIR:   /* Is a directory */
-            rc = OCF_NOT_INSTALLED;
-            break;
-        case EACCES:   /* permission denied (various errors) */
-            rc = OCF_INSUFFICIENT_PRIV;
-            break;
-        default:
-            rc = OCF_UNKNOWN_ERROR;
-            break;
-        }
-        _exit(rc);
     }
 
     /* Only the parent reaches here */
@@ -365,6 +538,11 @@ services_os_action_execute(svc_action_t* op, gboolean synchronous)
                 mh_err("kill(%d, KILL) failed: %d", op->pid, killrc);
             }
 
+            /* Nobody else reaps it, see child_death_dispatch() */
+            if (waitpid(op->pid, &status, 0) < 0) {
+                mh_perror(LOG_ERR, "waitpid(%d) failed", op->pid);
+            }
+
         } else if (WIFEXITED(status)) {
             op->status = LRM_OP_DONE;
             op->rc = WEXITSTATUS(status);
@@ -383,8 +561,9 @@ services_os_action_execute(svc_action_t* op, gboolean synchronous)
         }
 #endif
 
-        read_output(op->opaque->stdout_fd, op);
-        read_output(op->opaque->stderr_fd, op);
+        finish_output(op);
+        pipe_out_done(op);
+        pipe_err_done(op);
 
     } else {
         mh_trace("Async waiting for %d - %s", op->pid, op->opaque->exec);
@@ -19,6 +19,29 @@
 #ifndef __MH_SERVICES_PRIVATE_H__
 #define __MH_SERVICES_PRIVATE_H__
 
+/**
+ * Output of a child process.  Once more than max bytes were read, only the
+ * first half of them and the last bytes (in a ring buffer) are kept.
+ */
+struct svc_output {
+    char    *head;
+    size_t   head_len;
+    size_t   head_size;
+    char    *tail;
+    size_t   tail_len;
+    size_t   tail_pos;
+    size_t   max;
+    /** Bytes read in all */
+    uint64_t total;
+};
+
+/** Streams of an action's output, see output_pending */
+enum svc_stream {
+    SVC_STREAM_STDOUT,
+    SVC_STREAM_STDERR,
+    SVC_STREAMS
+};
+
 struct svc_action_private_s {
     char *exec;
     char *args[7];
@@ -31,14 +54,79 @@ struct svc_action_private_s {
 
     int            stdout_fd;
     mainloop_fd_t *stdout_gsource;
+
+    struct svc_output stderr_output;
+    struct svc_output stdout_output;
+
+    /** See services_action_stream_output() */
+    svc_output_fn  output_fn;
+    unsigned int   output_interval;
+    unsigned int   output_max_lines;
+    guint          output_timer;
+    /** Output not passed yet, and its number of complete lines */
+    GString       *output_pending[SVC_STREAMS];
+    unsigned int   output_lines[SVC_STREAMS];
+
+    /** Whether the action waits in, or was started by, the scheduler */
+    gboolean queued;
+    gboolean running;
+    /** When services_action_async() was called, in monotonic us */
+    gint64   queued_at;
+    /** Position among the queued actions */
+    guint64  queue_order;
 };
 
+/**
+ * Add bytes read from a child to its output.
+ */
+void
+services_output_append(struct svc_output *output, const char *data,
+                       size_t len);
+
+/**
+ * Take the output of a child, marking where bytes were left out, and empty
+ * the buffer.
+ *
+ * \param[in]  output the output
+ * \param[out] len the length of the output, which may contain NULs
+ *
+ * \return the output, NUL terminated, or NULL if there was none
+ */
+char *
+services_output_finish(struct svc_output *output, size_t *len);
+
+/**
+ * Pass the output of a child to the action's output callback, batched.
+ */
+void
+services_output_stream(svc_action_t *op, gboolean is_stderr,
+                       const char *data, size_t len);
+
+/**
+ * Pass whatever output of a child is pending, including incomplete lines.
+ */
+void
+services_output_stream_flush(svc_action_t *op);
+
+/**
+ * Empty the buffer, throwing the output away.
+ */
+void
+services_output_clear(struct svc_output *output);
+
 GList *
 services_os_get_directory_list(const char *root, gboolean files);
 
 gboolean
 services_os_action_execute(svc_action_t *op, gboolean synchronous);
 
+/**
+ * Tell the scheduler an asynchronous action has completed, so that queued
+ * actions may start.  Called before the action's callback.
+ */
+void
+services_action_finished(svc_action_t *op);
+
 void
 services_os_set_exec(svc_action_t *op);
 
@@ -98,7 +98,7 @@ read_output(HANDLE h, char **output, int *length)
 
         data = realloc(data, len + (int) bytes + 1);
         mh_info("Read %d: %.*s", len, (int) bytes, buf);
-        sprintf(data + len, "%s", buf);
+        memcpy(data + len, buf, bytes);
         data[len + bytes] = 0;
         len += (int)bytes;
     }
@@ -286,6 +286,7 @@ services_os_action_execute(svc_action_t *op, gboolean synchronous)
     }
 
     read_output(child_pipe_rd, &op->stdout_data, &max);
+    op->stdout_len = max;
     if (op->stdout_data) {
         mh_debug("RAW: %s", op->stdout_data);
     }
@@ -503,6 +503,17 @@ g_list_free_full (GList *list, GDestroyNotify free_func)
 }
 #endif /* HAVE_G_LIST_FREE_FULL */
 
+#ifndef HAVE_G_GET_MONOTONIC_TIME
+gint64
+g_get_monotonic_time(void)
+{
+    GTimeVal now;
+
+    g_get_current_time(&now);
+    return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+#endif /* HAVE_G_GET_MONOTONIC_TIME */
+
 char *
 mh_string_copy(char *dst, const char *src, size_t dst_len)
 {
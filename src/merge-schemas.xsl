@@ -0,0 +1,39 @@
+<?xml version="1.0" encoding="ISO-8859-1"?>
+<xsl:stylesheet version="1.0"
+                xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+
+<xsl:output method="xml" indent="yes" />
+
+<!--
+This XSL transformation merges several QMF schemas of the same package into
+a single one, so that their classes can be served by one agent.
+
+The input is a list of the schemas to merge:
+
+    <schemas>
+        <file href="/path/to/host/schema.xml"/>
+        <file href="/path/to/network/schema.xml"/>
+    </schemas>
+
+Event arguments shared by several schemas are only written once.
+-->
+
+<xsl:variable name="schemas" select="document(/schemas/file/@href)/schema"/>
+
+<xsl:template match="/">
+    <schema package="{$schemas[1]/@package}">
+        <eventArguments>
+            <xsl:for-each select="$schemas/eventArguments/arg">
+                <xsl:variable name="name" select="@name"/>
+                <xsl:if test="generate-id(.) = generate-id(($schemas/eventArguments/arg[@name = $name])[1])">
+                    <xsl:copy-of select="."/>
+                </xsl:if>
+            </xsl:for-each>
+        </eventArguments>
+
+        <xsl:copy-of select="$schemas/event"/>
+        <xsl:copy-of select="$schemas/class"/>
+    </schema>
+</xsl:template>
+
+</xsl:stylesheet>
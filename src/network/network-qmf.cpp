@@ -43,6 +43,7 @@ private:
     static const char NETWORK_NAME[];
 
 public:
+    virtual void registerSchemas(qmf::AgentSession session);
     virtual int setup(qmf::AgentSession session);
     virtual gboolean invoke(qmf::AgentSession session, qmf::AgentEvent event,
                             gpointer user_data);
@@ -50,6 +51,13 @@ public:
 
 const char NetAgent::NETWORK_NAME[] = "Network";
 
+#ifdef MH_NODE_AGENT
+MatahariAgent *
+mh_node_network_agent(void)
+{
+    return new NetAgent();
+}
+#else
 int
 main(int argc, char **argv)
 {
@@ -60,6 +68,7 @@ main(int argc, char **argv)
     }
     return rc;
 }
+#endif
 
 static int
 interface_status(const char *iface)
@@ -79,16 +88,21 @@ interface_status(const char *iface)
     return 1; /* Inactive */
 }
 
+void
+NetAgent::registerSchemas(qmf::AgentSession session)
+{
+    _package.configure(session);
+}
+
 int
 NetAgent::setup(qmf::AgentSession session)
 {
-    _package.configure(session);
     _instance = qmf::Data(_package.data_Network);
 
     _instance.setProperty("hostname", mh_hostname());
     _instance.setProperty("uuid", mh_uuid());
 
-    session.addData(_instance, NETWORK_NAME);
+    addData(_instance, NETWORK_NAME);
     return 0;
 }
 
@@ -0,0 +1,171 @@
+/* node-qmf.cpp - Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * \file
+ * \brief Node QMF Agent
+ *
+ * Serves the Host, Network, Services, Resources and Sysconfig classes from a
+ * single process, over a single broker connection and QMF session.  The
+ * agents themselves are the same ones used by the standalone daemons, built
+ * with MH_NODE_AGENT defined.
+ */
+
+#include "config.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include "matahari/agent.h"
+
+extern "C" {
+#include "matahari/logging.h"
+#include "matahari/errors.h"
+#include "matahari/utilities.h"
+}
+
+/* Provided by the individual agents when built with MH_NODE_AGENT */
+MatahariAgent *mh_node_host_agent(void);
+MatahariAgent *mh_node_network_agent(void);
+MatahariAgent *mh_node_service_agent(void);
+MatahariAgent *mh_node_sysconfig_agent(void);
+
+/* The hosted agents, and the names of the data objects each of them serves */
+static const struct {
+    MatahariAgent *(*create)(void);
+    const char *names[3];
+} hosted_agents[] = {
+    { mh_node_host_agent,      { "Host", NULL } },
+    { mh_node_network_agent,   { "Network", NULL } },
+    { mh_node_service_agent,   { "Services", "Resources", NULL } },
+    { mh_node_sysconfig_agent, { "Sysconfig", NULL } },
+};
+
+class NodeAgent : public MatahariAgent
+{
+public:
+    virtual ~NodeAgent();
+
+    virtual void registerOptions(qpid::types::Variant::Map &options);
+    virtual int setup(qmf::AgentSession session);
+    virtual gboolean invoke(qmf::AgentSession session, qmf::AgentEvent event,
+                            gpointer user_data);
+
+private:
+    /**
+     * Set up a hosted agent on our session.
+     *
+     * \param[in] agent the agent to host
+     * \param[in] names names of the data objects the agent adds, terminated
+     *            by NULL
+     *
+     * \return the result of the agent's setup()
+     */
+    int host(MatahariAgent *agent, const char * const names[]);
+
+    /** Hosted agents, indexed by the name of the data objects they serve */
+    std::map<std::string, MatahariAgent *> _routes;
+    std::vector<MatahariAgent *> _agents;
+};
+
+int
+main(int argc, char **argv)
+{
+    NodeAgent agent;
+    int rc = agent.init(argc, argv, "node");
+    if (rc == 0) {
+        mainloop_track_children(G_PRIORITY_DEFAULT);
+        agent.run();
+    }
+    return rc;
+}
+
+NodeAgent::~NodeAgent()
+{
+    std::vector<MatahariAgent *>::iterator iter;
+
+    for (iter = _agents.begin(); iter != _agents.end(); iter++) {
+        delete *iter;
+    }
+}
+
+int
+NodeAgent::host(MatahariAgent *agent, const char * const names[])
+{
+    int lpc = 0;
+
+    for (lpc = 0; names[lpc] != NULL; lpc++) {
+        mh_trace("Routing %s to agent %p", names[lpc], agent);
+        _routes[names[lpc]] = agent;
+    }
+
+    return agent->attach(this);
+}
+
+void
+NodeAgent::registerOptions(qpid::types::Variant::Map &options)
+{
+    /* Created before setup() so that their options are parsed as well */
+    for (int lpc = 0; lpc < DIMOF(hosted_agents); lpc++) {
+        MatahariAgent *agent = hosted_agents[lpc].create();
+
+        _agents.push_back(agent);
+        agent->registerOptions(options);
+    }
+}
+
+int
+NodeAgent::setup(qmf::AgentSession session)
+{
+    for (size_t lpc = 0; lpc < _agents.size(); lpc++) {
+        if (host(_agents[lpc], hosted_agents[lpc].names) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+gboolean
+NodeAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event,
+                  gpointer user_data)
+{
+    std::map<std::string, MatahariAgent *>::iterator route;
+
+    if (event.getType() != qmf::AGENT_METHOD) {
+        return TRUE;
+    }
+
+    /* Only calls on one of the hosted objects can be routed */
+    if (!event.hasDataAddr()) {
+        mh_warn("No object address, cannot call %s",
+                event.getMethodName().c_str());
+        session.raiseException(event, mh_result_to_str(MH_RES_INVALID_ARGS));
+        return TRUE;
+    }
+
+    route = _routes.find(event.getDataAddr().getName());
+    if (route == _routes.end()) {
+        mh_warn("No agent serving '%s', cannot call %s",
+                event.getDataAddr().getName().c_str(),
+                event.getMethodName().c_str());
+        session.raiseException(event, mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+        return TRUE;
+    }
+
+    return route->second->invoke(session, event, user_data);
+}
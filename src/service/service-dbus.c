@@ -363,6 +363,7 @@ Resources_invoke(Matahari *matahari, const char *name, const char *standard,
                  const char *provider, const char *agent, const char *action,
                  unsigned int interval, GHashTable *parameters,
                  unsigned int timeout, unsigned int expected_rc,
+                 unsigned int output_interval, unsigned int output_lines,
                  const char *userdata_in, DBusGMethodInvocation *context)
 {
     GError* error = NULL;
@@ -408,6 +409,26 @@ Resources_invoke(Matahari *matahari, const char *name, const char *standard,
     return FALSE;
 }
 
+gboolean
+Resources_invoke_batch(Matahari *matahari, char **actions,
+                       gboolean stop_on_failure, gboolean events,
+                       const char *userdata_in, DBusGMethodInvocation *context)
+{
+    GError* error = NULL;
+    if (!check_authorization(RESOURCES_INTERFACE_NAME ".invoke_batch",
+                             &error, context)) {
+        dbus_g_method_return_error(context, error);
+        g_error_free(error);
+        return FALSE;
+    }
+    // Lists are passed as lists of strings, which cannot describe actions
+    error = g_error_new(MATAHARI_ERROR, MH_RES_NOT_IMPLEMENTED,
+                        "%s", mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+    return TRUE;
+}
+
 gboolean
 Resources_cancel(Matahari *matahari, const char *name, const char *action,
                  unsigned int interval, unsigned int timeout,
@@ -459,10 +480,21 @@ matahari_set_property(GObject *object, guint property_id, const GValue *value,
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 }
 
+static void
+queue_stat_add(Dict *dict, GValue *value, const char *name, uint64_t stat)
+{
+    g_value_set_uint64(value, stat);
+    dict_add(dict, name, value);
+}
+
 void
 matahari_get_property(GObject *object, guint property_id, GValue *value,
                       GParamSpec *pspec)
 {
+    struct svc_queue_stats stats;
+    GValue value_value = {0, };
+    Dict *dict;
+
     switch (property_id) {
     case PROP_SERVICES_HOSTNAME:
     case PROP_RESOURCES_HOSTNAME:
@@ -472,6 +504,20 @@ matahari_get_property(GObject *object, guint property_id, GValue *value,
     case PROP_RESOURCES_UUID:
         g_value_set_string (value, mh_uuid());
         break;
+    case PROP_RESOURCES_ACTION_QUEUE:
+        services_get_queue_stats(&stats);
+        dict = dict_new(value);
+        g_value_init(&value_value, G_TYPE_UINT64);
+        queue_stat_add(dict, &value_value, "running", stats.running);
+        queue_stat_add(dict, &value_value, "max_running", stats.max_running);
+        queue_stat_add(dict, &value_value, "queued", stats.queued);
+        queue_stat_add(dict, &value_value, "max_queued", stats.max_queued);
+        queue_stat_add(dict, &value_value, "started", stats.started);
+        queue_stat_add(dict, &value_value, "delayed", stats.delayed);
+        queue_stat_add(dict, &value_value, "wait_total", stats.wait_total);
+        queue_stat_add(dict, &value_value, "wait_max", stats.wait_max);
+        dict_free(dict);
+        break;
     default:
         /* We don't have any other property... */
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -482,9 +528,15 @@ matahari_get_property(GObject *object, guint property_id, GValue *value,
 GType
 matahari_dict_type(int prop)
 {
-    g_printerr("Type of property %s is map of unknown types\n",
-               properties[prop].name);
-    return G_TYPE_VALUE;
+    switch (prop) {
+    case PROP_RESOURCES_ACTION_QUEUE:
+        return G_TYPE_UINT64;
+        break;
+    default:
+        g_printerr("Type of property %s is map of unknown types\n",
+                   properties[prop].name);
+        return G_TYPE_VALUE;
+    }
 }
 
 int
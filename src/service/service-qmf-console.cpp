@@ -123,7 +123,8 @@ int main(int argc, char** argv)
     filter << "[and";
 
     filter << ", [eq, _vendor, [quote, 'matahariproject.org']]";
-    filter << ", [eq, _product, [quote, 'service']]";
+    filter << ", [or, [eq, _product, [quote, 'service']]"
+           << ", [eq, _product, [quote, 'node']]]";
     if (options.count("action") && core_options.count("host-uuid")) {
         filter << ", [eq, hostname, [quote, " << core_options["host-uuid"] << "]]";
 
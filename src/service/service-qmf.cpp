@@ -24,6 +24,7 @@ extern "C" {
 };
 
 #include <string>
+#include <vector>
 #include <qpid/management/Manageable.h>
 #include <qpid/agent/ManagementAgent.h>
 #include "matahari/agent.h"
@@ -63,10 +64,16 @@ private:
     qmf::org::matahariproject::PackageDefinition _package;
 
 public:
+    virtual void registerSchemas(qmf::AgentSession session);
+    virtual void registerOptions(qpid::types::Variant::Map &options);
     virtual int setup(qmf::AgentSession session);
     virtual gboolean invoke(qmf::AgentSession session,
                             qmf::AgentEvent event, gpointer user_data);
     void raiseEvent(svc_action_t *op, enum service_id service, const std::string &userdata);
+    void raiseOutputEvent(svc_action_t *op, gboolean is_stderr,
+                          const std::string &output, uint32_t chunk,
+                          const std::string &userdata);
+    void publishActionQueue(void);
 };
 
 const char SrvAgent::SERVICES_NAME[] = "Services";
@@ -85,10 +92,12 @@ public:
             qmf::AgentSession& _session, qmf::AgentEvent& _event,
             bool _has_rc) :
             agent(_agent), service(_service), session(_session), event(_event),
-            has_rc(_has_rc), last_rc(0), first_result(true) {};
+            has_rc(_has_rc), last_rc(0), first_result(true), chunk(0) {};
     ~AsyncCB() {};
 
     static void mh_async_callback(svc_action_t *op);
+    static void mh_output_callback(svc_action_t *op, gboolean is_stderr,
+                                   const char *data, size_t len);
 
     /** Cached SrvAgent instance */
     SrvAgent *agent;
@@ -105,6 +114,8 @@ public:
     int last_rc;
     /** true if this is the first callback. */
     bool first_result;
+    /** Number of resource_output events raised */
+    uint32_t chunk;
 };
 
 void
@@ -115,6 +126,8 @@ AsyncCB::mh_async_callback(svc_action_t *op)
 
     mh_trace("Completed: %s = %d", op->id, op->rc);
 
+    cb_data->agent->publishActionQueue();
+
     qpid::types::Variant::Map& args = cb_data->event.getArguments();
     if (args.count("userdata") > 0) {
         userdata = args["userdata"].asString();
@@ -144,6 +157,189 @@ AsyncCB::mh_async_callback(svc_action_t *op)
     }
 }
 
+void
+AsyncCB::mh_output_callback(svc_action_t *op, gboolean is_stderr,
+                            const char *data, size_t len)
+{
+    std::string userdata;
+    AsyncCB *cb_data = static_cast<AsyncCB *>(op->cb_data);
+
+    qpid::types::Variant::Map& args = cb_data->event.getArguments();
+    if (args.count("userdata") > 0) {
+        userdata = args["userdata"].asString();
+    }
+
+    cb_data->agent->raiseOutputEvent(op, is_stderr, std::string(data, len),
+                                     cb_data->chunk++, userdata);
+}
+
+/**
+ * Batch process callback
+ *
+ * The state of a Resources.invoke_batch call, which returns once every
+ * action of the batch has completed or was skipped.
+ */
+class BatchCB {
+public:
+    BatchCB(SrvAgent *_agent, qmf::AgentSession& _session,
+            qmf::AgentEvent& _event, const std::vector<svc_action_t *>& _ops,
+            bool _stop_on_failure, bool _events);
+    ~BatchCB() {};
+
+    static void mh_batch_callback(svc_action_t *op);
+
+    /** Start the actions: all of them, or the first if stop_on_failure */
+    void start(void);
+
+private:
+    /** What the cb_data of each action points to */
+    struct Item {
+        BatchCB *batch;
+        size_t index;
+    };
+
+    void submit(size_t index);
+    void completed(size_t index, svc_action_t *op, bool started);
+
+    /** Cached SrvAgent instance */
+    SrvAgent *agent;
+    /** The QMF session that initiated the batch */
+    qmf::AgentSession session;
+    /** The method call that initiated the batch */
+    qmf::AgentEvent event;
+    std::string userdata;
+    /** Run the actions in order, skipping the rest after a failure */
+    bool stop_on_failure;
+    /** Raise resource_op for each completed action */
+    bool events;
+
+    std::vector<svc_action_t *> ops;
+    std::vector<Item> items;
+    std::vector<_qtype::Variant::Map> results;
+    /** Next action to start if stop_on_failure */
+    size_t next;
+    /** Actions neither completed nor skipped yet */
+    size_t remaining;
+    uint32_t failures;
+};
+
+BatchCB::BatchCB(SrvAgent *_agent, qmf::AgentSession& _session,
+                 qmf::AgentEvent& _event,
+                 const std::vector<svc_action_t *>& _ops,
+                 bool _stop_on_failure, bool _events) :
+        agent(_agent), session(_session), event(_event),
+        stop_on_failure(_stop_on_failure), events(_events), ops(_ops),
+        items(_ops.size()), results(_ops.size()), next(0),
+        remaining(_ops.size()), failures(0)
+{
+    qpid::types::Variant::Map& args = event.getArguments();
+    if (args.count("userdata") > 0) {
+        userdata = args["userdata"].asString();
+    }
+
+    for (size_t lpc = 0; lpc < ops.size(); lpc++) {
+        items[lpc].batch = this;
+        items[lpc].index = lpc;
+        ops[lpc]->cb_data = &items[lpc];
+    }
+}
+
+void
+BatchCB::start(void)
+{
+    size_t count = ops.size();
+
+    if (stop_on_failure) {
+        submit(next++);
+        return;
+    }
+
+    /* The batch is deleted once the last action completes, do not touch it */
+    for (size_t lpc = 0; lpc < count; lpc++) {
+        submit(lpc);
+    }
+}
+
+void
+BatchCB::submit(size_t index)
+{
+    svc_action_t *op = ops[index];
+
+    if (!services_action_async(op, mh_batch_callback)) {
+        op->status = LRM_OP_ERROR;
+        op->rc = OCF_UNKNOWN_ERROR;
+        completed(index, op, false);
+    }
+}
+
+void
+BatchCB::mh_batch_callback(svc_action_t *op)
+{
+    Item *item = static_cast<Item *>(op->cb_data);
+
+    mh_trace("Completed: %s = %d", op->id, op->rc);
+
+    op->cb_data = NULL;
+    item->batch->completed(item->index, op, true);
+}
+
+void
+BatchCB::completed(size_t index, svc_action_t *op, bool started)
+{
+    _qtype::Variant::Map& result = results[index];
+    bool failed = op->status != LRM_OP_DONE || op->rc != op->expected_rc;
+
+    result["name"] = op->rsc;
+    result["action"] = op->action;
+    result["sequence"] = op->sequence;
+    result["status"] = op->status;
+    result["rc"] = op->rc;
+
+    if (events && started) {
+        agent->raiseEvent(op, SRV_RESOURCES, userdata);
+    }
+    if (!started) {
+        services_action_free(op);
+    }
+    ops[index] = NULL;
+    remaining--;
+
+    if (failed) {
+        failures++;
+    }
+
+    if (stop_on_failure && failed) {
+        for (; next < ops.size(); next++) {
+            results[next]["name"] = ops[next]->rsc;
+            results[next]["action"] = ops[next]->action;
+            results[next]["sequence"] = ops[next]->sequence;
+            results[next]["status"] = LRM_OP_CANCELLED;
+            services_action_free(ops[next]);
+            ops[next] = NULL;
+            remaining--;
+        }
+
+    } else if (stop_on_failure && next < ops.size()) {
+        submit(next++);
+        return;
+    }
+
+    if (remaining) {
+        return;
+    }
+
+    _qtype::Variant::List list(results.begin(), results.end());
+    event.addReturnArgument("results", list);
+    event.addReturnArgument("failures", failures);
+    if (userdata.length()) {
+        event.addReturnArgument("userdata", userdata);
+    }
+    session.methodSuccess(event);
+
+    agent->publishActionQueue();
+    delete this;
+}
+
 static GHashTable *
 qmf_map_to_hash(::qpid::types::Variant::Map parameters)
 {
@@ -160,6 +356,14 @@ qmf_map_to_hash(::qpid::types::Variant::Map parameters)
     return hash;
 }
 
+#ifdef MH_NODE_AGENT
+MatahariAgent *
+mh_node_service_agent(void)
+{
+    /* The node agent tracks child processes for us */
+    return new SrvAgent();
+}
+#else
 int
 main(int argc, char **argv)
 {
@@ -173,6 +377,7 @@ main(int argc, char **argv)
 
     return rc;
 }
+#endif
 
 void
 SrvAgent::raiseEvent(svc_action_t *op, enum service_id service, const std::string &userdata)
@@ -214,24 +419,73 @@ SrvAgent::raiseEvent(svc_action_t *op, enum service_id service, const std::strin
     getSession().raiseEvent(event);
 }
 
-int
-SrvAgent::setup(qmf::AgentSession session)
+void
+SrvAgent::raiseOutputEvent(svc_action_t *op, gboolean is_stderr,
+                           const std::string &output, uint32_t chunk,
+                           const std::string &userdata)
+{
+    uint64_t timestamp = 0L;
+    qmf::Data event(_package.event_resource_output);
+
+#ifdef HAVE_TIME
+    timestamp = ::time(NULL);
+#endif
+
+    event.setProperty("timestamp", timestamp);
+    event.setProperty("sequence", op->sequence);
+    event.setProperty("name", op->rsc);
+    event.setProperty("action", op->action);
+    event.setProperty("interval", op->interval);
+    event.setProperty("stream", is_stderr ? "stderr" : "stdout");
+    event.setProperty("chunk", chunk);
+    event.setProperty("output", output);
+
+    if (userdata.length()) {
+        event.setProperty("userdata", userdata);
+    }
+
+    getSession().raiseEvent(event);
+}
+
+void
+SrvAgent::registerSchemas(qmf::AgentSession session)
 {
     _package.configure(session);
+}
+
+void
+SrvAgent::registerOptions(qpid::types::Variant::Map &options)
+{
+    mh_add_map_option('A', required_argument, "max-actions", "number of resource and service actions run at once, the others wait (default: 0, twice the number of CPUs)", options);
+    mh_add_map_option('O', required_argument, "max-output",  "kb of the output of each resource and service action kept, the first and last halves of longer output (default: 128)", options);
+}
 
+int
+SrvAgent::setup(qmf::AgentSession session)
+{
     _services = qmf::Data(_package.data_Services);
 
     _services.setProperty("uuid", mh_uuid());
     _services.setProperty("hostname", mh_hostname());
 
-    session.addData(_services, SERVICES_NAME);
+    addData(_services, SERVICES_NAME);
 
     _resources = qmf::Data(_package.data_Resources);
 
     _resources.setProperty("uuid", mh_uuid());
     _resources.setProperty("hostname", mh_hostname());
 
-    session.addData(_resources, RESOURCES_NAME);
+    addData(_resources, RESOURCES_NAME);
+
+    if (getOptions().count("max-actions")) {
+        services_set_max_running(
+            atoi(getOptions()["max-actions"].asString().c_str()));
+    }
+    if (getOptions().count("max-output")) {
+        services_set_max_output(
+            1024 * atoi(getOptions()["max-output"].asString().c_str()));
+    }
+    publishActionQueue();
 
     return 0;
 }
@@ -262,6 +516,25 @@ SrvAgent::action_async(enum service_id service, qmf::AgentSession& session,
 {
     op->cb_data = new AsyncCB(this, service, session, event, has_rc);
     services_action_async(op, AsyncCB::mh_async_callback);
+    publishActionQueue();
+}
+
+void
+SrvAgent::publishActionQueue(void)
+{
+    struct svc_queue_stats stats;
+    ::qpid::types::Variant::Map queue;
+
+    services_get_queue_stats(&stats);
+    queue["running"] = stats.running;
+    queue["max_running"] = stats.max_running;
+    queue["queued"] = stats.queued;
+    queue["max_queued"] = stats.max_queued;
+    queue["started"] = stats.started;
+    queue["delayed"] = stats.delayed;
+    queue["wait_total"] = stats.wait_total;
+    queue["wait_max"] = stats.wait_max;
+    _resources.setProperty("action_queue", queue);
 }
 
 gboolean
@@ -325,6 +598,107 @@ SrvAgent::invoke_services(qmf::AgentSession session, qmf::AgentEvent event,
     return TRUE;
 }
 
+/*
+ * Listing systemd services waits for systemctl to finish, so this is handed
+ * to the worker pool.
+ */
+static enum mh_result
+list_agents(_qtype::Variant::Map &args, _qtype::Variant::Map &results,
+            void *userdata)
+{
+    GList *gIter = NULL;
+    GList *agents = NULL;
+    std::string standard("ocf");
+    std::string provider("heartbeat");
+    _qtype::Variant::List t_list;
+
+    if (args.count("standard")) {
+        standard = args["standard"].asString();
+    }
+
+    if (args.count("provider")) {
+        provider = args["provider"].asString();
+    }
+
+    agents = resources_list_agents(standard.c_str(), provider.c_str());
+    for (gIter = agents; gIter != NULL; gIter = gIter->next) {
+        t_list.push_back((const char *) gIter->data);
+    }
+    g_list_free_full(agents, free);
+
+    results["agents"] = t_list;
+    return MH_RES_SUCCESS;
+}
+
+/*
+ * Create the action described by the arguments of Resources.invoke.
+ */
+static svc_action_t *
+resource_action_create(_qtype::Variant::Map &args, enum mh_result *res)
+{
+    svc_action_t *op = NULL;
+    _qtype::Variant::Map map;
+    int32_t interval = 0;
+    int32_t timeout = 60000;
+    std::string agent;
+    std::string standard("ocf");
+    std::string provider("heartbeat");
+    GList *standards;
+    gboolean known;
+
+    if (args.count("standard")) {
+        standard = args["standard"].asString();
+    }
+    if (args.count("provider")) {
+        provider = args["provider"].asString();
+    }
+    if (args.count("agent")) {
+        agent = args["agent"].asString();
+    } else {
+        agent = args["name"].asString();
+    }
+
+    if(args.count("interval") > 0) {
+        interval = args["interval"].asInt32();
+    }
+    if(args.count("timeout") > 0) {
+        timeout = args["timeout"].asInt32();
+    }
+
+    standards = resources_list_standards();
+    known = g_list_find_custom(standards, standard.c_str(),
+                               (GCompareFunc) strcasecmp) != NULL;
+    g_list_free_full(standards, free);
+
+    if (!known) {
+        mh_err("%s is not a known resource standard", standard.c_str());
+        *res = MH_RES_NOT_IMPLEMENTED;
+        return NULL;
+    }
+
+    if(args.count("parameters") == 1) {
+        map = args["parameters"].asMap();
+    }
+
+    op = resources_action_create(
+        args["name"].asString().c_str(),
+        standard.c_str(), provider.c_str(), agent.c_str(),
+        args["action"].asString().c_str(),
+        interval, timeout, qmf_map_to_hash(map));
+
+    if (!op) {
+        *res = MH_RES_INVALID_ARGS;
+        return NULL;
+    }
+
+    if(args.count("expected-rc") == 1) {
+        op->expected_rc = args["expected-rc"].asInt32();
+    }
+
+    *res = MH_RES_SUCCESS;
+    return op;
+}
+
 gboolean
 SrvAgent::invoke_resources(qmf::AgentSession session, qmf::AgentEvent event,
                            gpointer user_data)
@@ -363,88 +737,69 @@ SrvAgent::invoke_resources(qmf::AgentSession session, qmf::AgentEvent event,
         event.addReturnArgument("providers", p_list);
 
     } else if (methodName == "list") {
-        GList *gIter = NULL;
-        GList *agents = NULL;
-        std::string standard("ocf");
-        std::string provider("heartbeat");
-        _qtype::Variant::List t_list;
+        runBlocking(session, event, list_agents, NULL);
+        return TRUE;
 
-        if (args.count("standard")) {
-            standard = args["standard"].asString();
-        }
+    } else if (methodName == "invoke") {
+        enum mh_result res;
+        svc_action_t *op = resource_action_create(args, &res);
 
-        if (args.count("provider")) {
-            provider = args["provider"].asString();
+        if (!op) {
+            session.raiseException(event, mh_result_to_str(res));
+            return TRUE;
         }
 
-        agents = resources_list_agents(standard.c_str(), provider.c_str());
-        for (gIter = agents; gIter != NULL; gIter = gIter->next) {
-            t_list.push_back((const char *) gIter->data);
+        if (args.count("output-interval") || args.count("output-lines")) {
+            services_action_stream_output(op, AsyncCB::mh_output_callback,
+                args.count("output-interval") ? args["output-interval"].asUint32() : 0,
+                args.count("output-lines") ? args["output-lines"].asUint32() : 0);
         }
-        g_list_free_full(agents, free);
 
-        event.addReturnArgument("agents", t_list);
+        action_async(SRV_RESOURCES, session, event, op, true);
+        return TRUE;
 
-    } else if (methodName == "invoke") {
-        svc_action_t *op = NULL;
+    } else if (methodName == "invoke_batch") {
+        _qtype::Variant::List actions;
         _qtype::Variant::List::iterator iter;
-        _qtype::Variant::Map map;
-
-        if(args.count("parameters") == 1) {
-            map = args["parameters"].asMap();
-        }
+        std::vector<svc_action_t *> ops;
+        enum mh_result res = MH_RES_SUCCESS;
+        svc_action_t *op;
 
-        GHashTable *params = qmf_map_to_hash(map);
-
-        int32_t interval = 0;
-        int32_t timeout = 60000;
-        std::string agent;
-        std::string standard("ocf");
-        std::string provider("heartbeat");
-
-        if (args.count("standard")) {
-            standard = args["standard"].asString();
-        }
-        if (args.count("provider")) {
-            provider = args["provider"].asString();
+        if (args.count("actions")) {
+            actions = args["actions"].asList();
         }
-        if (args.count("agent")) {
-            agent = args["agent"].asString();
-        } else {
-            agent = args["name"].asString();
-        }
-
-        if(args.count("interval") > 0) {
-            interval = args["interval"].asInt32();
-        }
-        if(args.count("timeout") > 0) {
-            timeout = args["timeout"].asInt32();
-        }
-
-        GList *standards = resources_list_standards();
-
-        if (g_list_find_custom(standards, standard.c_str(), (GCompareFunc) strcasecmp) == NULL) {
-            mh_err("%s is not a known resource standard", standard.c_str());
-            session.raiseException(event, mh_result_to_str(MH_RES_NOT_IMPLEMENTED));
+        if (actions.empty()) {
+            session.raiseException(event, mh_result_to_str(MH_RES_INVALID_ARGS));
             return TRUE;
         }
 
-        op = resources_action_create(
-            args["name"].asString().c_str(),
-            standard.c_str(), provider.c_str(), agent.c_str(),
-            args["action"].asString().c_str(),
-            interval, timeout, params);
-
-        if (!op) {
-            session.raiseException(event, mh_result_to_str(MH_RES_INVALID_ARGS));
-            return TRUE;
+        /* Nothing is started unless every action is valid */
+        for (iter = actions.begin(); iter != actions.end(); iter++) {
+            if (iter->getType() != _qtype::VAR_MAP) {
+                res = MH_RES_INVALID_ARGS;
+                break;
+            }
+            _qtype::Variant::Map action = iter->asMap();
+            action.erase("interval");
+            if (!(op = resource_action_create(action, &res))) {
+                break;
+            }
+            ops.push_back(op);
         }
 
-        if(args.count("expected-rc") == 1) {
-            op->expected_rc = args["expected-rc"].asInt32();
+        if (res != MH_RES_SUCCESS) {
+            for (size_t lpc = 0; lpc < ops.size(); lpc++) {
+                services_action_free(ops[lpc]);
+            }
+            session.raiseException(event, mh_result_to_str(res));
+            return TRUE;
         }
 
-        action_async(SRV_RESOURCES, session, event, op, true);
+        BatchCB *batch = new BatchCB(this, session, event, ops,
+            args.count("stop-on-failure") && args["stop-on-failure"].asBool(),
+            args.count("events") && args["events"].asBool());
+        batch->start();
+        publishActionQueue();
         return TRUE;
 
     } else if (methodName == "cancel") {
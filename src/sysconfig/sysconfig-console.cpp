@@ -68,8 +68,11 @@ int main(int argc, char **argv)
     connection.open();
 
     ConsoleSession session(connection, sessionOptions);
-    // Only filter connecting agents under matahariproject.org vendor and Config product
-    session.setAgentFilter("[and, [eq, _vendor, [quote, 'matahariproject.org']], [eq, _product, [quote, 'Sysconfig']]]");
+    // Only filter connecting agents under matahariproject.org vendor and Config
+    // product, or the node agent which also serves the Sysconfig class
+    session.setAgentFilter("[and, [eq, _vendor, [quote, 'matahariproject.org']], "
+                           "[or, [eq, _product, [quote, 'Sysconfig']], "
+                           "[eq, _product, [quote, 'node']]]]");
     session.open();
 
     while(session.getAgentCount() == 0) {
@@ -41,6 +41,7 @@ private:
     static const char SYSCONFIG_NAME[];
 
 public:
+    virtual void registerSchemas(qmf::AgentSession session);
     virtual int setup(qmf::AgentSession session);
     virtual gboolean invoke(qmf::AgentSession session, qmf::AgentEvent event,
                             gpointer user_data);
@@ -48,13 +49,13 @@ public:
 
 const char ConfigAgent::SYSCONFIG_NAME[] = "Sysconfig";
 
-class AsyncCB
+class ConfigAsyncCB
 {
 public:
-    AsyncCB(const std::string& _key, qmf::AgentEvent& _event,
+    ConfigAsyncCB(const std::string& _key, qmf::AgentEvent& _event,
             qmf::AgentSession& _session) :
                     key(_key), event(_event), session(_session) {}
-    ~AsyncCB() {}
+    ~ConfigAsyncCB() {}
 
     static void result_cb(void *cb_data, int res);
 
@@ -66,6 +67,14 @@ private:
     qmf::AgentSession session;
 };
 
+#ifdef MH_NODE_AGENT
+MatahariAgent *
+mh_node_sysconfig_agent(void)
+{
+    /* The node agent tracks child processes for us */
+    return new ConfigAgent();
+}
+#else
 int
 main(int argc, char **argv)
 {
@@ -77,25 +86,31 @@ main(int argc, char **argv)
     }
     return rc;
 }
+#endif
+
+void
+ConfigAgent::registerSchemas(qmf::AgentSession session)
+{
+    _package.configure(session);
+}
 
 int
 ConfigAgent::setup(qmf::AgentSession session)
 {
-    _package.configure(session);
     _instance = qmf::Data(_package.data_Sysconfig);
 
     _instance.setProperty("hostname", mh_hostname());
     _instance.setProperty("uuid", mh_uuid());
     _instance.setProperty("is_postboot_configured", 0);
 
-    session.addData(_instance, SYSCONFIG_NAME);
+    addData(_instance, SYSCONFIG_NAME);
     return 0;
 }
 
 void
-AsyncCB::result_cb(void *cb_data, int res)
+ConfigAsyncCB::result_cb(void *cb_data, int res)
 {
-    AsyncCB *action_data = static_cast<AsyncCB *>(cb_data);
+    ConfigAsyncCB *action_data = static_cast<ConfigAsyncCB *>(cb_data);
     char *status;
 
     status = mh_sysconfig_is_configured(action_data->key.c_str());
@@ -107,6 +122,24 @@ AsyncCB::result_cb(void *cb_data, int res)
     delete action_data;
 }
 
+/*
+ * Loading the augeas tree can take a while, so queries are handed to the
+ * worker pool.
+ */
+static enum mh_result
+query(qpid::types::Variant::Map &args, qpid::types::Variant::Map &results,
+      void *userdata)
+{
+    char *data = NULL;
+
+    data = mh_sysconfig_query(args["text"].asString().c_str(),
+                              args["flags"].asUint32(),
+                              args["scheme"].asString().c_str());
+    results["data"] = data ? data : "unknown";
+    free(data);
+    return MH_RES_SUCCESS;
+}
+
 gboolean
 ConfigAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event, gpointer user_data)
 {
@@ -121,19 +154,19 @@ ConfigAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event, gpointer u
     qpid::types::Variant::Map& args = event.getArguments();
 
     if (methodName == "run_uri" || methodName == "run_string") {
-        AsyncCB *action_data = new AsyncCB(args["key"].asString(), event, session);
+        ConfigAsyncCB *action_data = new ConfigAsyncCB(args["key"].asString(), event, session);
         mh_result res;
 
         if (methodName == "run_uri")
             res = mh_sysconfig_run_uri(args["uri"].asString().c_str(),
                 args["flags"].asUint32(),
                 args["scheme"].asString().c_str(),
-                args["key"].asString().c_str(), AsyncCB::result_cb, action_data);
+                args["key"].asString().c_str(), ConfigAsyncCB::result_cb, action_data);
         else
             res = mh_sysconfig_run_string(args["text"].asString().c_str(),
                 args["flags"].asUint32(),
                 args["scheme"].asString().c_str(),
-                args["key"].asString().c_str(), AsyncCB::result_cb, action_data);
+                args["key"].asString().c_str(), ConfigAsyncCB::result_cb, action_data);
 
 
         if (res == MH_RES_SUCCESS) {
@@ -144,12 +177,8 @@ ConfigAgent::invoke(qmf::AgentSession session, qmf::AgentEvent event, gpointer u
             goto bail;
         }
     } else if (methodName == "query") {
-        char *data = NULL;
-        data = mh_sysconfig_query(args["text"].asString().c_str(),
-                                  args["flags"].asUint32(),
-                                  args["scheme"].asString().c_str());
-        event.addReturnArgument("data", data ? data : "unknown");
-        free(data);
+        runBlocking(session, event, query, NULL);
+        goto bail;
     } else if (methodName == "is_configured") {
         status = mh_sysconfig_is_configured(args["key"].asString().c_str());
         event.addReturnArgument("status", status ? status : "unknown");
@@ -107,6 +107,19 @@ class MhApiHostSuite : public CxxTest::TestSuite
         infomsg.str("");
     }
 
+    void testCpuFeatures(void)
+    {
+        infomsg << "Verify isa level: " << mh_host_get_isa_level();
+        TS_TRACE(infomsg.str());
+#if defined(__x86_64__)
+        TS_ASSERT((mh_test_is_match("^x86-64(-v[234])?$", mh_host_get_isa_level())) >= 0);
+        TS_ASSERT(mh_host_has_cpu_feature("sse2"));
+#endif
+        TS_ASSERT(!mh_host_has_cpu_feature("no_such_feature"));
+        TS_ASSERT(!mh_host_has_cpu_feature(""));
+        infomsg.str("");
+    }
+
     void testCpuCount(void)
     {
         infomsg << "Verify cpu count: " << mh_host_get_cpu_count();
@@ -163,6 +176,273 @@ class MhApiHostSuite : public CxxTest::TestSuite
         infomsg.str("");
     }
 
+    void testSnapshot(void)
+    {
+        struct mh_host_snapshot snapshot;
+
+        TS_ASSERT(mh_host_get_snapshot(&snapshot) == MH_RES_SUCCESS);
+
+        infomsg << "Verify snapshot: " << snapshot.mem_free << "/"
+                << snapshot.mem_total << " kb free, "
+                << snapshot.procs.total << " processes";
+        TS_TRACE(infomsg.str());
+        TS_ASSERT(snapshot.timestamp > 0);
+        TS_ASSERT(snapshot.mem_total == mh_host_get_memory());
+        TS_ASSERT(snapshot.mem_free > 0);
+        TS_ASSERT(snapshot.mem_free <= snapshot.mem_total);
+        TS_ASSERT(snapshot.swap_free <= snapshot.swap_total);
+        TS_ASSERT(snapshot.procs.total > 0);
+        TS_ASSERT(snapshot.procs.running <= snapshot.procs.total);
+        infomsg.str("");
+    }
+
+    void testCpuUtilization(void)
+    {
+        struct mh_host_cpu_utilization total;
+        int ncpus = mh_host_get_cpu_count();
+        struct mh_host_cpu_utilization *cpus =
+            (struct mh_host_cpu_utilization *) g_new0(struct mh_host_cpu_utilization, ncpus);
+        double sum;
+
+        TS_ASSERT(mh_host_get_cpu_utilization(&total, cpus, ncpus) == MH_RES_SUCCESS);
+        g_usleep(G_USEC_PER_SEC / 10);
+        TS_ASSERT(mh_host_get_cpu_utilization(&total, cpus, ncpus) == MH_RES_SUCCESS);
+
+        sum = total.user + total.system + total.iowait + total.steal + total.idle;
+        infomsg << "Verify cpu utilization: " << total.user << "% user, "
+                << total.idle << "% idle";
+        TS_TRACE(infomsg.str());
+        TS_ASSERT_DELTA(sum, 100.0, 0.01);
+        TS_ASSERT(cpus[ncpus - 1].user + cpus[ncpus - 1].idle <= 100.01);
+        infomsg.str("");
+
+        g_free(cpus);
+    }
+
+    void testTopology(void)
+    {
+        const struct mh_host_topology *topology = mh_host_get_topology();
+        uint64_t *free_mem;
+        uint64_t memory = 0;
+        unsigned int lpc;
+
+        infomsg << "Verify topology: " << topology->sockets << " sockets, "
+                << topology->cores << " cores, " << topology->threads
+                << " threads, " << topology->nnodes << " NUMA nodes";
+        TS_TRACE(infomsg.str());
+        TS_ASSERT(topology->sockets >= 1);
+        TS_ASSERT(topology->cores >= topology->sockets);
+        TS_ASSERT(topology->threads >= topology->cores);
+        TS_ASSERT((int) topology->threads == mh_host_get_cpu_count());
+        TS_ASSERT(topology->nnodes >= 1);
+        infomsg.str("");
+
+        for (lpc = 0; lpc < topology->nnodes; lpc++) {
+            memory += topology->nodes[lpc].memory;
+        }
+        TS_ASSERT(memory <= mh_host_get_memory() * 11 / 10);
+
+        free_mem = g_new0(uint64_t, topology->nnodes);
+        TS_ASSERT(mh_host_get_numa_free_mem(free_mem, topology->nnodes) == MH_RES_SUCCESS);
+        TS_ASSERT(free_mem[0] <= topology->nodes[0].memory);
+        g_free(free_mem);
+
+        TS_ASSERT(mh_host_get_topology() == topology);
+    }
+
+    void testDiskIO(void)
+    {
+        struct mh_host_disks *disks = mh_host_disks_new(0);
+        const struct mh_host_disk_io *io;
+        unsigned int count, all, lpc;
+
+        TS_ASSERT(mh_host_disks_update(disks, &io, &count) == MH_RES_SUCCESS);
+        g_usleep(G_USEC_PER_SEC / 10);
+        TS_ASSERT(mh_host_disks_update(disks, &io, &count) == MH_RES_SUCCESS);
+
+        for (lpc = 0; lpc < count; lpc++) {
+            TS_ASSERT(strncmp(io[lpc].name, "loop", 4) != 0);
+            TS_ASSERT(io[lpc].reads >= 0 && io[lpc].writes >= 0);
+            TS_ASSERT(io[lpc].await >= 0);
+        }
+        mh_host_disks_free(disks);
+
+        disks = mh_host_disks_new(MH_HOST_DISK_PARTITIONS | MH_HOST_DISK_VIRTUAL);
+        TS_ASSERT(mh_host_disks_update(disks, &io, &all) == MH_RES_SUCCESS);
+        TS_ASSERT(all >= count);
+        mh_host_disks_free(disks);
+    }
+
+    void testFilesystems(void)
+    {
+        struct mh_host_filesystems *filesystems = mh_host_filesystems_new(1000);
+        const struct mh_host_filesystem *list;
+        unsigned int count, lpc;
+
+        TS_ASSERT(mh_host_filesystems_update(filesystems, &list, &count) == MH_RES_SUCCESS);
+        for (lpc = 0; lpc < count; lpc++) {
+            infomsg << "Verify filesystem " << list[lpc].mount_point << ": "
+                    << list[lpc].avail << " of " << list[lpc].size << " kb";
+            TS_TRACE(infomsg.str());
+            infomsg.str("");
+
+            if (!list[lpc].stale) {
+                TS_ASSERT(list[lpc].avail <= list[lpc].free);
+                TS_ASSERT(list[lpc].free <= list[lpc].size);
+                TS_ASSERT(list[lpc].inodes_free <= list[lpc].inodes);
+            }
+        }
+
+        /* Nothing was mounted, the same filesystems are found again */
+        TS_ASSERT(mh_host_filesystems_update(filesystems, &list, &lpc) == MH_RES_SUCCESS);
+        TS_ASSERT(lpc == count);
+        mh_host_filesystems_free(filesystems);
+    }
+
+    void testTopProcesses(void)
+    {
+        struct mh_host_processes *processes = mh_host_processes_new();
+        struct mh_host_process top[3];
+        enum mh_host_process_sort sort;
+        unsigned int count, lpc;
+
+        TS_ASSERT(mh_host_processes_update(processes) == MH_RES_SUCCESS);
+        g_usleep(G_USEC_PER_SEC / 10);
+        TS_ASSERT(mh_host_processes_update(processes) == MH_RES_SUCCESS);
+
+        count = mh_host_processes_top(processes, MH_HOST_PROCESS_RSS, top, 3);
+        TS_ASSERT(count > 0);
+        for (lpc = 1; lpc < count; lpc++) {
+            TS_ASSERT(top[lpc - 1].rss >= top[lpc].rss);
+        }
+
+        count = mh_host_processes_top(processes, MH_HOST_PROCESS_CPU, top, 3);
+        for (lpc = 1; lpc < count; lpc++) {
+            TS_ASSERT(top[lpc - 1].cpu >= top[lpc].cpu);
+        }
+        mh_host_processes_free(processes);
+
+        TS_ASSERT(mh_host_process_sort_from_name("rss", &sort) == MH_RES_SUCCESS);
+        TS_ASSERT(sort == MH_HOST_PROCESS_RSS);
+        TS_ASSERT(mh_host_process_sort_from_name("bogus", &sort) == MH_RES_INVALID_ARGS);
+    }
+
+    void testPressure(void)
+    {
+        struct mh_host_pressure_triggers *triggers;
+        struct mh_host_pressure pressure;
+        enum mh_result res;
+
+        res = mh_host_get_pressure(MH_HOST_PRESSURE_MEMORY, &pressure);
+        TS_ASSERT(res == MH_RES_SUCCESS || res == MH_RES_NOT_IMPLEMENTED);
+        if (res == MH_RES_SUCCESS) {
+            TS_ASSERT(pressure.some.avg10 >= 0.0 && pressure.some.avg10 <= 100.0);
+            TS_ASSERT(pressure.full.avg300 <= pressure.some.avg300 + 0.01);
+        }
+        TS_ASSERT(!strcmp(mh_host_pressure_resource_name(MH_HOST_PRESSURE_IO), "io"));
+
+        /* Invalid rules are refused before reaching the kernel */
+        triggers = mh_host_pressure_triggers_new(NULL, NULL);
+        TS_ASSERT(mh_host_pressure_triggers_add(triggers, "t", "disk some 1ms per 1s")
+                  == MH_RES_INVALID_ARGS);
+        TS_ASSERT(mh_host_pressure_triggers_add(triggers, "t", "memory some 2s per 1s")
+                  == MH_RES_INVALID_ARGS);
+        TS_ASSERT(mh_host_pressure_triggers_add(triggers, "t", "memory some 150ms")
+                  == MH_RES_INVALID_ARGS);
+        TS_ASSERT(mh_host_pressure_triggers_count(triggers) == 0);
+        TS_ASSERT(mh_host_pressure_triggers_remove(triggers, "t") == MH_RES_INVALID_ARGS);
+        mh_host_pressure_triggers_free(triggers);
+    }
+
+    void testHistory(void)
+    {
+        struct mh_host_history *history = mh_host_history_new(10);
+        struct mh_host_history_bucket buckets[10];
+        struct mh_host_snapshot snapshot;
+        unsigned int lpc, count;
+
+        memset(&snapshot, 0, sizeof(snapshot));
+
+        /* 25 samples, 5s apart, of which the last 10 are kept */
+        for (lpc = 0; lpc < 25; lpc++) {
+            snapshot.timestamp = 1000 + lpc * 5;
+            snapshot.mem_free = lpc;
+            mh_host_history_add(history, &snapshot, NULL);
+        }
+        TS_ASSERT(mh_host_history_count(history) == 10);
+
+        count = mh_host_history_query(history, MH_HOST_HISTORY_FREE_MEM,
+                                      0, 20, buckets, 10);
+        TS_ASSERT(count == 4);
+        TS_ASSERT(buckets[0].start == 1060);
+        TS_ASSERT(buckets[0].samples == 1);
+        TS_ASSERT(buckets[1].start == 1080);
+        TS_ASSERT(buckets[1].samples == 4);
+        TS_ASSERT_DELTA(buckets[1].min, 16.0, 0.001);
+        TS_ASSERT_DELTA(buckets[1].avg, 17.5, 0.001);
+        TS_ASSERT_DELTA(buckets[1].max, 19.0, 0.001);
+
+        count = mh_host_history_query(history, MH_HOST_HISTORY_FREE_MEM,
+                                      1100, 1, buckets, 2);
+        TS_ASSERT(count == 2);
+        TS_ASSERT(buckets[0].start == 1100);
+
+        TS_ASSERT(mh_host_history_field_from_name("load.5") == MH_HOST_HISTORY_LOAD_5);
+        TS_ASSERT(mh_host_history_field_from_name("bogus") == MH_HOST_HISTORY_FIELDS);
+
+        mh_host_history_free(history);
+    }
+
+    static void alertChanged(const struct mh_host_alert *alert, double value,
+                             void *userdata)
+    {
+        (*(int *) userdata)++;
+    }
+
+    void testAlerts(void)
+    {
+        struct mh_host_alerts *alerts = mh_host_alerts_new();
+        struct mh_host_snapshot snapshot;
+        int changes = 0;
+
+        TS_ASSERT(mh_host_alerts_add(alerts, "load", "load.1 > 2", 10, 10) == MH_RES_SUCCESS);
+        TS_ASSERT(mh_host_alerts_add(alerts, "bogus", "bogus > 2", 10, 0) == MH_RES_INVALID_ARGS);
+        TS_ASSERT(mh_host_alerts_add(alerts, "unit", "load.1 > 2%", 10, 0) == MH_RES_INVALID_ARGS);
+        TS_ASSERT(mh_host_alerts_count(alerts) == 1);
+
+        memset(&snapshot, 0, sizeof(snapshot));
+
+        /* Must stay above the threshold for the hold time */
+        snapshot.timestamp = 100;
+        snapshot.loadavg[0] = 3.0;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        TS_ASSERT(changes == 0);
+        snapshot.timestamp = 110;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        TS_ASSERT(changes == 1);
+        TS_ASSERT(mh_host_alerts_get(alerts, 0)->active);
+
+        /* Within the hysteresis band, nothing changes */
+        snapshot.timestamp = 200;
+        snapshot.loadavg[0] = 1.9;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        snapshot.timestamp = 300;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        TS_ASSERT(changes == 1);
+
+        snapshot.loadavg[0] = 1.0;
+        snapshot.timestamp = 310;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        snapshot.timestamp = 320;
+        mh_host_alerts_check(alerts, &snapshot, NULL, alertChanged, &changes);
+        TS_ASSERT(changes == 2);
+        TS_ASSERT(!mh_host_alerts_get(alerts, 0)->active);
+
+        TS_ASSERT(mh_host_alerts_remove(alerts, "load") == MH_RES_SUCCESS);
+        TS_ASSERT(mh_host_alerts_remove(alerts, "load") == MH_RES_INVALID_ARGS);
+        mh_host_alerts_free(alerts);
+    }
+
     void testPowerManagement(void)
     {
         char *original, *newProfile;